@@ -140,6 +140,10 @@ ifeq ($(KERNELFLINGER_SUPPORT_KEYBOX_PROVISION),true)
     KERNELFLINGER_CFLAGS += -DFASTBOOT_KEYBOX_PROVISION
 endif
 
+ifeq ($(KERNELFLINGER_USE_BOOT_TRACE),true)
+    KERNELFLINGER_CFLAGS += -DUSE_BOOT_TRACE
+endif
+
 KERNELFLINGER_STATIC_LIBRARIES := \
 	libuefi_ssl_static \
 	libuefi_crypto_static \
@@ -0,0 +1,304 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdio.h>
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+#include <gpt.h>
+
+#include "libavb.h"
+#define AVB_COMPILATION
+#include "avb_rsa.h"
+#include "avb_sha.h"
+#undef AVB_COMPILATION
+
+#include "kfbench.h"
+#include "rsa_vector.h"
+
+#define MAX_PARTITIONS	8
+
+struct hash_ctx {
+	UINT8 *data;
+	UINTN size;
+};
+
+struct verify_ctx {
+	AvbOps *ops;
+	const char *partitions[MAX_PARTITIONS + 1];
+	const char *suffix;
+};
+
+/*
+ * Hashes and RSA
+ */
+static EFI_STATUS sha256(VOID *ctx)
+{
+	struct hash_ctx *hash = ctx;
+	AvbSHA256Ctx sha;
+
+	avb_sha256_init(&sha);
+	avb_sha256_update(&sha, hash->data, hash->size);
+	return avb_sha256_final(&sha) ? EFI_SUCCESS : EFI_ABORTED;
+}
+
+static EFI_STATUS sha512(VOID *ctx)
+{
+	struct hash_ctx *hash = ctx;
+	AvbSHA512Ctx sha;
+
+	avb_sha512_init(&sha);
+	avb_sha512_update(&sha, hash->data, hash->size);
+	return avb_sha512_final(&sha) ? EFI_SUCCESS : EFI_ABORTED;
+}
+
+static EFI_STATUS rsa4096_verify(__attribute__((__unused__)) VOID *ctx)
+{
+	const AvbAlgorithmData *algo;
+
+	algo = avb_get_algorithm_data(AVB_ALGORITHM_TYPE_SHA256_RSA4096);
+	if (!algo)
+		return EFI_UNSUPPORTED;
+
+	if (!avb_rsa_verify(rsa_vector_key, sizeof(rsa_vector_key),
+			    rsa_vector_sig, sizeof(rsa_vector_sig),
+			    rsa_vector_digest, sizeof(rsa_vector_digest),
+			    algo->padding, algo->padding_len))
+		return EFI_SECURITY_VIOLATION;
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS bench_avb_hash(UINTN size)
+{
+	struct hash_ctx hash = { .size = size };
+
+	hash.data = AllocatePool(size);
+	if (!hash.data)
+		return EFI_OUT_OF_RESOURCES;
+	bench_fill_random(hash.data, size, 0xa7b);
+
+	bench_run("avb_sha256", size, sha256, &hash);
+	bench_run("avb_sha512", size, sha512, &hash);
+	bench_run("avb_rsa4096_verify", 0, rsa4096_verify, NULL);
+
+	FreePool(hash.data);
+	return EFI_SUCCESS;
+}
+
+/*
+ * avb_slot_verify() on top of the shim disk.  Only the operations
+ * the verification needs are implemented: the disk is never written,
+ * every key is trusted and the rollback indexes are zero.
+ */
+static AvbIOResult find_partition(const char *name, struct gpt_partition_interface *gpart,
+				  UINT64 *size)
+{
+	CHAR16 *label;
+	EFI_STATUS ret;
+
+	label = stra_to_str((const CHAR8 *)name);
+	if (!label)
+		return AVB_IO_RESULT_ERROR_OOM;
+
+	ret = gpt_get_partition_by_label(label, gpart, LOGICAL_UNIT_USER);
+	FreePool(label);
+	if (EFI_ERROR(ret))
+		return AVB_IO_RESULT_ERROR_NO_SUCH_PARTITION;
+
+	*size = (gpart->part.ending_lba - gpart->part.starting_lba + 1) *
+		gpart->bio->Media->BlockSize;
+	return AVB_IO_RESULT_OK;
+}
+
+static AvbIOResult read_from_partition(__attribute__((__unused__)) AvbOps *ops,
+				       const char *partition, int64_t offset,
+				       size_t num_bytes, void *buffer,
+				       size_t *out_num_read)
+{
+	struct gpt_partition_interface gpart;
+	AvbIOResult res;
+	EFI_STATUS ret;
+	UINT64 size;
+
+	res = find_partition(partition, &gpart, &size);
+	if (res != AVB_IO_RESULT_OK)
+		return res;
+
+	if (offset < 0) {
+		if ((UINT64)-offset > size)
+			return AVB_IO_RESULT_ERROR_RANGE_OUTSIDE_PARTITION;
+		offset += size;
+	}
+	if ((UINT64)offset > size)
+		return AVB_IO_RESULT_ERROR_RANGE_OUTSIDE_PARTITION;
+
+	*out_num_read = min((UINT64)num_bytes, size - offset);
+	ret = uefi_call_wrapper(gpart.dio->ReadDisk, 5, gpart.dio,
+				gpart.bio->Media->MediaId,
+				gpart.part.starting_lba * gpart.bio->Media->BlockSize + offset,
+				*out_num_read, buffer);
+	if (EFI_ERROR(ret)) {
+		*out_num_read = 0;
+		return AVB_IO_RESULT_ERROR_IO;
+	}
+
+	return AVB_IO_RESULT_OK;
+}
+
+static AvbIOResult write_to_partition(__attribute__((__unused__)) AvbOps *ops,
+				      __attribute__((__unused__)) const char *partition,
+				      __attribute__((__unused__)) int64_t offset,
+				      __attribute__((__unused__)) size_t num_bytes,
+				      __attribute__((__unused__)) const void *buffer)
+{
+	return AVB_IO_RESULT_ERROR_IO;
+}
+
+static AvbIOResult validate_vbmeta_public_key(__attribute__((__unused__)) AvbOps *ops,
+					      __attribute__((__unused__)) const uint8_t *key,
+					      __attribute__((__unused__)) size_t key_length,
+					      __attribute__((__unused__)) const uint8_t *metadata,
+					      __attribute__((__unused__)) size_t metadata_length,
+					      bool *out_is_trusted)
+{
+	*out_is_trusted = true;
+	return AVB_IO_RESULT_OK;
+}
+
+static AvbIOResult read_rollback_index(__attribute__((__unused__)) AvbOps *ops,
+				       __attribute__((__unused__)) size_t location,
+				       uint64_t *out_rollback_index)
+{
+	*out_rollback_index = 0;
+	return AVB_IO_RESULT_OK;
+}
+
+static AvbIOResult write_rollback_index(__attribute__((__unused__)) AvbOps *ops,
+					__attribute__((__unused__)) size_t location,
+					__attribute__((__unused__)) uint64_t rollback_index)
+{
+	return AVB_IO_RESULT_OK;
+}
+
+static AvbIOResult read_is_device_unlocked(__attribute__((__unused__)) AvbOps *ops,
+					   bool *out_is_unlocked)
+{
+	*out_is_unlocked = false;
+	return AVB_IO_RESULT_OK;
+}
+
+static AvbIOResult get_unique_guid_for_partition(__attribute__((__unused__)) AvbOps *ops,
+						 const char *partition,
+						 char *guid_buf, size_t guid_buf_size)
+{
+	struct gpt_partition_interface gpart;
+	EFI_GUID *g = &gpart.part.unique;
+	AvbIOResult res;
+	UINT64 size;
+
+	res = find_partition(partition, &gpart, &size);
+	if (res != AVB_IO_RESULT_OK)
+		return res;
+
+	if (guid_buf_size < 37)
+		return AVB_IO_RESULT_ERROR_INSUFFICIENT_SPACE;
+
+	snprintf(guid_buf, guid_buf_size,
+		 "%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+		 g->Data1, g->Data2, g->Data3, g->Data4[0], g->Data4[1],
+		 g->Data4[2], g->Data4[3], g->Data4[4], g->Data4[5],
+		 g->Data4[6], g->Data4[7]);
+	return AVB_IO_RESULT_OK;
+}
+
+static AvbIOResult get_size_of_partition(__attribute__((__unused__)) AvbOps *ops,
+					 const char *partition, uint64_t *out_size)
+{
+	struct gpt_partition_interface gpart;
+
+	return find_partition(partition, &gpart, out_size);
+}
+
+static EFI_STATUS slot_verify(VOID *ctx)
+{
+	struct verify_ctx *verify = ctx;
+	AvbSlotVerifyData *data = NULL;
+	AvbSlotVerifyResult res;
+
+	res = avb_slot_verify(verify->ops, verify->partitions, verify->suffix,
+			      AVB_SLOT_VERIFY_FLAGS_NONE,
+			      AVB_HASHTREE_ERROR_MODE_RESTART_AND_INVALIDATE,
+			      &data);
+	if (data)
+		avb_slot_verify_data_free(data);
+
+	if (res != AVB_SLOT_VERIFY_RESULT_OK) {
+		fprintf(stderr, "avb_slot_verify: %s\n",
+			avb_slot_verify_result_to_string(res));
+		return EFI_SECURITY_VIOLATION;
+	}
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS bench_avb_slot_verify(const char *partitions, const char *suffix)
+{
+	AvbOps ops = {
+		.read_from_partition = read_from_partition,
+		.write_to_partition = write_to_partition,
+		.validate_vbmeta_public_key = validate_vbmeta_public_key,
+		.read_rollback_index = read_rollback_index,
+		.write_rollback_index = write_rollback_index,
+		.read_is_device_unlocked = read_is_device_unlocked,
+		.get_unique_guid_for_partition = get_unique_guid_for_partition,
+		.get_size_of_partition = get_size_of_partition
+	};
+	struct verify_ctx verify = { .ops = &ops, .suffix = suffix };
+	char *list, *name, *saveptr;
+	EFI_STATUS ret;
+	UINTN nb = 0;
+
+	list = (char *)strdup(partitions);
+	if (!list)
+		return EFI_OUT_OF_RESOURCES;
+
+	for (name = strtok_r(list, ",", &saveptr); name && nb < MAX_PARTITIONS;
+	     name = strtok_r(NULL, ",", &saveptr))
+		verify.partitions[nb++] = name;
+	verify.partitions[nb] = NULL;
+
+	ret = bench_run("avb_slot_verify", 0, slot_verify, &verify);
+
+	FreePool(list);
+	return ret;
+}
@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2019, Intel Corporation
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+#
+#    * Redistributions of source code must retain the above copyright
+#      notice, this list of conditions and the following disclaimer.
+#    * Redistributions in binary form must reproduce the above copyright
+#      notice, this list of conditions and the following disclaimer
+#      in the documentation and/or other materials provided with the
+#      distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+# "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+# LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+# FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+# COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+# INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+# STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+# OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+
+"""Generate the RSA-4096/SHA-256 test vector used by kfbench to time
+avb_rsa_verify() in isolation.
+
+The key is derived from a fixed seed so that the generated header,
+and therefore the benchmark, is identical from one build to the
+other.  The key format is the AvbRSAPublicKeyHeader one, see
+avb/libavb/avb_crypto.h."""
+
+import hashlib
+import random
+import struct
+import sys
+
+KEY_BITS = 4096
+EXPONENT = 65537
+SEED = 0x6b66
+MESSAGE = b'kernelflinger benchmark'
+
+# PKCS#1 v1.5 DigestInfo prefix for SHA-256.
+SHA256_DIGEST_INFO = bytes.fromhex('3031300d060960864801650304020105000420')
+
+
+SMALL_PRIMES = [p for p in range(3, 8192, 2)
+                if all(p % d for d in range(3, int(p ** 0.5) + 1, 2))]
+
+
+def is_probable_prime(n, rng, rounds=40):
+    for p in SMALL_PRIMES:
+        if n % p == 0:
+            return n == p
+    d, r = n - 1, 0
+    while d % 2 == 0:
+        d //= 2
+        r += 1
+    for _ in range(rounds):
+        x = pow(rng.randrange(2, n - 1), d, n)
+        if x in (1, n - 1):
+            continue
+        for _ in range(r - 1):
+            x = pow(x, 2, n)
+            if x == n - 1:
+                break
+        else:
+            return False
+    return True
+
+
+def generate_prime(bits, rng):
+    while True:
+        p = rng.getrandbits(bits) | (3 << (bits - 2)) | 1
+        if (p - 1) % EXPONENT and is_probable_prime(p, rng):
+            return p
+
+
+def c_array(name, data):
+    lines = ['static const uint8_t %s[] = {' % name]
+    for i in range(0, len(data), 12):
+        lines.append('\t' + ' '.join('0x%02x,' % b for b in data[i:i + 12]))
+    lines.append('};')
+    return '\n'.join(lines)
+
+
+def main(argv):
+    if len(argv) != 2:
+        sys.stderr.write('Usage: %s OUTPUT_HEADER\n' % argv[0])
+        return 1
+
+    rng = random.Random(SEED)
+    while True:
+        p = generate_prime(KEY_BITS // 2, rng)
+        q = generate_prime(KEY_BITS // 2, rng)
+        n = p * q
+        if p != q and n.bit_length() == KEY_BITS:
+            break
+    d = pow(EXPONENT, -1, (p - 1) * (q - 1))
+
+    num_bytes = KEY_BITS // 8
+    n0inv = (-pow(n, -1, 1 << 32)) % (1 << 32)
+    rr = pow(2, 2 * KEY_BITS, n)
+    key = struct.pack('>II', KEY_BITS, n0inv) + \
+        n.to_bytes(num_bytes, 'big') + rr.to_bytes(num_bytes, 'big')
+
+    digest = hashlib.sha256(MESSAGE).digest()
+    suffix = SHA256_DIGEST_INFO + digest
+    em = b'\x00\x01' + b'\xff' * (num_bytes - len(suffix) - 3) + b'\x00' + suffix
+    sig = pow(int.from_bytes(em, 'big'), d, n).to_bytes(num_bytes, 'big')
+
+    with open(argv[1], 'w') as f:
+        f.write('/* Do not modify this auto-generated file. */\n\n')
+        f.write(c_array('rsa_vector_key', key) + '\n\n')
+        f.write(c_array('rsa_vector_sig', sig) + '\n\n')
+        f.write(c_array('rsa_vector_digest', digest) + '\n')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
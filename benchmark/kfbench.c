@@ -0,0 +1,1154 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+#include <gpt.h>
+#include <blobstore.h>
+#include <oemvars.h>
+#include <text_parser.h>
+#include <upng.h>
+#include <sparse_format.h>
+
+#include "flash.h"
+#include "flash_jobs.h"
+#include "sparse.h"
+#include "shim.h"
+#include "kfbench.h"
+
+#ifndef KFBENCH_IMAGE
+#define KFBENCH_IMAGE	NULL
+#endif
+
+#define MiB			(1024 * 1024)
+#define DISK_BLOCK_SIZE		512
+#define DISK_ALIGN		MiB
+#define SPARSE_BLOCK_SIZE	4096
+#define SPARSE_SIZE		(64 * MiB)
+#define FILL_BUFFER_SIZE	MiB
+#define HASH_SIZE		(16 * MiB)
+#define BLOBSTORE_ITEMS		128
+#define BLOBSTORE_HASHMAP_SIZE	61
+#define BLOBSTORE_ITEM_SIZE	256
+#define OEMVARS_COUNT		256
+#define JOBS_PART_SIZE		(4 * MiB)
+#define JOBS_WRITE_SIZE		(64 * 1024)
+#define JOBS_MAX_CTX		8
+#define MAX_RESULTS		32
+
+static const struct {
+	const CHAR16 *label;
+	UINT64 size;		/* MiB */
+} PARTITIONS[] = {
+	{ L"bootloader",	30 },
+	{ L"bootloader2",	30 },
+	{ L"misc",		1 },
+	{ L"metadata",		16 },
+	{ L"persistent",	1 },
+	{ L"frp",		1 },
+	{ L"teedata",		8 },
+	{ L"vbmeta",		1 },
+	{ L"tos",		10 },
+	{ L"acpio",		2 },
+	{ L"boot",		64 },
+	{ L"recovery",		64 },
+	{ L"vendor",		64 },
+	{ L"config",		16 },
+	{ L"factory",		10 },
+	{ L"cache",		64 },
+	{ L"system",		128 },
+	{ L"userdata",		64 }
+};
+
+struct result {
+	char name[32];
+	double min;
+	double median;
+	double mean;
+};
+
+/* Blobstore on-disk layout, see blobstore.c */
+struct blob_metablock {
+	char blob_key[64];
+	unsigned int blob_type;
+	unsigned int next_item_offset;
+	unsigned int data_offset;
+	unsigned int data_size;
+} __attribute__((packed));
+
+struct blob_header {
+	char magic[8];
+	unsigned int version;
+	unsigned int total_size;
+	unsigned int hashmap_sz;
+} __attribute__((packed));
+
+unsigned int hash_blob_key(char *key, enum blobtype type, unsigned int hsize);
+
+struct buffer {
+	VOID *data;
+	UINTN size;
+};
+
+static UINTN iterations = 20;
+static struct result results[MAX_RESULTS];
+static UINTN nb_results;
+static UINTN nb_failures;
+
+static char disk_path[] = "/tmp/kfbench-disk-XXXXXX";
+static BOOLEAN synthetic_disk;
+static struct gpt_partition_interface flash_part;
+static UINT64 flash_offset;
+
+/*
+ * Runner
+ */
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double elapsed_usec(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e6 +
+		(end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+EFI_STATUS bench_run(const char *name, UINT64 bytes, bench_fn_t fn, VOID *ctx)
+{
+	struct timespec start, end;
+	struct result *res;
+	double *samples, total = 0;
+	EFI_STATUS ret;
+	UINTN i;
+
+	samples = malloc(iterations * sizeof(*samples));
+	if (!samples)
+		return EFI_OUT_OF_RESOURCES;
+
+	/* The first run faults the buffers in and warms the caches
+	 * up, it is not accounted. */
+	ret = fn(ctx);
+	for (i = 0; !EFI_ERROR(ret) && i < iterations; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		ret = fn(ctx);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		samples[i] = elapsed_usec(&start, &end);
+		total += samples[i];
+	}
+	if (EFI_ERROR(ret)) {
+		fprintf(stderr, "%s: failed with status 0x%lx\n", name, (unsigned long)ret);
+		nb_failures++;
+		goto out;
+	}
+
+	qsort(samples, iterations, sizeof(*samples), compare_double);
+
+	if (nb_results < MAX_RESULTS) {
+		res = &results[nb_results++];
+		snprintf(res->name, sizeof(res->name), "%s", name);
+		res->min = samples[0];
+		res->median = samples[iterations / 2];
+		res->mean = total / iterations;
+	}
+
+	printf("%-24s %6lu %12.1f %12.1f %12.1f", name, (unsigned long)iterations,
+	       samples[0], samples[iterations / 2], total / iterations);
+	if (bytes)
+		printf(" %10.1f\n", bytes / samples[iterations / 2]);
+	else
+		printf(" %10s\n", "-");
+
+out:
+	free(samples);
+	return ret;
+}
+
+void bench_fill_random(VOID *buf, UINTN size, UINT32 seed)
+{
+	UINT8 *p = buf;
+	UINT32 x = seed ? seed : 0x2545f491;
+
+	while (size--) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		*p++ = x;
+	}
+}
+
+static UINT32 random_range(UINT32 *state, UINT32 min, UINT32 max)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return min + *state % (max - min + 1);
+}
+
+/* Compare the results against a previous run of this program and
+ * report every benchmark whose median got slower than THRESHOLD
+ * percent. */
+static int compare_baseline(const char *path, double threshold)
+{
+	char line[256], name[32];
+	unsigned long iters;
+	double min, median, mean, limit;
+	int regressions = 0;
+	FILE *f;
+	UINTN i;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' ||
+		    sscanf(line, "%31s %lu %lf %lf %lf", name, &iters,
+			   &min, &median, &mean) != 5)
+			continue;
+
+		for (i = 0; i < nb_results; i++) {
+			if (strcmp((CHAR8 *)results[i].name, (CHAR8 *)name))
+				continue;
+			limit = median * (1 + threshold / 100);
+			if (results[i].median > limit) {
+				printf("REGRESSION %s: median %.1f us, baseline %.1f us (+%.1f%%)\n",
+				       name, results[i].median, median,
+				       (results[i].median / median - 1) * 100);
+				regressions++;
+			}
+			break;
+		}
+	}
+
+	fclose(f);
+	return regressions;
+}
+
+static EFI_STATUS read_file(const char *path, struct buffer *buf)
+{
+	FILE *f;
+	long size;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return EFI_NOT_FOUND;
+
+	if (fseek(f, 0, SEEK_END) || (size = ftell(f)) <= 0 ||
+	    fseek(f, 0, SEEK_SET)) {
+		fclose(f);
+		return EFI_LOAD_ERROR;
+	}
+
+	buf->data = AllocatePool(size);
+	buf->size = size;
+	if (buf->data && fread(buf->data, 1, size, f) != (size_t)size) {
+		FreePool(buf->data);
+		buf->data = NULL;
+	}
+	fclose(f);
+
+	return buf->data ? EFI_SUCCESS : EFI_LOAD_ERROR;
+}
+
+/*
+ * Synthetic disk: a GPT with the usual Android partitions on top of a
+ * sparse file.
+ */
+static EFI_STATUS write_gpt(int fd, UINT64 last_lba, UINT64 entries_lba, UINT64 my_lba,
+			    UINT64 alternate_lba, struct gpt_partition *entries,
+			    UINTN entries_size, EFI_GUID *disk_uuid)
+{
+	struct gpt_header gh;
+	UINT8 block[DISK_BLOCK_SIZE];
+
+	memset(&gh, 0, sizeof(gh));
+	memcpy(gh.signature, EFI_PTAB_HEADER_ID, sizeof(gh.signature));
+	gh.revision = 0x00010000;
+	gh.size = sizeof(gh);
+	gh.my_lba = my_lba;
+	gh.alternate_lba = alternate_lba;
+	gh.first_usable_lba = 2 + entries_size / DISK_BLOCK_SIZE;
+	gh.last_usable_lba = last_lba - 1 - entries_size / DISK_BLOCK_SIZE;
+	gh.disk_uuid = *disk_uuid;
+	gh.entries_lba = entries_lba;
+	gh.number_of_entries = GPT_ENTRIES;
+	gh.size_of_entry = GPT_ENTRY_SIZE;
+	gh.entries_crc32 = shim_crc32(entries, entries_size);
+	gh.header_crc32 = shim_crc32(&gh, sizeof(gh));
+
+	memset(block, 0, sizeof(block));
+	memcpy(block, &gh, sizeof(gh));
+
+	if (pwrite(fd, entries, entries_size, entries_lba * DISK_BLOCK_SIZE) != (ssize_t)entries_size ||
+	    pwrite(fd, block, sizeof(block), my_lba * DISK_BLOCK_SIZE) != sizeof(block))
+		return EFI_DEVICE_ERROR;
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS create_disk(void)
+{
+	static const EFI_GUID linux_data = { 0x0fc63daf, 0x8483, 0x4772,
+		{ 0x8e, 0x79, 0x3d, 0x69, 0xd8, 0x47, 0x7d, 0xe4 } };
+	struct gpt_partition entries[GPT_ENTRIES];
+	EFI_GUID disk_uuid;
+	UINT64 lba, last_lba, size;
+	EFI_STATUS ret;
+	UINTN i;
+	int fd;
+
+	size = 2 * DISK_ALIGN;
+	for (i = 0; i < ARRAY_SIZE(PARTITIONS); i++)
+		size += PARTITIONS[i].size * MiB;
+	last_lba = size / DISK_BLOCK_SIZE - 1;
+
+	fd = mkstemp(disk_path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return EFI_DEVICE_ERROR;
+	}
+	synthetic_disk = TRUE;
+
+	if (ftruncate(fd, size)) {
+		perror("ftruncate");
+		close(fd);
+		return EFI_DEVICE_ERROR;
+	}
+
+	memset(entries, 0, sizeof(entries));
+	lba = DISK_ALIGN / DISK_BLOCK_SIZE;
+	for (i = 0; i < ARRAY_SIZE(PARTITIONS); i++) {
+		entries[i].type = linux_data;
+		bench_fill_random(&entries[i].unique, sizeof(entries[i].unique), i + 1);
+		entries[i].starting_lba = lba;
+		lba += PARTITIONS[i].size * MiB / DISK_BLOCK_SIZE;
+		entries[i].ending_lba = lba - 1;
+		memcpy(entries[i].name, PARTITIONS[i].label,
+		       StrSize((CHAR16 *)PARTITIONS[i].label));
+	}
+	bench_fill_random(&disk_uuid, sizeof(disk_uuid), 0x6b66);
+
+	ret = write_gpt(fd, last_lba, 2, 1, last_lba, entries,
+			sizeof(entries), &disk_uuid);
+	if (!EFI_ERROR(ret))
+		ret = write_gpt(fd, last_lba, last_lba - sizeof(entries) / DISK_BLOCK_SIZE,
+				last_lba, 1, entries, sizeof(entries), &disk_uuid);
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * GPT
+ */
+static EFI_STATUS lookup_all(void)
+{
+	struct gpt_partition_interface gparti;
+	EFI_STATUS ret;
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(PARTITIONS); i++) {
+		ret = gpt_get_partition_by_label(PARTITIONS[i].label, &gparti,
+						 LOGICAL_UNIT_USER);
+		if (EFI_ERROR(ret) && synthetic_disk)
+			return ret;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS gpt_cold(__attribute__((__unused__)) VOID *ctx)
+{
+	gpt_free_cache();
+	return lookup_all();
+}
+
+static EFI_STATUS gpt_warm(__attribute__((__unused__)) VOID *ctx)
+{
+	return lookup_all();
+}
+
+/*
+ * Sparse: flash_{write,skip,fill} normally live in flash.c which
+ * drags the whole fastboot in.  Without a flash context, these write
+ * to the "system" partition of the synthetic disk, otherwise to the
+ * in memory partition of the flash jobs context, see below.
+ */
+static EFI_STATUS jobs_write(struct flash_ctx *ctx, VOID *data, UINTN size);
+
+EFI_STATUS flash_skip(struct flash_ctx *ctx, UINT64 size)
+{
+	if (ctx)
+		return jobs_write(ctx, NULL, size);
+
+	flash_offset += size;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS flash_write(struct flash_ctx *ctx, VOID *data, UINTN size)
+{
+	UINT64 start = flash_part.part.starting_lba * flash_part.bio->Media->BlockSize;
+	UINT64 end = (flash_part.part.ending_lba + 1) * flash_part.bio->Media->BlockSize;
+	EFI_STATUS ret;
+
+	if (ctx)
+		return jobs_write(ctx, data, size);
+
+	if (flash_offset < start || flash_offset + size > end)
+		return EFI_INVALID_PARAMETER;
+
+	ret = uefi_call_wrapper(flash_part.dio->WriteDisk, 5, flash_part.dio,
+				flash_part.bio->Media->MediaId,
+				flash_offset, size, data);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	flash_offset += size;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS flash_fill(struct flash_ctx *ctx, UINT32 pattern, UINTN size)
+{
+	static UINT32 buf[FILL_BUFFER_SIZE / sizeof(UINT32)];
+	EFI_STATUS ret;
+	UINTN i, len;
+
+	for (i = 0; i < ARRAY_SIZE(buf); i++)
+		buf[i] = pattern;
+
+	for (; size; size -= len) {
+		len = min(size, sizeof(buf));
+		ret = flash_write(ctx, buf, len);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS create_sparse(struct buffer *buf, UINT64 size)
+{
+	struct sparse_header *sph;
+	struct chunk_header *ckh;
+	UINT32 state = 0x5350, blocks, total = size / SPARSE_BLOCK_SIZE;
+	UINT8 *p;
+
+	/* Worst case, every chunk is raw. */
+	buf->data = AllocatePool(sizeof(*sph) + size + total * sizeof(*ckh));
+	if (!buf->data)
+		return EFI_OUT_OF_RESOURCES;
+
+	sph = buf->data;
+	memset(sph, 0, sizeof(*sph));
+	sph->magic = SPARSE_HEADER_MAGIC;
+	sph->major_version = 1;
+	sph->file_hdr_sz = sizeof(*sph);
+	sph->chunk_hdr_sz = sizeof(*ckh);
+	sph->blk_sz = SPARSE_BLOCK_SIZE;
+
+	p = (UINT8 *)(sph + 1);
+	while (sph->total_blks < total) {
+		ckh = (struct chunk_header *)p;
+		p += sizeof(*ckh);
+		memset(ckh, 0, sizeof(*ckh));
+
+		switch (sph->total_chunks % 3) {
+		case 0:
+			blocks = random_range(&state, 1, 256);
+			ckh->chunk_type = CHUNK_TYPE_RAW;
+			break;
+		case 1:
+			blocks = random_range(&state, 1, 1024);
+			ckh->chunk_type = CHUNK_TYPE_FILL;
+			break;
+		default:
+			blocks = random_range(&state, 1, 1024);
+			ckh->chunk_type = CHUNK_TYPE_DONT_CARE;
+			break;
+		}
+		blocks = min(blocks, total - sph->total_blks);
+		ckh->chunk_sz = blocks;
+
+		switch (ckh->chunk_type) {
+		case CHUNK_TYPE_RAW:
+			bench_fill_random(p, blocks * SPARSE_BLOCK_SIZE, state);
+			p += blocks * SPARSE_BLOCK_SIZE;
+			break;
+		case CHUNK_TYPE_FILL:
+			*(UINT32 *)p = state;
+			p += sizeof(UINT32);
+			break;
+		}
+		ckh->total_sz = p - (UINT8 *)ckh;
+		sph->total_blks += blocks;
+		sph->total_chunks++;
+	}
+	buf->size = p - (UINT8 *)buf->data;
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS sparse_flash(VOID *ctx)
+{
+	struct buffer *buf = ctx;
+
+	flash_offset = flash_part.part.starting_lba * flash_part.bio->Media->BlockSize;
+	return flash_sparse(NULL, buf->data, buf->size);
+}
+
+/*
+ * Flash jobs: the flash contexts flash_jobs() drives normally live in
+ * flash.c, these flash in memory partitions of two disks, the user and
+ * the factory one.  A write keeps its context busy for a couple of
+ * polls as an asynchronous write would.  The stubs count the
+ * scheduling errors: a context used after it is freed or freed twice,
+ * two images of the same disk written at the same time or a special
+ * label flashed while a job is open.
+ */
+static const struct {
+	const CHAR16 *label;
+	UINTN disk;
+} JOBS_PARTITIONS[] = {
+	{ L"boot",		0 },
+	{ L"system",		0 },
+	{ L"vendor",		0 },
+	{ L"reference",		0 },
+	{ L"factory:config",	1 },
+	{ L"factory:factory",	1 }
+};
+
+struct flash_ctx {
+	BOOLEAN used;
+	BOOLEAN done;
+	UINTN part;
+	UINT64 offset;
+	UINTN busy;
+};
+
+struct jobs_case {
+	const CHAR16 *labels[8];
+	UINTN nb;
+	const CHAR16 *failing;	/* Partition whose writes fail */
+};
+
+static struct flash_ctx jobs_ctx[JOBS_MAX_CTX];
+static UINT8 *jobs_parts[ARRAY_SIZE(JOBS_PARTITIONS)];
+static UINT8 jobs_disks[2];
+static UINTN jobs_failing;
+static UINTN jobs_errors;
+static UINTN jobs_overlaps;
+
+static UINTN jobs_part(const CHAR16 *label)
+{
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(JOBS_PARTITIONS); i++)
+		if (!StrCmp(JOBS_PARTITIONS[i].label, label))
+			return i;
+
+	return ARRAY_SIZE(JOBS_PARTITIONS);
+}
+
+static EFI_STATUS jobs_write(struct flash_ctx *ctx, VOID *data, UINTN size)
+{
+	UINTN disk = JOBS_PARTITIONS[ctx->part].disk;
+	UINTN i;
+
+	if (!ctx->used || ctx->done) {
+		jobs_errors++;
+		return EFI_INVALID_PARAMETER;
+	}
+	if (ctx->offset + size > JOBS_PART_SIZE)
+		return EFI_INVALID_PARAMETER;
+	if (ctx->part == jobs_failing && ctx->offset >= JOBS_WRITE_SIZE)
+		return EFI_DEVICE_ERROR;
+
+	for (i = 0; i < ARRAY_SIZE(jobs_ctx); i++) {
+		if (&jobs_ctx[i] == ctx || !jobs_ctx[i].used ||
+		    jobs_ctx[i].done || !jobs_ctx[i].offset)
+			continue;
+		if (JOBS_PARTITIONS[jobs_ctx[i].part].disk == disk)
+			jobs_errors++;
+		else
+			jobs_overlaps++;
+	}
+
+	if (data)
+		memcpy(jobs_parts[ctx->part] + ctx->offset, data, size);
+	ctx->offset += size;
+	ctx->busy = 2;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS flash_partition_start(CHAR16 *label, struct flash_ctx **ctx_p)
+{
+	UINTN i, part = jobs_part(label);
+
+	if (part == ARRAY_SIZE(JOBS_PARTITIONS))
+		return EFI_NOT_FOUND;
+
+	for (i = 0; i < ARRAY_SIZE(jobs_ctx); i++)
+		if (!jobs_ctx[i].used)
+			break;
+	if (i == ARRAY_SIZE(jobs_ctx)) {
+		jobs_errors++;
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	memset(jobs_parts[part], 0, JOBS_PART_SIZE);
+	memset(&jobs_ctx[i], 0, sizeof(jobs_ctx[i]));
+	jobs_ctx[i].used = TRUE;
+	jobs_ctx[i].part = part;
+	*ctx_p = &jobs_ctx[i];
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS flash_partition_done(struct flash_ctx *ctx)
+{
+	if (!ctx->used || ctx->done)
+		jobs_errors++;
+
+	ctx->done = TRUE;
+	return EFI_SUCCESS;
+}
+
+void flash_ctx_free(struct flash_ctx *ctx)
+{
+	if (!ctx->used)
+		jobs_errors++;
+
+	ctx->used = FALSE;
+}
+
+BOOLEAN flash_ctx_ready(struct flash_ctx *ctx)
+{
+	if (!ctx->used)
+		jobs_errors++;
+
+	if (ctx->busy) {
+		ctx->busy--;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+EFI_HANDLE flash_ctx_disk(struct flash_ctx *ctx)
+{
+	return &jobs_disks[JOBS_PARTITIONS[ctx->part].disk];
+}
+
+UINTN flash_ctx_write_size(__attribute__((__unused__)) struct flash_ctx *ctx)
+{
+	return JOBS_WRITE_SIZE;
+}
+
+CHAR16 *flash_ctx_label(struct flash_ctx *ctx)
+{
+	return (CHAR16 *)JOBS_PARTITIONS[ctx->part].label;
+}
+
+BOOLEAN is_special_label(CHAR16 *label)
+{
+	return !StrCmp(label, L"gpt");
+}
+
+EFI_STATUS flash(__attribute__((__unused__)) VOID *data,
+		 __attribute__((__unused__)) UINTN size,
+		 __attribute__((__unused__)) CHAR16 *label)
+{
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(jobs_ctx); i++)
+		if (jobs_ctx[i].used)
+			jobs_errors++;
+
+	return EFI_SUCCESS | REFRESH_PARTITION_VAR;
+}
+
+/* The images of the partitions, the "vendor" one is a sparse image
+   which is also flashed at once in "reference" to check the result
+   of its slice by slice flashing.  */
+static struct buffer jobs_images[ARRAY_SIZE(JOBS_PARTITIONS)];
+
+static void free_jobs(void)
+{
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(JOBS_PARTITIONS); i++) {
+		if (jobs_parts[i])
+			FreePool(jobs_parts[i]);
+		if (jobs_images[i].data)
+			FreePool(jobs_images[i].data);
+		jobs_parts[i] = NULL;
+		jobs_images[i].data = NULL;
+	}
+}
+
+static EFI_STATUS create_jobs(void)
+{
+	struct flash_ctx *ctx;
+	EFI_STATUS ret;
+	UINTN i, vendor = jobs_part(L"vendor");
+
+	for (i = 0; i < ARRAY_SIZE(JOBS_PARTITIONS); i++) {
+		jobs_parts[i] = AllocatePool(JOBS_PART_SIZE);
+		if (!jobs_parts[i])
+			goto err;
+
+		if (i == vendor)
+			continue;
+
+		/* Sizes which are not a multiple of the slice size. */
+		jobs_images[i].size = JOBS_PART_SIZE / 2 + i * 4096 + 1;
+		jobs_images[i].data = AllocatePool(jobs_images[i].size);
+		if (!jobs_images[i].data)
+			goto err;
+		bench_fill_random(jobs_images[i].data, jobs_images[i].size, i + 1);
+	}
+
+	ret = create_sparse(&jobs_images[vendor], JOBS_PART_SIZE);
+	if (EFI_ERROR(ret))
+		goto err;
+
+	ret = flash_partition_start(L"reference", &ctx);
+	if (EFI_ERROR(ret))
+		goto err;
+	ret = flash_sparse(ctx, jobs_images[vendor].data, jobs_images[vendor].size);
+	flash_ctx_free(ctx);
+	if (EFI_ERROR(ret) || jobs_errors)
+		goto err;
+
+	return EFI_SUCCESS;
+
+err:
+	free_jobs();
+	return EFI_OUT_OF_RESOURCES;
+}
+
+static EFI_STATUS jobs_check(const struct jobs_case *c)
+{
+	struct flash_image images[ARRAY_SIZE(c->labels)];
+	UINT8 *expected;
+	EFI_STATUS ret;
+	UINTN i, part, size;
+	BOOLEAN special = FALSE;
+
+	for (i = 0; i < c->nb; i++) {
+		images[i].label = (CHAR16 *)c->labels[i];
+		part = jobs_part(c->labels[i]);
+		if (part == ARRAY_SIZE(JOBS_PARTITIONS)) {
+			special = TRUE;
+			images[i].data = jobs_images[0].data;
+			images[i].size = jobs_images[0].size;
+			continue;
+		}
+		images[i].data = jobs_images[part].data;
+		images[i].size = jobs_images[part].size;
+	}
+
+	jobs_errors = 0;
+	jobs_failing = c->failing ? jobs_part(c->failing) : ARRAY_SIZE(JOBS_PARTITIONS);
+
+	ret = flash_jobs(images, c->nb);
+	for (i = 0; i < ARRAY_SIZE(jobs_ctx); i++)
+		if (jobs_ctx[i].used)
+			jobs_errors++;
+	if (jobs_errors)
+		return EFI_ABORTED;
+
+	if (c->failing)
+		return ret == EFI_DEVICE_ERROR ? EFI_SUCCESS : EFI_ABORTED;
+	if (EFI_ERROR(ret))
+		return ret;
+	if (special != !!(ret & REFRESH_PARTITION_VAR))
+		return EFI_ABORTED;
+
+	for (i = 0; i < c->nb; i++) {
+		part = jobs_part(c->labels[i]);
+		if (part == ARRAY_SIZE(JOBS_PARTITIONS))
+			continue;
+
+		expected = jobs_images[part].data;
+		size = jobs_images[part].size;
+		if (!StrCmp(c->labels[i], L"vendor")) {
+			expected = jobs_parts[jobs_part(L"reference")];
+			size = JOBS_PART_SIZE;
+		}
+		if (memcmp(jobs_parts[part], expected, size))
+			return EFI_CRC_ERROR;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS flash_jobs_check(__attribute__((__unused__)) VOID *ctx)
+{
+	static const struct jobs_case CASES[] = {
+		/* Two images of the same disk, one after the other. */
+		{ { L"boot", L"system" }, 2, NULL },
+		/* The user and the factory disks at the same time. */
+		{ { L"system", L"factory:config", L"vendor", L"gpt",
+		    L"boot", L"factory:factory" }, 6, NULL },
+		/* A failing image aborts all the jobs. */
+		{ { L"system", L"factory:config", L"boot" }, 3, L"factory:config" }
+	};
+	EFI_STATUS ret;
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(CASES); i++) {
+		jobs_overlaps = 0;
+		ret = jobs_check(&CASES[i]);
+		if (EFI_ERROR(ret))
+			return ret;
+		if (i == 1 && !jobs_overlaps)
+			return EFI_ABORTED;
+	}
+
+	return EFI_SUCCESS;
+}
+
+/*
+ * PNG
+ */
+static EFI_STATUS png_decode(VOID *ctx)
+{
+	struct buffer *buf = ctx;
+	EFI_GRAPHICS_OUTPUT_BLT_PIXEL *blt;
+	UINTN width, height;
+	EFI_STATUS ret;
+
+	ret = upng_load(buf->data, buf->size, &blt, &width, &height);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	FreePool(blt);
+	return EFI_SUCCESS;
+}
+
+/*
+ * Blobstore
+ */
+static EFI_STATUS create_blobstore(struct buffer *buf)
+{
+	struct blob_header *bh;
+	struct blob_metablock *mb;
+	unsigned int *hashmap, offset, hash;
+	UINTN i;
+
+	buf->size = sizeof(*bh) + BLOBSTORE_HASHMAP_SIZE * sizeof(*hashmap) +
+		BLOBSTORE_ITEMS * (sizeof(*mb) + BLOBSTORE_ITEM_SIZE);
+	buf->data = AllocateZeroPool(buf->size);
+	if (!buf->data)
+		return EFI_OUT_OF_RESOURCES;
+
+	bh = buf->data;
+	memcpy(bh->magic, "BLOBSTOR", sizeof(bh->magic));
+	bh->version = 1;
+	bh->total_size = buf->size;
+	bh->hashmap_sz = BLOBSTORE_HASHMAP_SIZE;
+	hashmap = (unsigned int *)(bh + 1);
+
+	offset = sizeof(*bh) + BLOBSTORE_HASHMAP_SIZE * sizeof(*hashmap);
+	for (i = 0; i < BLOBSTORE_ITEMS; i++) {
+		mb = (struct blob_metablock *)((UINT8 *)buf->data + offset);
+		efi_snprintf((CHAR8 *)mb->blob_key, sizeof(mb->blob_key),
+			     (CHAR8 *)"board-%03d", (int)i);
+		mb->blob_type = BLOB_TYPE_DTB;
+		mb->data_offset = offset + sizeof(*mb);
+		mb->data_size = BLOBSTORE_ITEM_SIZE;
+		bench_fill_random((UINT8 *)buf->data + mb->data_offset,
+				  BLOBSTORE_ITEM_SIZE, i + 1);
+
+		hash = hash_blob_key(mb->blob_key, BLOB_TYPE_DTB, BLOBSTORE_HASHMAP_SIZE);
+		mb->next_item_offset = hashmap[hash];
+		hashmap[hash] = offset;
+
+		offset += sizeof(*mb) + BLOBSTORE_ITEM_SIZE;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS blobstore_lookup(VOID *ctx)
+{
+	struct buffer *buf = ctx;
+	struct blobstore *bs;
+	char key[64];
+	VOID *data;
+	unsigned int size;
+	UINTN i;
+
+	bs = blobstore_get(buf->data, buf->size);
+	if (!bs)
+		return EFI_COMPROMISED_DATA;
+
+	for (i = 0; i < BLOBSTORE_ITEMS; i++) {
+		efi_snprintf((CHAR8 *)key, sizeof(key), (CHAR8 *)"board-%03d", (int)i);
+		if (blobstore_get_item(bs, key, BLOB_TYPE_DTB, &data, &size))
+			return EFI_NOT_FOUND;
+	}
+
+	return EFI_SUCCESS;
+}
+
+/*
+ * Text parser and OEM variables
+ */
+static EFI_STATUS create_oemvars(struct buffer *buf)
+{
+	static const char *ATTRIBUTES[] = { "", "[b] ", "[d] ", "[a] " };
+	CHAR8 *p;
+	UINTN i, left;
+	int len;
+
+	left = 128 * OEMVARS_COUNT;
+	buf->data = p = AllocatePool(left);
+	if (!buf->data)
+		return EFI_OUT_OF_RESOURCES;
+
+	len = efi_snprintf(p, left, (CHAR8 *)"# kfbench OEM variables\n"
+			   "GUID = 4a67b082-0a4c-41cf-b6c7-440b29bb8c4f\n");
+	for (i = 0; len > 0 && i < OEMVARS_COUNT; i++) {
+		p += len;
+		left -= len;
+		len = efi_snprintf(p, left, (CHAR8 *)"%aKfBenchVar%03d   value-%03d%%0a%%ff  # item %d\n",
+				   (CHAR8 *)ATTRIBUTES[i % ARRAY_SIZE(ATTRIBUTES)],
+				   (int)i, (int)i, (int)i);
+	}
+	if (len <= 0)
+		return EFI_BUFFER_TOO_SMALL;
+	buf->size = p + len - (CHAR8 *)buf->data;
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS count_line(__attribute__((__unused__)) char *line, VOID *ctx)
+{
+	(*(UINTN *)ctx)++;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS text_parse(VOID *ctx)
+{
+	struct buffer *buf = ctx;
+	UINTN lines = 0;
+
+	return parse_text_buffer(buf->data, buf->size, count_line, &lines);
+}
+
+static EFI_STATUS oemvars_flash(VOID *ctx)
+{
+	struct buffer *buf = ctx;
+
+	return flash_oemvars(buf->data, buf->size);
+}
+
+static void usage(const char *progname)
+{
+	printf("Usage: %s [OPTIONS]\n"
+	       "Time platform-neutral kernelflinger code on the host.\n\n"
+	       "  -n, --iterations N    timed runs per benchmark (default %lu)\n"
+	       "  -d, --disk FILE       use FILE as the disk instead of a synthetic one\n"
+	       "  -i, --image FILE      PNG image to decode\n"
+	       "  -a, --avb PARTS       verify the comma separated PARTS with libavb,\n"
+	       "                        requires a disk with vbmeta\n"
+	       "  -s, --suffix SUFFIX   slot suffix for --avb\n"
+	       "  -c, --compare FILE    compare against the output of a previous run\n"
+	       "  -t, --threshold PCT   tolerated median slowdown (default 10)\n"
+	       "  -v, --verbose         print the kernelflinger logs\n"
+	       "  -h, --help            display this help\n",
+	       progname, (unsigned long)iterations);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option long_options[] = {
+		{ "iterations",	required_argument,	NULL, 'n' },
+		{ "disk",	required_argument,	NULL, 'd' },
+		{ "image",	required_argument,	NULL, 'i' },
+		{ "avb",	required_argument,	NULL, 'a' },
+		{ "suffix",	required_argument,	NULL, 's' },
+		{ "compare",	required_argument,	NULL, 'c' },
+		{ "threshold",	required_argument,	NULL, 't' },
+		{ "verbose",	no_argument,		NULL, 'v' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	const char *disk = NULL, *image = KFBENCH_IMAGE, *avb = NULL;
+	const char *suffix = "", *baseline = NULL;
+	double threshold = 10;
+	BOOLEAN verbose = FALSE;
+	struct buffer buf;
+	EFI_STATUS ret;
+	int opt, status = EXIT_SUCCESS, regressions;
+
+	while ((opt = getopt_long(argc, argv, "n:d:i:a:s:c:t:vh",
+				  long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			if (!iterations) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'd':
+			disk = optarg;
+			break;
+		case 'i':
+			image = optarg;
+			break;
+		case 'a':
+			avb = optarg;
+			break;
+		case 's':
+			suffix = optarg;
+			break;
+		case 'c':
+			baseline = optarg;
+			break;
+		case 't':
+			threshold = atof(optarg);
+			break;
+		case 'v':
+			verbose = TRUE;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	shim_init(verbose);
+
+	if (!disk) {
+		ret = create_disk();
+		if (EFI_ERROR(ret)) {
+			fprintf(stderr, "Failed to create the synthetic disk\n");
+			status = EXIT_FAILURE;
+			goto out;
+		}
+		disk = disk_path;
+	}
+
+	ret = shim_add_disk(disk, DISK_BLOCK_SIZE, NULL);
+	if (EFI_ERROR(ret)) {
+		fprintf(stderr, "Failed to open %s\n", disk);
+		status = EXIT_FAILURE;
+		goto out;
+	}
+
+	printf("# %-22s %6s %12s %12s %12s %10s\n", "benchmark", "iters",
+	       "min(us)", "median(us)", "mean(us)", "MB/s");
+
+	bench_run("gpt_lookup_cold", 0, gpt_cold, NULL);
+	bench_run("gpt_lookup_warm", 0, gpt_warm, NULL);
+
+	/* Never write to a disk image the user handed over. */
+	if (synthetic_disk) {
+		ret = gpt_get_partition_by_label(L"system", &flash_part, LOGICAL_UNIT_USER);
+		if (!EFI_ERROR(ret))
+			ret = create_sparse(&buf, SPARSE_SIZE);
+		if (!EFI_ERROR(ret)) {
+			bench_run("sparse_flash", SPARSE_SIZE, sparse_flash, &buf);
+			FreePool(buf.data);
+		}
+	}
+
+	ret = create_jobs();
+	if (EFI_ERROR(ret)) {
+		fprintf(stderr, "Failed to create the flash jobs images\n");
+		nb_failures++;
+	} else {
+		bench_run("flash_jobs", 0, flash_jobs_check, NULL);
+		free_jobs();
+	}
+
+	if (image) {
+		ret = read_file(image, &buf);
+		if (EFI_ERROR(ret)) {
+			fprintf(stderr, "Failed to read %s\n", image);
+			nb_failures++;
+		} else {
+			bench_run("upng_load", buf.size, png_decode, &buf);
+			FreePool(buf.data);
+		}
+	}
+
+	ret = create_blobstore(&buf);
+	if (!EFI_ERROR(ret)) {
+		bench_run("blobstore_lookup", 0, blobstore_lookup, &buf);
+		FreePool(buf.data);
+	}
+
+	ret = create_oemvars(&buf);
+	if (!EFI_ERROR(ret)) {
+		bench_run("text_parser", buf.size, text_parse, &buf);
+		bench_run("oemvars_flash", buf.size, oemvars_flash, &buf);
+		FreePool(buf.data);
+	}
+
+	bench_avb_hash(HASH_SIZE);
+	if (avb)
+		bench_avb_slot_verify(avb, suffix);
+
+	if (nb_failures)
+		status = EXIT_FAILURE;
+
+	if (baseline) {
+		regressions = compare_baseline(baseline, threshold);
+		if (regressions)
+			status = EXIT_FAILURE;
+	}
+
+out:
+	shim_exit();
+	if (synthetic_disk)
+		unlink(disk_path);
+	return status;
+}
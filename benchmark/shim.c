@@ -0,0 +1,604 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+#include <log.h>
+#include <storage.h>
+#include <vars.h>
+
+#include "shim.h"
+
+#define container_of(ptr, type, member) \
+	((type *)((UINT8 *)(ptr) - offsetof(type, member)))
+
+#define SHIM_MAX_DISKS	4
+#define SHIM_LOG_SIZE	512
+
+struct shim_disk {
+	EFI_BLOCK_IO bio;
+	EFI_BLOCK_IO_MEDIA media;
+	EFI_DISK_IO dio;
+	EFI_DEVICE_PATH dp;
+	UINT64 size;
+	int fd;
+};
+
+struct shim_var {
+	struct shim_var *next;
+	EFI_GUID guid;
+	CHAR16 *name;
+	UINT32 attributes;
+	UINTN size;
+	VOID *data;
+};
+
+/* Normally provided by vars.c which depends on too much of the
+ * firmware to be built here. */
+const EFI_GUID fastboot_guid = { 0x1ac80a82, 0x4f0c, 0x456b,
+	{0x9a, 0x99, 0xde, 0xbe, 0xb4, 0x31, 0xfc, 0xc1} };
+const EFI_GUID loader_guid = { 0x4a67b082, 0x0a4c, 0x41cf,
+	{0xb6, 0xc7, 0x44, 0x0b, 0x29, 0xbb, 0x8c, 0x4f} };
+
+static EFI_SYSTEM_TABLE shim_st;
+static EFI_BOOT_SERVICES shim_bs;
+static EFI_RUNTIME_SERVICES shim_rt;
+static SIMPLE_TEXT_OUTPUT_INTERFACE shim_conout;
+static SIMPLE_TEXT_OUTPUT_MODE shim_conout_mode;
+
+static struct shim_disk *disks[SHIM_MAX_DISKS];
+static UINTN nb_disks;
+static struct shim_var *variables;
+static UINTN variable_writes;
+static BOOLEAN shim_verbose;
+static UINT32 crc32_table[256];
+
+static void print_str16(FILE *stream, const CHAR16 *str)
+{
+	for (; *str; str++)
+		fputc(*str < 0x80 ? (int)*str : '?', stream);
+}
+
+UINT32 shim_crc32(const void *data, UINTN size)
+{
+	const UINT8 *p = data;
+	UINT32 crc = 0xffffffff;
+
+	while (size--)
+		crc = crc32_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc ^ 0xffffffff;
+}
+
+static void crc32_init(void)
+{
+	UINT32 i, j, c;
+
+	for (i = 0; i < ARRAY_SIZE(crc32_table); i++) {
+		for (c = i, j = 0; j < 8; j++)
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc32_table[i] = c;
+	}
+}
+
+/* Every service the shim does not implement points to this function.
+ * It ignores its arguments which is harmless with the x86_64 calling
+ * conventions. */
+static EFI_STATUS EFIAPI unsupported(void)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static void fill_unsupported(VOID *table, UINTN size)
+{
+	VOID **services = (VOID **)((UINT8 *)table + sizeof(EFI_TABLE_HEADER));
+	UINTN i;
+
+	for (i = 0; i < (size - sizeof(EFI_TABLE_HEADER)) / sizeof(VOID *); i++)
+		services[i] = (VOID *)unsupported;
+}
+
+/*
+ * Boot services
+ */
+static EFI_STATUS EFIAPI shim_allocate_pool(__attribute__((__unused__)) EFI_MEMORY_TYPE type,
+					    UINTN size, VOID **buffer)
+{
+	*buffer = malloc(size ? size : 1);
+	return *buffer ? EFI_SUCCESS : EFI_OUT_OF_RESOURCES;
+}
+
+static EFI_STATUS EFIAPI shim_free_pool(VOID *buffer)
+{
+	free(buffer);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI shim_allocate_pages(EFI_ALLOCATE_TYPE type,
+					     __attribute__((__unused__)) EFI_MEMORY_TYPE mem_type,
+					     UINTN pages, EFI_PHYSICAL_ADDRESS *memory)
+{
+	void *ptr;
+
+	if (type != AllocateAnyPages)
+		return EFI_UNSUPPORTED;
+
+	if (posix_memalign(&ptr, EFI_PAGE_SIZE, pages * EFI_PAGE_SIZE))
+		return EFI_OUT_OF_RESOURCES;
+
+	*memory = (EFI_PHYSICAL_ADDRESS)(UINTN)ptr;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI shim_free_pages(EFI_PHYSICAL_ADDRESS memory,
+					 __attribute__((__unused__)) UINTN pages)
+{
+	free((VOID *)(UINTN)memory);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI shim_calculate_crc32(VOID *data, UINTN size, UINT32 *crc)
+{
+	if (!data || !size || !crc)
+		return EFI_INVALID_PARAMETER;
+
+	*crc = shim_crc32(data, size);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI shim_stall(UINTN usec)
+{
+	usleep(usec);
+	return EFI_SUCCESS;
+}
+
+static struct shim_disk *find_disk(EFI_HANDLE handle)
+{
+	UINTN i;
+
+	for (i = 0; i < nb_disks; i++)
+		if (disks[i] == handle)
+			return disks[i];
+
+	return NULL;
+}
+
+static EFI_STATUS EFIAPI shim_handle_protocol(EFI_HANDLE handle, EFI_GUID *protocol,
+					      VOID **interface)
+{
+	struct shim_disk *disk = find_disk(handle);
+
+	if (!disk)
+		return EFI_UNSUPPORTED;
+
+	if (!CompareGuid(protocol, &BlockIoProtocol))
+		*interface = &disk->bio;
+	else if (!CompareGuid(protocol, &DiskIoProtocol))
+		*interface = &disk->dio;
+	else if (!CompareGuid(protocol, &DevicePathProtocol))
+		*interface = &disk->dp;
+	else
+		return EFI_UNSUPPORTED;
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI shim_locate_handle_buffer(EFI_LOCATE_SEARCH_TYPE type,
+						   EFI_GUID *protocol,
+						   __attribute__((__unused__)) VOID *key,
+						   UINTN *nb_handles, EFI_HANDLE **handles)
+{
+	UINTN i;
+
+	if (type != ByProtocol ||
+	    (CompareGuid(protocol, &BlockIoProtocol) &&
+	     CompareGuid(protocol, &DiskIoProtocol)))
+		return EFI_NOT_FOUND;
+
+	if (!nb_disks)
+		return EFI_NOT_FOUND;
+
+	*handles = AllocatePool(nb_disks * sizeof(**handles));
+	if (!*handles)
+		return EFI_OUT_OF_RESOURCES;
+
+	for (i = 0; i < nb_disks; i++)
+		(*handles)[i] = disks[i];
+	*nb_handles = nb_disks;
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI shim_success(void)
+{
+	return EFI_SUCCESS;
+}
+
+/*
+ * File backed Block IO and Disk IO
+ */
+static EFI_STATUS disk_io(struct shim_disk *disk, BOOLEAN write, UINT32 media_id,
+			  UINT64 offset, UINTN size, VOID *buffer)
+{
+	UINT8 *p = buffer;
+	ssize_t len;
+
+	if (media_id != disk->media.MediaId)
+		return EFI_MEDIA_CHANGED;
+
+	if (offset > disk->size || size > disk->size - offset)
+		return EFI_INVALID_PARAMETER;
+
+	while (size) {
+		if (write)
+			len = pwrite(disk->fd, p, size, offset);
+		else
+			len = pread(disk->fd, p, size, offset);
+		if (len <= 0)
+			return EFI_DEVICE_ERROR;
+		p += len;
+		offset += len;
+		size -= len;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI bio_read_blocks(EFI_BLOCK_IO *This, UINT32 media_id, EFI_LBA lba,
+					 UINTN size, VOID *buffer)
+{
+	struct shim_disk *disk = container_of(This, struct shim_disk, bio);
+
+	if (size % disk->media.BlockSize)
+		return EFI_BAD_BUFFER_SIZE;
+
+	return disk_io(disk, FALSE, media_id, lba * disk->media.BlockSize, size, buffer);
+}
+
+static EFI_STATUS EFIAPI bio_write_blocks(EFI_BLOCK_IO *This, UINT32 media_id, EFI_LBA lba,
+					  UINTN size, VOID *buffer)
+{
+	struct shim_disk *disk = container_of(This, struct shim_disk, bio);
+
+	if (size % disk->media.BlockSize)
+		return EFI_BAD_BUFFER_SIZE;
+
+	return disk_io(disk, TRUE, media_id, lba * disk->media.BlockSize, size, buffer);
+}
+
+static EFI_STATUS EFIAPI dio_read_disk(EFI_DISK_IO *This, UINT32 media_id, UINT64 offset,
+				       UINTN size, VOID *buffer)
+{
+	return disk_io(container_of(This, struct shim_disk, dio), FALSE,
+		       media_id, offset, size, buffer);
+}
+
+static EFI_STATUS EFIAPI dio_write_disk(EFI_DISK_IO *This, UINT32 media_id, UINT64 offset,
+					UINTN size, VOID *buffer)
+{
+	return disk_io(container_of(This, struct shim_disk, dio), TRUE,
+		       media_id, offset, size, buffer);
+}
+
+EFI_STATUS shim_add_disk(const char *path, UINT32 block_size, EFI_HANDLE *handle)
+{
+	struct shim_disk *disk;
+	struct stat st;
+
+	if (nb_disks == SHIM_MAX_DISKS || !block_size)
+		return EFI_OUT_OF_RESOURCES;
+
+	disk = calloc(1, sizeof(*disk));
+	if (!disk)
+		return EFI_OUT_OF_RESOURCES;
+
+	disk->fd = open(path, O_RDWR);
+	if (disk->fd < 0 || fstat(disk->fd, &st) || st.st_size < block_size) {
+		if (disk->fd >= 0)
+			close(disk->fd);
+		free(disk);
+		return EFI_NOT_FOUND;
+	}
+	disk->size = st.st_size - st.st_size % block_size;
+
+	disk->media.MediaPresent = TRUE;
+	disk->media.BlockSize = block_size;
+	disk->media.LastBlock = disk->size / block_size - 1;
+
+	disk->bio.Revision = EFI_BLOCK_IO_INTERFACE_REVISION;
+	disk->bio.Media = &disk->media;
+	disk->bio.Reset = (EFI_BLOCK_RESET)shim_success;
+	disk->bio.ReadBlocks = bio_read_blocks;
+	disk->bio.WriteBlocks = bio_write_blocks;
+	disk->bio.FlushBlocks = (EFI_BLOCK_FLUSH)shim_success;
+
+	disk->dio.Revision = EFI_DISK_IO_INTERFACE_REVISION;
+	disk->dio.ReadDisk = dio_read_disk;
+	disk->dio.WriteDisk = dio_write_disk;
+
+	SetDevicePathEndNode(&disk->dp);
+
+	disks[nb_disks++] = disk;
+	if (handle)
+		*handle = disk;
+
+	return EFI_SUCCESS;
+}
+
+/*
+ * Runtime services: in-memory variable store
+ */
+static struct shim_var *find_variable(CHAR16 *name, EFI_GUID *guid)
+{
+	struct shim_var *var;
+
+	for (var = variables; var; var = var->next)
+		if (!CompareGuid(&var->guid, guid) && !StrCmp(var->name, name))
+			return var;
+
+	return NULL;
+}
+
+static void free_variable(struct shim_var *var)
+{
+	free(var->name);
+	free(var->data);
+	free(var);
+}
+
+static EFI_STATUS EFIAPI shim_get_variable(CHAR16 *name, EFI_GUID *guid, UINT32 *attributes,
+					   UINTN *size, VOID *data)
+{
+	struct shim_var *var;
+
+	if (!name || !guid || !size)
+		return EFI_INVALID_PARAMETER;
+
+	var = find_variable(name, guid);
+	if (!var)
+		return EFI_NOT_FOUND;
+
+	if (*size < var->size) {
+		*size = var->size;
+		return EFI_BUFFER_TOO_SMALL;
+	}
+
+	memcpy(data, var->data, var->size);
+	*size = var->size;
+	if (attributes)
+		*attributes = var->attributes;
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI shim_set_variable(CHAR16 *name, EFI_GUID *guid, UINT32 attributes,
+					   UINTN size, VOID *data)
+{
+	struct shim_var *var, **pvar;
+	VOID *copy = NULL;
+
+	if (!name || !guid || (size && !data))
+		return EFI_INVALID_PARAMETER;
+
+	variable_writes++;
+
+	if (!size || !attributes) {
+		for (pvar = &variables; *pvar; pvar = &(*pvar)->next) {
+			if (CompareGuid(&(*pvar)->guid, guid) || StrCmp((*pvar)->name, name))
+				continue;
+			var = *pvar;
+			*pvar = var->next;
+			free_variable(var);
+			return EFI_SUCCESS;
+		}
+		return EFI_NOT_FOUND;
+	}
+
+	copy = malloc(size);
+	if (!copy)
+		return EFI_OUT_OF_RESOURCES;
+	memcpy(copy, data, size);
+
+	var = find_variable(name, guid);
+	if (!var) {
+		var = calloc(1, sizeof(*var));
+		if (var)
+			var->name = malloc((StrLen(name) + 1) * sizeof(CHAR16));
+		if (!var || !var->name) {
+			free(var);
+			free(copy);
+			return EFI_OUT_OF_RESOURCES;
+		}
+		memcpy(var->name, name, (StrLen(name) + 1) * sizeof(CHAR16));
+		var->guid = *guid;
+		var->next = variables;
+		variables = var;
+	}
+
+	free(var->data);
+	var->data = copy;
+	var->size = size;
+	var->attributes = attributes;
+
+	return EFI_SUCCESS;
+}
+
+UINTN shim_variable_writes(void)
+{
+	return variable_writes;
+}
+
+static EFI_STATUS EFIAPI shim_reset_system(__attribute__((__unused__)) EFI_RESET_TYPE type,
+					   EFI_STATUS status,
+					   __attribute__((__unused__)) UINTN size,
+					   __attribute__((__unused__)) CHAR16 *data)
+{
+	fprintf(stderr, "ResetSystem called, status %ld\n", (long)status);
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Console
+ */
+static EFI_STATUS EFIAPI shim_output_string(__attribute__((__unused__)) SIMPLE_TEXT_OUTPUT_INTERFACE *This,
+					    CHAR16 *str)
+{
+	print_str16(stdout, str);
+	return EFI_SUCCESS;
+}
+
+/*
+ * Kernelflinger services outside of the benchmarked code
+ */
+void vlog(const CHAR16 *fmt, va_list args)
+{
+	CHAR16 buf[SHIM_LOG_SIZE];
+
+	/* Always format, the firmware pays that price too. */
+	VSPrint(buf, sizeof(buf), (CHAR16 *)fmt, args);
+	if (shim_verbose)
+		print_str16(stderr, buf);
+}
+
+void log(const CHAR16 *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vlog(fmt, args);
+	va_end(args);
+}
+
+EFI_STATUS log_flush_to_var(__attribute__((__unused__)) BOOLEAN nonvol)
+{
+	return EFI_SUCCESS;
+}
+
+void log_drain(void)
+{
+}
+
+void log_flush(void)
+{
+	fflush(stderr);
+}
+
+UINT8 min_boot_state_policy()
+{
+	return BOOT_STATE_GREEN;
+}
+
+EFI_STATUS storage_check_logical_unit(__attribute__((__unused__)) EFI_DEVICE_PATH *p,
+				      logical_unit_t log_unit)
+{
+	return log_unit == LOGICAL_UNIT_USER ? EFI_SUCCESS : EFI_UNSUPPORTED;
+}
+
+EFI_STATUS shim_init(BOOLEAN verbose)
+{
+	shim_verbose = verbose;
+	crc32_init();
+
+	fill_unsupported(&shim_bs, sizeof(shim_bs));
+	shim_bs.Hdr.Signature = EFI_BOOT_SERVICES_SIGNATURE;
+	shim_bs.Hdr.Revision = EFI_BOOT_SERVICES_REVISION;
+	shim_bs.Hdr.HeaderSize = sizeof(shim_bs);
+	shim_bs.AllocatePool = shim_allocate_pool;
+	shim_bs.FreePool = shim_free_pool;
+	shim_bs.AllocatePages = shim_allocate_pages;
+	shim_bs.FreePages = shim_free_pages;
+	shim_bs.CalculateCrc32 = shim_calculate_crc32;
+	shim_bs.Stall = shim_stall;
+	shim_bs.HandleProtocol = shim_handle_protocol;
+	shim_bs.LocateHandleBuffer = shim_locate_handle_buffer;
+	shim_bs.ConnectController = (EFI_CONNECT_CONTROLLER)shim_success;
+	shim_bs.ReinstallProtocolInterface = (EFI_REINSTALL_PROTOCOL_INTERFACE)shim_success;
+	shim_bs.SetWatchdogTimer = (EFI_SET_WATCHDOG_TIMER)shim_success;
+
+	fill_unsupported(&shim_rt, sizeof(shim_rt));
+	shim_rt.Hdr.Signature = EFI_RUNTIME_SERVICES_SIGNATURE;
+	shim_rt.Hdr.Revision = EFI_RUNTIME_SERVICES_REVISION;
+	shim_rt.Hdr.HeaderSize = sizeof(shim_rt);
+	shim_rt.GetVariable = shim_get_variable;
+	shim_rt.SetVariable = shim_set_variable;
+	shim_rt.ResetSystem = (EFI_RESET_SYSTEM)shim_reset_system;
+
+	shim_conout.Reset = (EFI_TEXT_RESET)shim_success;
+	shim_conout.OutputString = shim_output_string;
+	shim_conout.TestString = (EFI_TEXT_TEST_STRING)shim_success;
+	shim_conout.QueryMode = (EFI_TEXT_QUERY_MODE)unsupported;
+	shim_conout.SetMode = (EFI_TEXT_SET_MODE)unsupported;
+	shim_conout.SetAttribute = (EFI_TEXT_SET_ATTRIBUTE)shim_success;
+	shim_conout.ClearScreen = (EFI_TEXT_CLEAR_SCREEN)shim_success;
+	shim_conout.SetCursorPosition = (EFI_TEXT_SET_CURSOR_POSITION)shim_success;
+	shim_conout.EnableCursor = (EFI_TEXT_ENABLE_CURSOR)shim_success;
+	shim_conout.Mode = &shim_conout_mode;
+
+	shim_st.Hdr.Signature = EFI_SYSTEM_TABLE_SIGNATURE;
+	shim_st.Hdr.Revision = EFI_SYSTEM_TABLE_REVISION;
+	shim_st.Hdr.HeaderSize = sizeof(shim_st);
+	shim_st.FirmwareVendor = L"kernelflinger host shim";
+	shim_st.ConOut = &shim_conout;
+	shim_st.StdErr = &shim_conout;
+	shim_st.BootServices = &shim_bs;
+	shim_st.RuntimeServices = &shim_rt;
+
+	/* There is no loaded image, gnu-efi only uses the handle to
+	 * look up protocols the shim does not provide. */
+	InitializeLib(NULL, &shim_st);
+
+	return EFI_SUCCESS;
+}
+
+void shim_exit(void)
+{
+	struct shim_var *var;
+	UINTN i;
+
+	for (i = 0; i < nb_disks; i++) {
+		close(disks[i]->fd);
+		free(disks[i]);
+	}
+	nb_disks = 0;
+
+	while (variables) {
+		var = variables;
+		variables = var->next;
+		free_variable(var);
+	}
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef _SHIM_H_
+#define _SHIM_H_
+
+#include <efi.h>
+
+/* Thin UEFI environment used to run platform-neutral kernelflinger
+ * code on a Linux host.  Boot and runtime services are backed by the
+ * C library, Block IO and Disk IO protocols are backed by files and
+ * EFI variables live in memory. */
+
+EFI_STATUS shim_init(BOOLEAN verbose);
+void shim_exit(void);
+
+/* Register the file at PATH as a disk.  The disk is exposed to
+ * LocateHandleBuffer() and HandleProtocol() as a Block IO + Disk IO
+ * handle with BLOCK_SIZE bytes blocks. */
+EFI_STATUS shim_add_disk(const char *path, UINT32 block_size,
+			 EFI_HANDLE *handle);
+
+/* Number of SetVariable() calls which reached the variable store. */
+UINTN shim_variable_writes(void);
+
+UINT32 shim_crc32(const void *data, UINTN size);
+
+#endif	/* _SHIM_H_ */
@@ -157,6 +157,7 @@ set(LIB_ADB_SOURCES
 	${LIB_ADB_SOURCE}/reboot_service.c
 	${LIB_ADB_SOURCE}/sync_service.c
 	${LIB_ADB_SOURCE}/reader.c
+	${LIB_ADB_SOURCE}/lz4.c
 	)
 
 set(LIB_ELFLOADER_SOURCES
@@ -170,6 +171,7 @@ set(LIB_FASTBOOT_SOURCES
 	#${LIB_FASTBOOT_SOURCE}/fastboot_oem.c
 	${LIB_FASTBOOT_SOURCE}/fastboot_flashing.c
 	${LIB_FASTBOOT_SOURCE}/flash.c
+	${LIB_FASTBOOT_SOURCE}/flash_jobs.c
 	${LIB_FASTBOOT_SOURCE}/sparse.c
 	${LIB_FASTBOOT_SOURCE}/info.c
 	${LIB_FASTBOOT_SOURCE}/intel_variables.c
@@ -191,6 +193,8 @@ set(LIB_KERNELFLINGER_SOURCES
 	${LIB_KERNELFLINGER_SOURCE}/log.c
 	${LIB_KERNELFLINGER_SOURCE}/em.c
 	${LIB_KERNELFLINGER_SOURCE}/gpt.c
+	${LIB_KERNELFLINGER_SOURCE}/block_reader.c
+	${LIB_KERNELFLINGER_SOURCE}/bufpool.c
 	${LIB_KERNELFLINGER_SOURCE}/storage.c
 	${LIB_KERNELFLINGER_SOURCE}/pci.c
 	${LIB_KERNELFLINGER_SOURCE}/mmc.c
@@ -214,6 +218,7 @@ set(LIB_KERNELFLINGER_SOURCES
 	${LIB_KERNELFLINGER_SOURCE}/rpmb/rpmb_nvme.c
 	${LIB_KERNELFLINGER_SOURCE}/nvme.c
 	${LIB_KERNELFLINGER_SOURCE}/timer.c
+	${LIB_KERNELFLINGER_SOURCE}/trace.c
 	${LIB_KERNELFLINGER_SOURCE}/virtual_media.c
 	${LIB_KERNELFLINGER_SOURCE}/general_block.c
 	${LIB_KERNELFLINGER_SOURCE}/slot.c
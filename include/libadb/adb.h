@@ -56,12 +56,24 @@ typedef struct adb_msg {
 	UINT32 magic;		/* command ^ 0xffffffff             */
 } adb_msg_t;
 
+/* Protocol versions: starting with version 2, the data_check field
+ * is not computed nor checked anymore and payloads can be up to
+ * ADB_MAX_PAYLOAD bytes.  */
+#define ADB_VERSION_MIN			0x01000000
+#define ADB_VERSION_SKIP_CHECKSUM	0x01000001
+#define ADB_VERSION			ADB_VERSION_SKIP_CHECKSUM
+
 #define ADB_MIN_PAYLOAD 4096
-#define ADB_MAX_PAYLOAD 262144
+#define ADB_MAX_PAYLOAD (1024 * 1024)
 
 /* Negociated (CONNECT hand-shake) maximum buffer size */
 extern UINT32 adb_max_payload;
 
+/* Negociated (CONNECT hand-shake) delayed_ack feature: the sockets
+ * flow control counts bytes, each OKAY message carries the number of
+ * bytes acknowledged.  */
+extern BOOLEAN adb_delayed_ack;
+
 typedef struct adb_pkt {
 	adb_msg_t msg;
 	unsigned char *data;
@@ -74,5 +86,6 @@ enum boot_target adb_get_boot_target(void);
 void adb_set_boot_target(enum boot_target bt);
 
 EFI_STATUS adb_send_pkt(adb_pkt_t *pkt, UINT32 command, UINT32 arg0, UINT32 arg1);
+EFI_STATUS adb_send_okay(UINT32 local, UINT32 remote, UINT32 acked);
 
 #endif	/* _ADB_H_ */
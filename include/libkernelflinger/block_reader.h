@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef _BLOCK_READER_H_
+#define _BLOCK_READER_H_
+
+#include <efi.h>
+#include "gpt.h"
+
+/* Streaming partition reader.  Up to BLOCK_READER_MAX_DEPTH chunks
+ * are read ahead of the consumer with the asynchronous Disk I/O 2
+ * protocol so that the disk reads overlap with the processing of the
+ * previous chunk.  It falls back to synchronous Disk I/O reads if the
+ * Disk I/O 2 protocol is not available.
+ *
+ * The buffer returned by block_reader_next() remains valid until the
+ * next call.  A zero length means that the end has been reached. */
+#define BLOCK_READER_MAX_DEPTH 4
+
+struct block_reader;
+
+EFI_STATUS block_reader_open(struct block_reader **br,
+			     struct gpt_partition_interface *gparti,
+			     UINT64 offset, UINT64 len,
+			     UINTN chunk_size, UINTN depth);
+EFI_STATUS block_reader_next(struct block_reader *br, unsigned char **buf,
+			     UINTN *len);
+void block_reader_close(struct block_reader *br);
+
+#endif	/* _BLOCK_READER_H_ */
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _BUFPOOL_H_
+#define _BUFPOOL_H_
+
+#include <efi.h>
+
+/* Pool of large transient buffers.  The buffers are allocated with
+ * AllocatePages() in size classes and kept for reuse once they are
+ * released, up to BUFPOOL_MAX_CACHED bytes.  The size classes are
+ * the powers of two and their midpoints from BUFPOOL_MIN_SIZE to
+ * BUFPOOL_MAX_SIZE.  Buffers larger than BUFPOOL_MAX_SIZE are not
+ * kept.
+ *
+ * The buffers are page aligned, or aligned on ALIGN bytes if ALIGN is
+ * larger, as required by the Block I/O IoAlign.  Their content is
+ * undefined. */
+#define BUFPOOL_MIN_SIZE (64 * 1024)
+#define BUFPOOL_MAX_SIZE (32 * 1024 * 1024)
+#define BUFPOOL_MAX_CACHED (64 * 1024 * 1024)
+
+struct bufpool_stats {
+	UINTN in_use;		/* bytes of the borrowed buffers */
+	UINTN cached;		/* bytes of the buffers kept for reuse */
+	UINTN high_water;	/* maximum of in_use + cached */
+	UINTN hits;		/* requests served by a kept buffer */
+	UINTN misses;		/* requests which allocated pages */
+};
+
+EFI_STATUS bufpool_get(UINTN size, UINTN align, VOID **buf);
+void bufpool_put(VOID *buf);
+void bufpool_flush(void);
+void bufpool_get_stats(struct bufpool_stats *stats);
+
+#endif	/* _BUFPOOL_H_ */
@@ -64,6 +64,7 @@ typedef INTN ssize_t;
 
 #define panic(x, ...) do { \
     error(x, ##__VA_ARGS__); \
+    log_flush(); \
     pause(30); \
     halt_system(); \
 } while(0)
@@ -227,6 +228,7 @@ void sort_memory_map(void *descr, UINTN nr_descr, UINTN descr_sz);
 UINT64 efi_time_to_ctime(EFI_TIME *time);
 
 VOID cpuid(UINT32 op, UINT32 reg[4]);
+VOID cpuid_count(UINT32 op, UINT32 subop, UINT32 reg[4]);
 
 EFI_STATUS generate_random_numbers(CHAR8 *data, UINTN size);
 
@@ -39,6 +39,17 @@
 
 EFI_STATUS log_flush_to_var(BOOLEAN nonvol);
 
+/* Serial output is asynchronous.  log_drain() pushes a bounded
+ * amount of pending output and is meant for idle points, log_flush()
+ * writes out everything, it must be called before leaving the boot
+ * services or halting the system.  log_exit() flushes and stops the
+ * periodic drain, the output is synchronous afterwards: it must be
+ * called before returning from efi_main() or starting another image
+ * as the drain timer would call into an unloaded image. */
+void log_drain(void);
+void log_flush(void);
+void log_exit(void);
+
 void log(const CHAR16 *fmt, ...);
 void vlog(const CHAR16 *fmt, va_list args);
 
@@ -45,7 +45,22 @@ enum TM_POINT {
 	TM_POINT_LAST
 };
 
+static inline uint64_t __attribute__((unused,always_inline))
+__RDTSC (void)
+{
+	uint32_t lo, hi;
+
+	asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+	return (uint64_t) hi << 32 | lo;
+}
+
+/* TSC based clock.  The TSC frequency is computed on first use and
+ * then cached so that all these functions are O(1). */
+uint32_t get_tsc_khz(void);
 uint32_t get_cpu_freq(void);
+uint64_t get_tsc_ticks(void);
+uint64_t tsc_ticks_to_usec(uint64_t ticks);
+uint64_t boottime_in_usec(void);
 uint32_t boottime_in_msec(void);
 void set_boottime_stamp(int num);
 void set_efi_enter_point(unsigned int value);
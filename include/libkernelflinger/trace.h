@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <efi.h>
+
+/* Boot trace events are recorded as TSC timestamps in a fixed size
+ * ring, exported as a binary blob through the TRACE_VAR EFI variable
+ * or the crashmode "trace" reader, and converted into a Chrome/Perfetto
+ * timeline by tools/trace2json.py.  Keep the trace_names[] table in
+ * trace.c in sync with this enumeration. */
+enum trace_event_id {
+	TRACE_BOOT_STAGE = 0,	/* argument is the TM_POINT */
+	TRACE_GPT_LOOKUP,
+	TRACE_READ_DISK,	/* argument is the size in KiB */
+	TRACE_AVB_VERIFY,
+	TRACE_RSA_VERIFY,
+	TRACE_TRUSTY_LOAD,
+	TRACE_ACPI_INSTALL,
+	TRACE_ID_LAST
+};
+
+enum trace_event_type {
+	TRACE_TYPE_BEGIN = 0,
+	TRACE_TYPE_END,
+	TRACE_TYPE_INSTANT
+};
+
+#define TRACE_MAGIC	0x5254464b	/* "KFTR" */
+#define TRACE_VERSION	1
+#define TRACE_NAME_LEN	16
+
+struct trace_header {
+	UINT32 magic;
+	UINT16 version;
+	UINT16 name_len;
+	UINT32 tsc_khz;
+	UINT32 nb_ids;
+	UINT32 nb_events;
+	UINT32 dropped;
+	/* Followed by nb_ids names of name_len bytes and nb_events
+	 * struct trace_event, oldest first. */
+} __attribute__((packed));
+
+struct trace_event {
+	UINT64 tsc;
+	UINT32 arg;
+	UINT16 id;
+	UINT16 type;
+} __attribute__((packed));
+
+#ifdef USE_BOOT_TRACE
+void trace_event(enum trace_event_id id, enum trace_event_type type, UINT32 arg);
+
+struct trace_scope {
+	enum trace_event_id id;
+	UINT32 arg;
+};
+
+static inline struct trace_scope trace_scope_begin(enum trace_event_id id, UINT32 arg)
+{
+	struct trace_scope scope = { .id = id, .arg = arg };
+
+	trace_event(id, TRACE_TYPE_BEGIN, arg);
+	return scope;
+}
+
+static inline void trace_scope_end(struct trace_scope *scope)
+{
+	trace_event(scope->id, TRACE_TYPE_END, scope->arg);
+}
+
+#define TRACE_BEGIN(id, arg) trace_event(id, TRACE_TYPE_BEGIN, arg)
+#define TRACE_END(id, arg) trace_event(id, TRACE_TYPE_END, arg)
+#define TRACE_INSTANT(id, arg) trace_event(id, TRACE_TYPE_INSTANT, arg)
+
+/* Trace from this point up to the end of the enclosing scope. */
+#define __TRACE_SCOPE_VAR(line) __trace_scope_ ## line
+#define _TRACE_SCOPE_VAR(line) __TRACE_SCOPE_VAR(line)
+#define TRACE_SCOPE(id, arg)						\
+	struct trace_scope _TRACE_SCOPE_VAR(__LINE__)			\
+	__attribute__((cleanup(trace_scope_end), unused)) =		\
+		trace_scope_begin(id, arg)
+#else
+#define TRACE_BEGIN(id, arg) (void)0
+#define TRACE_END(id, arg) (void)0
+#define TRACE_INSTANT(id, arg) (void)0
+#define TRACE_SCOPE(id, arg) do { } while (0)
+#endif
+
+/* Allocate and fill a buffer with the binary trace holding at most
+ * MAX_SIZE bytes, the most recent events being kept.  The caller is
+ * responsible for freeing the buffer. */
+EFI_STATUS trace_export(void **buf, UINTN *size, UINTN max_size);
+EFI_STATUS trace_save_to_var(void);
+
+#endif	/* _TRACE_H_ */
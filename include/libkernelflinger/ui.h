@@ -49,8 +49,15 @@ extern EFI_GRAPHICS_OUTPUT_BLT_PIXEL	COLOR_HIGHLIGHT;
 extern EFI_GRAPHICS_OUTPUT_BLT_PIXEL	COLOR_ORANGE;
 
 /* Image */
+typedef enum ui_image_format {
+	UI_IMAGE_PNG = 0,	/* PNG file, decoded on first use */
+	UI_IMAGE_BLT,		/* Pre-decoded BGRA BLT pixels, used in place */
+	UI_IMAGE_RLE		/* Run-length encoded BGRA BLT pixels */
+} ui_image_format_t;
+
 typedef struct image {
 	const char *name;
+	const ui_image_format_t format;
 	const UINT8 *data;
 	const UINTN size;
 	EFI_GRAPHICS_OUTPUT_BLT_PIXEL *blt;
@@ -80,6 +80,9 @@ extern const UINTN FASTBOOT_SECURED_VARS_SIZE;
 /* EFI variable to store the kernelflinger logs.  */
 #define LOG_VAR			L"KernelflingerLogs"
 
+/* EFI variable to store the kernelflinger binary boot trace.  */
+#define TRACE_VAR		L"KernelflingerTrace"
+
 #ifndef USER
 #define CMDLINE_PREPEND_VAR     L"PrependCmdline"
 #define CMDLINE_APPEND_VAR      L"AppendCmdline"
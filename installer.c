@@ -42,12 +42,12 @@
 #include "flash.h"
 #include "gpt.h"
 #include "sparse.h"
-#include "sparse_format.h"
 #include "fastboot.h"
 #include "fastboot_oem.h"
 #include "text_parser.h"
 #include "android.h"
 #include "slot.h"
+#include "timer.h"
 
 static BOOLEAN last_cmd_succeeded;
 static fastboot_handle fastboot_flash_cmd;
@@ -60,6 +60,16 @@ static UINTN fastboot_cmd_buf_len;
 static char command_buffer[256]; /* Large enough to fit long filename
 				    on flash command.  */
 static struct download_buffer *dl;
+static struct command {
+	BOOLEAN optional;
+	BOOLEAN parallel;
+	char *cmd;
+} *commands;
+static UINTN command_nb;
+static UINTN current_command;
+
+/* Per command time accounting. */
+static UINT64 cmd_start_us, read_us, flash_us;
 
 #define inst_perror(ret, x, ...) do { \
 	fastboot_fail(x ": %r", ##__VA_ARGS__, ret); \
@@ -157,6 +167,7 @@ static void installer_flash_buffer(void *data, unsigned size,
 				   INTN argc, CHAR8 **argv)
 {
 	void *data_save = dl->data;
+	UINT64 start = boottime_in_usec();
 
 	dl->data = data;
 	dl->size = size;
@@ -166,395 +177,599 @@ static void installer_flash_buffer(void *data, unsigned size,
 
 	dl->data = data_save;
 	dl->size = 0;
+
+	flash_us += boottime_in_usec() - start;
 }
 
-static EFI_STATUS read_file(EFI_FILE *file, UINTN size, void *data)
+/* Errors are not reported, NSIZE is the number of bytes read.  */
+static EFI_STATUS read_file_sync(EFI_FILE *file, UINTN size, void *data,
+				 UINTN *nsize)
 {
 	EFI_STATUS ret;
-	UINTN nsize = size;
+	UINT64 start = boottime_in_usec();
 
-	ret = uefi_call_wrapper(file->Read, 3, file, &nsize, data);
-	if (EFI_ERROR(ret)) {
-		inst_perror(ret, "Failed to read file");
+	*nsize = size;
+	ret = uefi_call_wrapper(file->Read, 3, file, nsize, data);
+	read_us += boottime_in_usec() - start;
+	if (EFI_ERROR(ret))
 		return ret;
-	}
-	if (size != nsize) {
+
+	return *nsize == size ? EFI_SUCCESS : EFI_END_OF_FILE;
+}
+
+static EFI_STATUS read_file(EFI_FILE *file, UINTN size, void *data)
+{
+	EFI_STATUS ret;
+	UINTN nsize;
+
+	ret = read_file_sync(file, size, data, &nsize);
+	if (ret == EFI_END_OF_FILE && nsize != size) {
 		fastboot_fail("Failed to read %d bytes (only %d read)",
 		    		  size, nsize);
 		return EFI_INVALID_PARAMETER;
 	}
+	if (EFI_ERROR(ret))
+		inst_perror(ret, "Failed to read file");
 
 	return ret;
 }
 
-typedef struct flash_buffer {
-	struct sparse_header sph;
-	struct chunk_header skip_ckh;
-	union {
-		struct chunk_header ckh;
-		char data[1];
-	} d;
-	char ckh_data[1];
-} __attribute__((__packed__)) flash_buffer_t;
-
-/*when flash big chunks and in two image should add read_flags*/
-static EFI_STATUS installer_flash_big_chunk_multiple(EFI_FILE **file, UINTN *read_flags,
-	UINTN file_size, UINTN *remaining_data, flash_buffer_t *fb, UINTN argc, CHAR8 **argv)
+/* Asynchronous file read.  When the file system implements the
+   ReadEx() service of the revision 2 of the file protocol, the read
+   runs in the background while the caller flashes another buffer.
+   Otherwise, read_file_start() falls back to a synchronous read.
+   Errors are not reported to the fastboot host so that a read ahead
+   failure is only reported by the command which needs the data.  */
+#define FILE_PROTOCOL_REVISION2 0x00020000
+
+struct file_read {
+	EFI_FILE_IO_TOKEN token;
+	UINTN size;
+	BOOLEAN pending;
+};
+
+static EFI_STATUS read_file_start(struct file_read *rd, EFI_FILE *file,
+				  UINTN size, void *data)
 {
-	EFI_STATUS ret = EFI_INVALID_PARAMETER;
-	UINTN payload_size, read_size, already_read, ckh_blks, data_size;
-	const UINTN MAX_DATA_SIZE = dl->max_size - offsetof(flash_buffer_t, ckh_data);
-	const UINTN MAX_BLKS = MAX_DATA_SIZE / fb->sph.blk_sz;
-	const UINTN HEADER_SIZE = offsetof(flash_buffer_t, d);
-	struct chunk_header *ckh;
-	void *read_ptr;
-
-	ckh = &fb->d.ckh;
-	payload_size = ckh->total_sz - sizeof(*ckh);
-	fb->sph.total_chunks = 2; /* skip and data chunks. */
-
-	for (ckh_blks = ckh->chunk_sz; ckh_blks; ckh_blks -= ckh->chunk_sz) {
-		ckh->chunk_sz = min(MAX_BLKS, ckh_blks);
-		data_size = ckh->chunk_sz * fb->sph.blk_sz;
-		ckh->total_sz = sizeof(*ckh) + data_size;
-		fb->sph.total_blks = fb->skip_ckh.chunk_sz + ckh->chunk_sz;
-		installer_flash_buffer(fb, ckh->total_sz + HEADER_SIZE, argc, argv);
-		if (!last_cmd_succeeded)
-			return EFI_INVALID_PARAMETER;
+	EFI_STATUS ret;
+	UINTN nsize;
 
-		payload_size -= data_size;
-		if (!payload_size)
-			break;
+	rd->size = size;
+	rd->pending = FALSE;
 
-		/* Move the incomplete data from the end to the
-		   beginning of the buffer. */
-		read_ptr = fb->ckh_data;
-		read_size = min(payload_size, MAX_DATA_SIZE);
-		if (data_size < MAX_DATA_SIZE) {
-			already_read = MAX_DATA_SIZE - data_size;
-			memcpy(read_ptr, fb->d.data + ckh->total_sz, already_read);
-			read_size -= already_read;
-			read_ptr += already_read;
-			if (read_size > file_size) {
-				ret = read_file(file[*read_flags], file_size, read_ptr);
-				if (EFI_ERROR(ret))
-					return ret;
-				read_size -= file_size;
-				read_ptr += file_size;
-				*remaining_data -= file_size;
-				(*read_flags)++;
-				}
+	if (file->Revision >= FILE_PROTOCOL_REVISION2) {
+		if (!rd->token.Event) {
+			ret = uefi_call_wrapper(BS->CreateEvent, 5, 0, 0, NULL,
+						NULL, &rd->token.Event);
+			if (EFI_ERROR(ret))
+				rd->token.Event = NULL;
 		}
-		ret = read_file(file[*read_flags], read_size, read_ptr);
-		if (EFI_ERROR(ret))
-			return ret;
-		*remaining_data -= read_size;
 
-		fb->skip_ckh.chunk_sz += ckh->chunk_sz;
+		if (rd->token.Event) {
+			rd->token.Status = EFI_SUCCESS;
+			rd->token.BufferSize = size;
+			rd->token.Buffer = data;
+			ret = uefi_call_wrapper(file->ReadEx, 2, file, &rd->token);
+			if (!EFI_ERROR(ret)) {
+				rd->pending = TRUE;
+				return EFI_SUCCESS;
+			}
+			if (ret != EFI_UNSUPPORTED)
+				return ret;
+		}
 	}
 
-	if (payload_size)
-		return EFI_INVALID_PARAMETER;
+	return read_file_sync(file, size, data, &nsize);
+}
+
+/* Wait for the completion of the read started by read_file_start().  */
+static EFI_STATUS read_file_wait(struct file_read *rd)
+{
+	UINT64 start;
+
+	if (!rd->pending)
+		return EFI_SUCCESS;
+
+	start = boottime_in_usec();
+	while (uefi_call_wrapper(BS->CheckEvent, 1, rd->token.Event) == EFI_NOT_READY)
+		;
+	read_us += boottime_in_usec() - start;
+	rd->pending = FALSE;
+
+	if (EFI_ERROR(rd->token.Status))
+		return rd->token.Status;
+
+	return rd->token.BufferSize == rd->size ? EFI_SUCCESS : EFI_END_OF_FILE;
+}
+
+static void read_file_free(struct file_read *rd)
+{
+	read_file_wait(rd);
+	if (rd->token.Event) {
+		uefi_call_wrapper(BS->CloseEvent, 1, rd->token.Event);
+		rd->token.Event = NULL;
+	}
+}
+
+/* Batch pipelining: while a file is flashed, the file of the next
+   command, if it is a flash command, is read ahead.  */
+static struct prefetch {
+	CHAR16 *filename;
+	EFI_FILE *file;
+	void *data;
+	UINTN size;
+	struct file_read rd;
+	EFI_STATUS status;	/* Read ahead failure */
+} prefetch;
+
+static void prefetch_release(void)
+{
+	read_file_free(&prefetch.rd);
+	if (prefetch.file)
+		uefi_call_wrapper(prefetch.file->Close, 1, prefetch.file);
+	if (prefetch.data)
+		FreePool(prefetch.data);
+	prefetch.file = NULL;
+	prefetch.data = NULL;
+}
+
+static void prefetch_free(void)
+{
+	prefetch_release();
+	if (prefetch.filename)
+		FreePool(prefetch.filename);
+	memset(&prefetch, 0, sizeof(prefetch));
+}
+
+static void prefetch_next_file(void)
+{
+	EFI_STATUS ret;
+	char *cmd, *token, *saveptr, *file = NULL;
+	UINTN argc;
+
+	if (prefetch.filename || current_command == command_nb)
+		return;
+
+	cmd = strdup(commands[current_command].cmd);
+	if (!cmd)
+		return;
+
+	/* Only "flash LABEL FILE" commands are read ahead. */
+	token = strtok_r(cmd, " ", &saveptr);
+	for (argc = 0; token; argc++, token = strtok_r(NULL, " ", &saveptr))
+		if (argc == 2)
+			file = token;
+	if (argc != 3 || strcmp((CHAR8 *)cmd, (CHAR8 *)"flash"))
+		goto out;
+
+	prefetch.filename = stra_to_str((CHAR8 *)file);
+	if (!prefetch.filename)
+		goto out;
+
+	ret = uefi_get_file_size(file_io_interface, prefetch.filename,
+				 &prefetch.size);
+	if (EFI_ERROR(ret))
+		goto fail;
+
+	/* Streamed or not enough memory, the command reads the file.  */
+	if (prefetch.size > dl->max_size)
+		goto err;
+
+	prefetch.data = AllocatePool(prefetch.size);
+	if (!prefetch.data)
+		goto err;
+
+	ret = uefi_open_file(file_io_interface, prefetch.filename, &prefetch.file);
+	if (EFI_ERROR(ret)) {
+		prefetch.file = NULL;
+		goto fail;
+	}
+
+	ret = read_file_start(&prefetch.rd, prefetch.file, prefetch.size,
+			      prefetch.data);
+	if (EFI_ERROR(ret))
+		goto fail;
+
+	goto out;
+
+fail:
+	/* The current command is still running, the failure is
+	   reported by prefetch_take() once the next one runs.  */
+	prefetch_release();
+	prefetch.status = ret;
+	goto out;
+err:
+	prefetch_free();
+out:
+	FreePool(cmd);
+}
+
+/* Hand over the read ahead content of FILENAME if any.  */
+static EFI_STATUS prefetch_take(CHAR16 *filename, void **data, UINTN *size)
+{
+	EFI_STATUS ret;
+
+	if (!prefetch.filename || StrCmp(prefetch.filename, filename)) {
+		prefetch_free();
+		return EFI_NOT_FOUND;
+	}
+
+	ret = prefetch.status;
+	if (!EFI_ERROR(ret))
+		ret = read_file_wait(&prefetch.rd);
+	if (EFI_ERROR(ret)) {
+		prefetch_free();
+		return ret;
+	}
+
+	*data = prefetch.data;
+	*size = prefetch.size;
+	prefetch.data = NULL;
+	prefetch_free();
 
 	return EFI_SUCCESS;
 }
 
-/* This function splits a chunk too large to fit into a
-   dl->max_size buffer into smaller chunks and flash them. */
-static EFI_STATUS installer_flash_big_chunk(EFI_FILE *file, UINTN *remaining_data,
-					    flash_buffer_t *fb, UINTN argc, CHAR8 **argv)
+/* Large sparse images streaming.  The N files of a split image are
+   read as one logical stream into the two halves of the download
+   buffer: while the chunks of one half are flashed, the next piece of
+   the stream is read into the other half.  The few bytes of a header
+   or of a block straddling the two halves are copied in the headroom
+   in front of the next piece.  */
+#define STREAM_HEADROOM (64 * 1024)
+
+struct file_stream {
+	EFI_FILE **file;
+	UINTN *left;		/* Bytes not read yet of each file. */
+	UINTN nb, cur;
+	void *buf[2];
+	UINTN buf_sz;
+	UINTN idx;		/* Buffer being consumed. */
+	void *pos;
+	UINTN avail;
+	struct file_read rd;	/* Read in progress in the other buffer. */
+	UINTN next_len;
+	BOOLEAN read_failed;
+};
+
+static EFI_STATUS stream_read_next(struct file_stream *s)
 {
-	EFI_STATUS ret = EFI_INVALID_PARAMETER;
-	UINTN payload_size, read_size, already_read, ckh_blks, data_size;
-	const UINTN MAX_DATA_SIZE = dl->max_size - offsetof(flash_buffer_t, ckh_data);
-	const UINTN MAX_BLKS = MAX_DATA_SIZE / fb->sph.blk_sz;
-	const UINTN HEADER_SIZE = offsetof(flash_buffer_t, d);
-	struct chunk_header *ckh;
-	void *read_ptr;
-
-	ckh = &fb->d.ckh;
-	payload_size = ckh->total_sz - sizeof(*ckh);
-	fb->sph.total_chunks = 2; /* skip and data chunks. */
-
-	for (ckh_blks = ckh->chunk_sz; ckh_blks; ckh_blks -= ckh->chunk_sz) {
-		ckh->chunk_sz = min(MAX_BLKS, ckh_blks);
-		data_size = ckh->chunk_sz * fb->sph.blk_sz;
-		ckh->total_sz = sizeof(*ckh) + data_size;
-		fb->sph.total_blks = fb->skip_ckh.chunk_sz + ckh->chunk_sz;
-
-		installer_flash_buffer(fb, ckh->total_sz + HEADER_SIZE, argc, argv);
-		if (!last_cmd_succeeded)
-			return EFI_INVALID_PARAMETER;
+	EFI_STATUS ret;
+	UINTN size;
 
-		payload_size -= data_size;
-		if (!payload_size)
-			break;
+	while (s->cur < s->nb && !s->left[s->cur])
+		s->cur++;
 
-		/* Move the incomplete data from the end to the
-		   beginning of the buffer. */
-		read_ptr = fb->ckh_data;
-		read_size = min(payload_size, MAX_DATA_SIZE);
-		if (data_size < MAX_DATA_SIZE) {
-			already_read = MAX_DATA_SIZE - data_size;
-			memcpy(read_ptr, fb->d.data + ckh->total_sz, already_read);
-			read_size -= already_read;
-			read_ptr += already_read;
-		}
+	if (s->cur == s->nb) {
+		s->next_len = 0;
+		return EFI_SUCCESS;
+	}
+
+	size = min(s->buf_sz, s->left[s->cur]);
+	ret = read_file_start(&s->rd, s->file[s->cur], size,
+			      s->buf[!s->idx] + STREAM_HEADROOM);
+	if (EFI_ERROR(ret)) {
+		inst_perror(ret, "Failed to read file");
+		s->read_failed = TRUE;
+		return ret;
+	}
 
-		ret = read_file(file, read_size, read_ptr);
+	s->left[s->cur] -= size;
+	s->next_len = size;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS stream_switch(struct file_stream *s)
+{
+	EFI_STATUS ret;
+	void *dst;
+
+	ret = read_file_wait(&s->rd);
+	if (EFI_ERROR(ret)) {
+		inst_perror(ret, "Failed to read file");
+		s->read_failed = TRUE;
+		return ret;
+	}
+
+	if (!s->next_len)
+		return EFI_END_OF_FILE;
+
+	dst = s->buf[!s->idx] + STREAM_HEADROOM - s->avail;
+	memcpy(dst, s->pos, s->avail);
+	s->pos = dst;
+	s->avail += s->next_len;
+	s->idx = !s->idx;
+
+	return stream_read_next(s);
+}
+
+static EFI_STATUS stream_read(void *ctx, UINTN unit, UINTN max,
+			      void **data, UINTN *len)
+{
+	struct file_stream *s = ctx;
+	EFI_STATUS ret;
+
+	if (unit > STREAM_HEADROOM)
+		return EFI_BAD_BUFFER_SIZE;
+
+	while (s->avail < unit) {
+		ret = stream_switch(s);
 		if (EFI_ERROR(ret))
 			return ret;
-		*remaining_data -= read_size;
-
-		fb->skip_ckh.chunk_sz += ckh->chunk_sz;
 	}
 
-	if (payload_size)
-		return EFI_INVALID_PARAMETER;
+	*len = min(max, s->avail);
+	if (*len != max)
+		*len -= *len % unit;
+
+	*data = s->pos;
+	s->pos += *len;
+	s->avail -= *len;
 
 	return EFI_SUCCESS;
 }
-/*this function splits a huge sparse file and put together the two image*/
-static void installer_split_and_joint_flash(CHAR16 **filename,
-						UINTN *size, UINTN num, UINTN argc, CHAR8 **argv)
+
+static void installer_flash_stream(CHAR16 **filename, UINTN *size, UINTN nb,
+				   CHAR8 *target)
 {
 	EFI_STATUS ret;
-	flash_buffer_t *fb;
-	UINTN  read_flags = 0;
-	struct sparse_header sph;
-	struct chunk_header *ckh;
-	UINTN read_size, flash_size, already_read = 0, remaining_data = 0;
-	void *read_ptr;
-	INTN nb_chunks;
-	EFI_FILE *file[num];
-	UINT32 blk_count;
+	struct file_stream s;
+	EFI_FILE *file[nb];
+	CHAR16 *label;
+	UINTN half, i;
+	UINT64 start = boottime_in_usec(), read_start = read_us;
+
+	label = stra_to_str(target);
+	if (!label) {
+		fastboot_fail("Failed to convert CHAR8 label to CHAR16");
+		return;
+	}
 
+	memset(&s, 0, sizeof(s));
 	memset(file, 0, sizeof(file));
-	const UINTN HEADER_SIZE = offsetof(flash_buffer_t, d);
-	const UINTN MAX_DATA_SIZE = dl->max_size - HEADER_SIZE;
-	for (UINTN i = 0; i < num; i++) {
-		remaining_data = remaining_data + size[i];
+	for (i = 0; i < nb; i++) {
 		ret = uefi_open_file(file_io_interface, filename[i], &file[i]);
 		if (EFI_ERROR(ret)) {
 			inst_perror(ret, "Failed to open %s file", filename[i]);
-			return;
+			goto exit;
 		}
 	}
 
-	ret = read_file(file[0], sizeof(sph), &sph);
-	if (EFI_ERROR(ret))
-		return;
-	remaining_data -= sizeof(sph);
-	size[read_flags] -=  sizeof(sph);
-	if (!is_sparse_image((void *) &sph, sizeof(sph))) {
-		fastboot_fail("sparse file expected");
-		return;
+	half = (dl->max_size / 2) & ~(EFI_PAGE_SIZE - 1);
+	s.file = file;
+	s.left = size;
+	s.nb = nb;
+	s.buf[0] = dl->data;
+	s.buf[1] = dl->data + half;
+	s.buf_sz = half - STREAM_HEADROOM;
+	s.idx = 1;
+
+	info(L"Flashing %s ...", label);
+	ret = stream_read_next(&s);
+	if (!EFI_ERROR(ret))
+		ret = flash_partition_stream(stream_read, &s, label);
+	read_file_free(&s.rd);
+
+	if (EFI_ERROR(ret)) {
+		if (!s.read_failed)
+			fastboot_fail("Flash failure: %r", ret);
+	} else {
+		gpt_sync();
+		info(L"Flash done.");
+		fastboot_okay("");
 	}
-	fb = dl->data;
-	memcpy(&fb->sph, &sph, sizeof(sph));
-	/* Sparse skip chunk. */
-	fb->skip_ckh.chunk_type = CHUNK_TYPE_DONT_CARE;
-	fb->skip_ckh.total_sz = sizeof(fb->skip_ckh);
-	nb_chunks = sph.total_chunks;
-	read_size = MAX_DATA_SIZE;
-	read_ptr = fb->d.data;
-	blk_count = 0;
-	while (nb_chunks > 0 && remaining_data > 0) {
-		fb->sph.total_chunks = 1;
-		fb->sph.total_blks = fb->skip_ckh.chunk_sz = blk_count;
-		if (remaining_data < read_size)
-			read_size = remaining_data;
-		/* Read a new piece of the input sparse file. */
-		ret = read_file(file[read_flags], read_size, read_ptr);
-		if (EFI_ERROR(ret))
-			goto exit;
-		remaining_data -= read_size;
-		size[read_flags] -= read_size;
-		/* Process the loaded chunks to build the new header
-		   and the skip chunk. */
-		flash_size = HEADER_SIZE;
-		ckh = &fb->d.ckh;
-		while ((void *)ckh + sizeof(*ckh) <= read_ptr + read_size &&
-				(void *)ckh + ckh->total_sz <= read_ptr + read_size) {
-			if (nb_chunks == 0)
-				goto exit;
-			flash_size += ckh->total_sz;
-			fb->sph.total_blks += ckh->chunk_sz;
-			blk_count += ckh->chunk_sz;
-			fb->sph.total_chunks++;
-			nb_chunks--;
-			ckh = (void *)ckh + ckh->total_sz;
-		}
-		/* chunk is too big to fit in the download buffer. */
-		if (flash_size == HEADER_SIZE) {
-			if (ckh->chunk_type != CHUNK_TYPE_RAW ||
-					remaining_data < ckh->total_sz - MAX_DATA_SIZE) {
-				fastboot_fail("Corrupted sparse file");
-				goto exit;
-			}
+	flush_tx_buffer();
 
-			blk_count += ckh->chunk_sz;
-			nb_chunks--;
+	flash_us += boottime_in_usec() - start - (read_us - read_start);
 
-			ret = installer_flash_big_chunk_multiple(file, &read_flags,
-						size[read_flags], &remaining_data, fb, argc, argv);
-			if (EFI_ERROR(ret))
-				goto exit;
+exit:
+	for (i = 0; i < nb; i++)
+		if (file[i])
+			uefi_call_wrapper(file[i]->Close, 1, file[i]);
+	FreePool(label);
+}
 
-			read_size = MAX_DATA_SIZE;
-			read_ptr = fb->d.data;
-			continue;
-		}
+/* Parallel flashing.  The consecutive "flash LABEL FILE" commands of
+   the batch file with the 'p' attribute are gathered into a bundle so
+   that the images of partitions lying on different disks are flashed
+   at the same time.  They are reported as a single command.  */
+struct parallel_flash {
+	CHAR8 *target;
+	CHAR16 *label;
+	CHAR16 *filename;
+	UINTN size;
+};
 
-		installer_flash_buffer(dl->data, flash_size, argc, argv);
-		if (!last_cmd_succeeded)
-			goto exit;
-		/* Move the incomplete chunk from the end to the
-		   beginning of the buffer. */
-
-		if (dl->data + flash_size < read_ptr + read_size) {
-			already_read = read_ptr + read_size - (void *)ckh;
-			memcpy(fb->d.data, ckh, already_read);
-			read_size = MAX_DATA_SIZE - already_read;
-			read_ptr = fb->d.data + already_read;
-
-		} else {
-			read_size = MAX_DATA_SIZE;
-			read_ptr = fb->d.data;
-		}
-		if ((read_size > size[read_flags]) && (read_flags != (num - 1))) {
-			ret = read_file(file[read_flags], size[read_flags], read_ptr);
-			if (EFI_ERROR(ret))
-				goto exit;
-			memcpy(fb->d.data+already_read, read_ptr, size[read_flags]);
-			read_size = read_size - size[read_flags];
-			remaining_data  -= size[read_flags];
-			read_ptr = fb->d.data+already_read+size[read_flags];
-			read_flags++;
-			}
+static BOOLEAN get_parallel_flash_args(UINTN index, char *cmd, CHAR8 **label,
+				       CHAR8 **file)
+{
+	char *token, *saveptr;
+	UINTN argc;
+
+	if (index >= command_nb || !commands[index].parallel)
+		return FALSE;
+
+	token = strtok_r(cmd, " ", &saveptr);
+	for (argc = 0; token; argc++, token = strtok_r(NULL, " ", &saveptr)) {
+		if (argc == 1)
+			*label = (CHAR8 *)token;
+		if (argc == 2)
+			*file = (CHAR8 *)token;
 	}
-exit:
-	for (UINTN i = 0; i < num; i++)
-		uefi_call_wrapper(file[i]->Close, 1, file[i]);
+
+	return argc == 3 && !strcmp((CHAR8 *)cmd, (CHAR8 *)"flash");
 }
-/* This function splits a huge sparse file into smaller ones and flash
-   them. */
-static void installer_split_and_flash(CHAR16 *filename, UINTN size,
-				      UINTN argc, CHAR8 **argv)
+
+static EFI_STATUS prepare_parallel_flash(CHAR8 *label, CHAR8 *file,
+					 struct parallel_flash *pf)
 {
 	EFI_STATUS ret;
-	flash_buffer_t *fb;
-	struct sparse_header sph;
-	struct chunk_header *ckh;
-	UINTN read_size, flash_size, already_read, remaining_data = size;
-	void *read_ptr;
-	INTN nb_chunks;
-	EFI_FILE *file;
-	UINT32 blk_count;
-	const UINTN HEADER_SIZE = offsetof(flash_buffer_t, d);
-	const UINTN MAX_DATA_SIZE = dl->max_size - HEADER_SIZE;
 
-	ret = uefi_open_file(file_io_interface, filename, &file);
-	if (EFI_ERROR(ret)) {
-		inst_perror(ret, "Failed to open %s file", filename);
-		return;
+	label = get_target(label);
+	if (!label)
+		return EFI_INVALID_PARAMETER;
+
+	pf->target = (CHAR8 *)strdup((char *)label);
+	if (!pf->target) {
+		fastboot_fail("Failed to duplicate the label");
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	pf->label = stra_to_str(label);
+	pf->filename = stra_to_str(file);
+	if (!pf->label || !pf->filename) {
+		fastboot_fail("Failed to convert CHAR8 string to CHAR16");
+		return EFI_OUT_OF_RESOURCES;
 	}
 
-	ret = read_file(file, sizeof(sph), &sph);
+	if (StrLen(pf->label) > GPT_NAME_LEN) {
+		fastboot_fail("Label name is too long");
+		return EFI_INVALID_PARAMETER;
+	}
+
+	ret = uefi_get_file_size(file_io_interface, pf->filename, &pf->size);
 	if (EFI_ERROR(ret))
-		return;
-	remaining_data -= sizeof(sph);
+		inst_perror(ret, "Failed to get %s file size", pf->filename);
 
-	if (!is_sparse_image((void *) &sph, sizeof(sph))) {
-		fastboot_fail("sparse file expected");
-		return;
+	return ret;
+}
+
+static EFI_STATUS erase_parallel_flash(struct parallel_flash *pf)
+{
+	EFI_STATUS ret;
+	CHAR8 *erase_argv[2] = { (CHAR8 *)"erase", pf->target };
+
+	ret = find_partition(pf->target);
+	if (ret == EFI_NOT_FOUND)
+		return EFI_SUCCESS;
+	if (EFI_ERROR(ret)) {
+		inst_perror(ret, "Failed to get partition information");
+		return ret;
 	}
 
-	fb = dl->data;
+	do_erase(2, erase_argv);
+	return last_cmd_succeeded ? EFI_SUCCESS : EFI_DEVICE_ERROR;
+}
 
-	/* New sparse header. */
-	memcpy(&fb->sph, &sph, sizeof(sph));
+static EFI_STATUS read_parallel_flash(struct parallel_flash *pf, void *data)
+{
+	EFI_STATUS ret;
+	EFI_FILE *file;
 
-	/* Sparse skip chunk. */
-	fb->skip_ckh.chunk_type = CHUNK_TYPE_DONT_CARE;
-	fb->skip_ckh.total_sz = sizeof(fb->skip_ckh);
+	ret = uefi_open_file(file_io_interface, pf->filename, &file);
+	if (EFI_ERROR(ret)) {
+		inst_perror(ret, "Failed to open %s file", pf->filename);
+		return ret;
+	}
 
-	nb_chunks = sph.total_chunks;
-	read_size = MAX_DATA_SIZE;
-	read_ptr = fb->d.data;
-	blk_count = 0;
+	ret = read_file(file, pf->size, data);
+	uefi_call_wrapper(file->Close, 1, file);
+	return ret;
+}
 
-	while (nb_chunks > 0 && remaining_data > 0) {
-		fb->sph.total_chunks = 1;
-		fb->sph.total_blks = fb->skip_ckh.chunk_sz = blk_count;
+/* The bundle is built in the download buffer: the group ends before
+   the first image which does not fit and the remaining commands are
+   gathered into the next bundle.  */
+static void installer_flash_parallel(CHAR8 *label, CHAR8 *file)
+{
+	EFI_STATUS ret;
+	CHAR8 *flash_argv[2] = { (CHAR8 *)"flash", (CHAR8 *)"bundle" };
+	struct parallel_flash *pf;
+	struct bundle_header *hdr;
+	struct bundle_entry *entry;
+	UINTN nb, i, size, room;
+	char *cmd = NULL;
+
+	if (get_current_state() == LOCKED) {
+		error(L"Installer: Flash %a is prohibited in %a state.", label,
+		      get_current_state_string());
+		fastboot_fail("Installer: Prohibited command in %a state.",
+			      get_current_state_string());
+		return;
+	}
 
-		if (remaining_data < read_size)
-			read_size = remaining_data;
+	prefetch_free();
 
-		/* Read a new piece of the input sparse file. */
-		ret = read_file(file, read_size, read_ptr);
-		if (EFI_ERROR(ret))
-			goto exit;
-		remaining_data -= read_size;
-
-		/* Process the loaded chunks to build the new header
-		   and the skip chunk. */
-		flash_size = HEADER_SIZE;
-		ckh = &fb->d.ckh;
-		while ((void *)ckh + sizeof(*ckh) <= read_ptr + read_size &&
-				(void *)ckh + ckh->total_sz <= read_ptr + read_size) {
-			if (nb_chunks == 0) {
-				fastboot_fail("Corrupted sparse file: too many chunks");
-				goto exit;
-			}
-			flash_size += ckh->total_sz;
-			fb->sph.total_blks += ckh->chunk_sz;
-			blk_count += ckh->chunk_sz;
-			fb->sph.total_chunks++;
-			nb_chunks--;
-			ckh = (void *)ckh + ckh->total_sz;
-		}
+	pf = AllocateZeroPool((command_nb - current_command + 2) * sizeof(*pf));
+	if (!pf) {
+		fastboot_fail("Failed to allocate the parallel flash array");
+		return;
+	}
 
-		/* chunk is too big to fit in the download buffer. */
-		if (flash_size == HEADER_SIZE) {
-			if (ckh->chunk_type != CHUNK_TYPE_RAW ||
-					remaining_data < ckh->total_sz - MAX_DATA_SIZE) {
-				fastboot_fail("Corrupted sparse file");
+	room = dl->max_size - sizeof(*hdr);
+	for (nb = 0; ; nb++) {
+		if (nb) {
+			cmd = strdup(commands[current_command].cmd);
+			if (!cmd) {
+				fastboot_fail("Failed to duplicate the command");
 				goto exit;
 			}
+			if (!get_parallel_flash_args(current_command, cmd,
+						     &label, &file))
+				break;
+		}
 
-			blk_count += ckh->chunk_sz;
-			nb_chunks--;
+		ret = prepare_parallel_flash(label, file, &pf[nb]);
+		if (cmd) {
+			FreePool(cmd);
+			cmd = NULL;
+		}
+		if (EFI_ERROR(ret))
+			goto exit;
 
-			ret = installer_flash_big_chunk(file, &remaining_data,
-					fb, argc, argv);
-			if (EFI_ERROR(ret))
-				goto exit;
+		if (pf[nb].size + sizeof(*entry) > room) {
+			if (nb)
+				break;
+			fastboot_fail("%s does not fit in the %d bytes download buffer",
+				      pf[nb].filename, dl->max_size);
+			goto exit;
+		}
+		room -= pf[nb].size + sizeof(*entry);
 
-			read_size = MAX_DATA_SIZE;
-			read_ptr = fb->d.data;
-			continue;
+		if (nb) {
+			Print(L"Starting command: '%a'\n", commands[current_command].cmd);
+			current_command++;
 		}
 
-		installer_flash_buffer(dl->data, flash_size, argc, argv);
-		if (!last_cmd_succeeded)
+		ret = erase_parallel_flash(&pf[nb]);
+		if (EFI_ERROR(ret))
 			goto exit;
+	}
 
-		/* Move the incomplete chunk from the end to the
-		   beginning of the buffer. */
-		if (dl->data + flash_size < read_ptr + read_size) {
-			already_read = read_ptr + read_size - (void *)ckh;
-			memcpy(fb->d.data, ckh, already_read);
-			read_size = MAX_DATA_SIZE - already_read;
-			read_ptr = fb->d.data + already_read;
-		} else {
-			read_size = MAX_DATA_SIZE;
-			read_ptr = fb->d.data;
-		}
+	hdr = dl->data;
+	hdr->magic = BUNDLE_MAGIC;
+	hdr->version = BUNDLE_VERSION;
+	hdr->nentries = nb;
+	hdr->reserved = 0;
+
+	entry = (struct bundle_entry *)&hdr[1];
+	size = sizeof(*hdr) + nb * sizeof(*entry);
+	for (i = 0; i < nb; i++, entry++) {
+		memset(entry, 0, sizeof(*entry));
+		memcpy(entry->label, pf[i].label, StrLen(pf[i].label) * sizeof(CHAR16));
+		entry->offset = size;
+		entry->size = pf[i].size;
+
+		ret = read_parallel_flash(&pf[i], dl->data + size);
+		if (EFI_ERROR(ret))
+			goto exit;
+		size += pf[i].size;
 	}
 
+	installer_flash_buffer(dl->data, size, 2, flash_argv);
+
 exit:
-	uefi_call_wrapper(file->Close, 1, file);
+	if (cmd)
+		FreePool(cmd);
+	for (i = 0; i <= nb; i++) {
+		if (pf[i].target)
+			FreePool(pf[i].target);
+		if (pf[i].label)
+			FreePool(pf[i].label);
+		if (pf[i].filename)
+			FreePool(pf[i].filename);
+	}
+	FreePool(pf);
 }
 
 static void installer_flash_cmd(INTN argc, CHAR8 **argv)
@@ -570,7 +785,11 @@ static void installer_flash_cmd(INTN argc, CHAR8 **argv)
 		fastboot_fail("Flash command requires exactly more then 3 arguments");
 		return;
 	}
-	if (argc > 4) {
+	if (argc == 3 && current_command && commands[current_command - 1].parallel) {
+		installer_flash_parallel(argv[1], argv[2]);
+		return;
+	}
+	if (num > 1) {
 		argc = 2;
 		for (int i = 0; i <  num; i++) {
 			numname[i] = stra_to_str(argv[i+2]);
@@ -609,7 +828,7 @@ static void installer_flash_cmd(INTN argc, CHAR8 **argv)
 			goto exit;
 		}
 
-		installer_split_and_joint_flash(numname, numsize, num, argc, argv);
+		installer_flash_stream(numname, numsize, num, argv[1]);
 	} else {
 		/* The fastboot flash command does not want the file parameter. */
 		argc--;
@@ -651,16 +870,24 @@ static void installer_flash_cmd(INTN argc, CHAR8 **argv)
 		}
 
 		if (size > dl->max_size) {
-			installer_split_and_flash(filename, size, argc, argv);
+			prefetch_free();
+			installer_flash_stream(&filename, &size, 1, argv[1]);
 			goto exit;
 		}
 
-		ret = uefi_read_file(file_io_interface, filename, &data, &size);
+		ret = prefetch_take(filename, &data, &size);
+		if (ret == EFI_NOT_FOUND) {
+			UINT64 start = boottime_in_usec();
+
+			ret = uefi_read_file(file_io_interface, filename, &data, &size);
+			read_us += boottime_in_usec() - start;
+		}
 		if (EFI_ERROR(ret)) {
 			inst_perror(ret, "Unable to read file %s", filename);
 			goto exit;
 		}
 
+		prefetch_next_file();
 		installer_flash_buffer(data, size, argc, argv);
 		FreePool(data);
 	}
@@ -780,13 +1007,6 @@ static void installer_boot(INTN argc, CHAR8 **argv)
 		fastboot_okay("");
 }
 
-static struct command {
-	BOOLEAN optional;
-	char *cmd;
-} *commands;
-static UINTN command_nb;
-static UINTN current_command;
-
 static void free_commands(void)
 {
 	UINTN i;
@@ -809,6 +1029,7 @@ static EFI_STATUS create_new_command(struct command *command, char *str)
 	char *cmd = str;
 
 	command->optional = FALSE;
+	command->parallel = FALSE;
 
 	if (*str == '[') {
 		str++;
@@ -822,6 +1043,9 @@ static EFI_STATUS create_new_command(struct command *command, char *str)
 			case 'o':
 				command->optional = TRUE;
 				break;
+			case 'p':
+				command->parallel = TRUE;
+				break;
 			default:
 				return EFI_INVALID_PARAMETER;
 			}
@@ -1048,6 +1272,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *_table)
 	ret = handle_protocol(image, &LoadedImageProtocol, (void **)&loaded_img);
 	if (ret != EFI_SUCCESS) {
 		efi_perror(ret, L"LoadedImageProtocol error");
+		log_exit();
 		return ret;
 	}
 
@@ -1056,6 +1281,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *_table)
 			&FileSystemProtocol, (void *)&file_io_interface);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to get FileSystemProtocol");
+		log_exit();
 		return ret;
 	}
 
@@ -1064,6 +1290,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *_table)
 	buf = options = AllocatePool(size);
 	if (!options) {
 		error(L"Unable to allocate buffer for parameters");
+		log_exit();
 		return EFI_OUT_OF_RESOURCES;
 	}
 	str_to_stra(options, loaded_img->LoadOptions, size);
@@ -1096,6 +1323,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *_table)
 
 exit:
 	FreePool(buf);
+	log_exit();
 	if (EFI_ERROR(ret))
 		return ret;
 	return last_cmd_succeeded ? EFI_SUCCESS : EFI_INVALID_PARAMETER;
@@ -1133,6 +1361,17 @@ EFI_STATUS installer_transport_stop(void)
 	return EFI_SUCCESS;
 }
 
+static void print_command_time(void)
+{
+	UINT64 total_ms = (boottime_in_usec() - cmd_start_us) / 1000;
+
+	if (read_us || flash_us)
+		Print(L"Command took %ld ms (read wait %ld ms, flash %ld ms)\n",
+		      total_ms, read_us / 1000, flash_us / 1000);
+	else
+		Print(L"Command took %ld ms\n", total_ms);
+}
+
 EFI_STATUS installer_transport_run(void)
 {
 	static BOOLEAN initialized = FALSE;
@@ -1153,6 +1392,7 @@ EFI_STATUS installer_transport_run(void)
 
 	if (current_command > 0) {
 		flush_tx_buffer();
+		print_command_time();
 		if (last_cmd_succeeded)
 			Print(L"Command successfully executed\n");
 		else {
@@ -1176,11 +1416,14 @@ EFI_STATUS installer_transport_run(void)
 	memcpy(fastboot_cmd_buf, cmd, cmd_len);
 
 	Print(L"Starting command: '%a'\n", cmd);
+	cmd_start_us = boottime_in_usec();
+	read_us = flash_us = 0;
 	fastboot_rx_cb(fastboot_cmd_buf, cmd_len);
 
 	return EFI_SUCCESS;
 
 stop:
+	prefetch_free();
 	fastboot_stop(NULL, NULL, 0, EXIT_SHELL);
 	return EFI_SUCCESS;
 }
@@ -1153,6 +1153,7 @@ static VOID enter_fastboot_mode(UINT8 boot_state)
 				efi_perror(ret, L"Unable to load the received EFI image");
 				continue;
 			}
+			log_exit();
 			ret = uefi_call_wrapper(BS->StartImage, 3, image, NULL, NULL);
 			if (EFI_ERROR(ret))
 				efi_perror(ret, L"Unable to start the received EFI image");
@@ -1319,6 +1320,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 			image, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"OpenProtocol: LoadedImageProtocol");
+		log_exit();
 		return ret;
 	}
 	g_disk_device = g_loaded_image->DeviceHandle;
@@ -1335,6 +1337,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 		if (!get_boot_device()) {
 			// Get boot device failed
 			error(L"Failed to find boot device");
+			log_exit();
 			return EFI_NO_MEDIA;
 		}
 	}
@@ -1372,6 +1375,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 	ret = slot_init();
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Slot management initialization failed");
+		log_exit();
 		return ret;
 	}
 
@@ -1380,8 +1384,10 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 	 */
 	if (boot_target == NORMAL_BOOT)
 		boot_target = choose_boot_target(&target_path, &oneshot);
-	if (boot_target == EXIT_SHELL)
+	if (boot_target == EXIT_SHELL) {
+		log_exit();
 		return EFI_SUCCESS;
+	}
 	if (boot_target == CRASHMODE) {
 #ifdef USE_UI
 		boot_target = ux_prompt_user_for_boot_target(NO_ERROR_CODE);
@@ -1450,8 +1456,10 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 	/* EFI binaries are validated by the BIOS */
 	if (boot_target == ESP_EFI_BINARY) {
 		debug(L"entering EFI binary");
-		if (!target_path)
+		if (!target_path) {
+			log_exit();
 			return EFI_INVALID_PARAMETER;
+		}
 		ret = uefi_enter_binary(g_disk_device, target_path, oneshot, 0, NULL);
 		if (EFI_ERROR(ret)) {
 			efi_perror(ret, L"EFI Application exited abnormally");
@@ -1561,6 +1569,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 
 	bootloader_recover_mode(boot_state);
 
+	log_exit();
 	return EFI_INVALID_PARAMETER;
 }
 
@@ -567,7 +567,7 @@ static enum boot_target check_command_line(EFI_HANDLE image, CHAR8 *cmd_buf, UIN
 					UINT32 cpu_khz;
 					nptr = (CHAR8 *)(arg8 + CmdlineArray[j].length);
 					VALUE = (UINT64)strtoull((char *)nptr, 0, 10);
-					cpu_khz = get_cpu_freq() * 1000;
+					cpu_khz = get_tsc_khz();
 					//EFI_ENTER_POINT boot time is recorded in ms
 					set_efi_enter_point(VALUE /cpu_khz);
 					continue;
@@ -1072,6 +1072,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 	if (!get_boot_device()) {
 		// Get boot device failed
 		error(L"Failed to find boot device");
+		log_exit();
 		return EFI_NO_MEDIA;
         }
 
@@ -1079,6 +1080,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 		log(L"Enter fastboot mode ...\n");
 		fastboot_start(&bootimage, &efiimage, &imagesize, &target);
 	}
+	log_exit();
 	return EFI_SUCCESS;
 }
 #else //FASTBOOT_FOR_NON_ANDROID
@@ -1105,6 +1107,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 	if (!get_boot_device()) {
 		// Get boot device failed
 		error(L"Failed to find boot device");
+		log_exit();
 		return EFI_NO_MEDIA;
         }
 
@@ -1115,6 +1118,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 	ret = slot_init();
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Slot management initialization failed");
+		log_exit();
 		return ret;
 	}
 
@@ -1151,6 +1155,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 	ret = slot_init_use_misc();
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Slot management initialization failed by misc");
+		log_exit();
 		return ret;
 	}
 
@@ -1170,6 +1175,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 		ret = slot_init_use_misc();
 		if (EFI_ERROR(ret)) {
 			efi_perror(ret, L"Slot management initialization failed by misc");
+			log_exit();
 			return ret;
 		}
 	}
@@ -1204,6 +1210,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 		}
 	}
 #endif
+	log_exit();
 	return EFI_SUCCESS;
 }
 #endif //FASTBOOT_FOR_NON_ANDROID
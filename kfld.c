@@ -209,6 +209,7 @@ EFI_STATUS load_kf(UINT8 slot)
 		return ret;
 	}
 
+	log_exit();
 	ret = uefi_call_wrapper(BS->StartImage, 3, kf_image, NULL, NULL);
 
 out:
@@ -236,6 +237,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *_table)
 			image, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"OpenProtocol: LoadedImageProtocol");
+		log_exit();
 		return ret;
 	}
 	g_disk_device = g_loaded_image->DeviceHandle;
@@ -251,6 +253,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *_table)
 		if (!get_boot_device()) {
 			// Get boot device failed
 			error(L"Failed to find boot device");
+			log_exit();
 			return EFI_NO_MEDIA;
 		}
 	}
@@ -276,6 +279,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *_table)
 		ret = load_kf(active_slot);
 	}
 
+	log_exit();
 	return ret;
 }
 
@@ -13,11 +13,15 @@ LOCAL_STATIC_LIBRARIES := \
 
 LOCAL_EXPORT_C_INCLUDE_DIRS := $(LOCAL_PATH)/../include/libadb
 LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include/libadb
+ifneq ($(KERNELFLINGER_ADB_WINDOW),)
+    LOCAL_CFLAGS += -DASOCK_WINDOW=$(KERNELFLINGER_ADB_WINDOW)
+endif
 LOCAL_SRC_FILES := \
 	adb.c \
 	adb_socket.c \
 	reboot_service.c \
 	sync_service.c \
-	reader.c
+	reader.c \
+	lz4.c
 
 include $(BUILD_EFI_STATIC_LIBRARY)
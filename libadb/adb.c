@@ -50,8 +50,8 @@
 #define TCP_PORT	5555
 
 /* Protocol definitions */
-#define ADB_VERSION	0x01000000
 #define SYSTEM_TYPE	"bootloader"
+#define FEATURE_DELAYED_ACK	"delayed_ack"
 
 /* Internal data */
 typedef enum adb_state {
@@ -69,46 +69,99 @@ static adb_pkt_t adb_pkt_in;
 unsigned char in_buf[ADB_MIN_PAYLOAD];
 
 UINT32 adb_max_payload;
+BOOLEAN adb_delayed_ack;
+
+/* Negociated (CONNECT hand-shake) protocol version */
+static UINT32 adb_version;
 
 static UINT32 adb_pkt_sum(adb_pkt_t *pkt)
 {
 	UINTN count, sum;
 	unsigned char *cur = pkt->data;
 
+	if (adb_version >= ADB_VERSION_SKIP_CHECKSUM)
+		return 0;
+
 	for (sum = 0, count = pkt->msg.data_length; count; count--)
 		sum += *cur++;
 
 	return sum;
 }
 
-static adb_pkt_t *delayed_pkt_data;
-EFI_STATUS adb_send_pkt(adb_pkt_t *pkt, UINT32 command, UINT32 arg0, UINT32 arg1)
-{
-	EFI_STATUS ret;
+/* Outgoing packets are queued so that several sockets and several
+   WRTE packets of a socket can be in flight.  The header of each
+   packet is copied in the queue but the payload must remain valid
+   until it has been sent.  Each socket can have a full window of
+   WRTE packets plus an OKAY and a CLSE packets queued, the extra
+   entry is for the CNXN packet.  */
+#define ADB_TX_QUEUE_SIZE (MAX_ADB_SOCKET * (ASOCK_WINDOW + 2) + 1)
 
-	pkt->msg.command = command;
-	pkt->msg.arg0 = arg0;
-	pkt->msg.arg1 = arg1;
+static adb_pkt_t tx_queue[ADB_TX_QUEUE_SIZE];
+static UINT32 tx_acks[ADB_TX_QUEUE_SIZE];
+static UINTN tx_head, tx_count;
+static BOOLEAN tx_payload;
 
-	pkt->msg.magic = pkt->msg.command ^ 0xFFFFFFFF;
-	pkt->msg.data_check = adb_pkt_sum(pkt);
+static EFI_STATUS adb_tx_start(void)
+{
+	EFI_STATUS ret;
+	adb_pkt_t *pkt = &tx_queue[tx_head];
 
 	/* Some transport layer (USB in particular) might not support
 	   several writes in raw.  Wait for the TX event to send the
-	   payload.  Prepare the delayed packet before we send the
-	   first one because some transport implementation trig the TX
+	   payload.  Prepare the payload state before we send the
+	   header because some transport implementation trig the TX
 	   even (TCP in particular) before the first transport_write()
 	   returns.  */
-	if (pkt->msg.data_length)
-		delayed_pkt_data = pkt;
+	tx_payload = pkt->msg.data_length != 0;
 
 	ret = transport_write(&pkt->msg, sizeof(pkt->msg));
-	if (EFI_ERROR(ret))
+	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to send adb msg");
+		tx_count = 0;
+	}
 
 	return ret;
 }
 
+EFI_STATUS adb_send_pkt(adb_pkt_t *pkt, UINT32 command, UINT32 arg0, UINT32 arg1)
+{
+	pkt->msg.command = command;
+	pkt->msg.arg0 = arg0;
+	pkt->msg.arg1 = arg1;
+
+	pkt->msg.magic = pkt->msg.command ^ 0xFFFFFFFF;
+	pkt->msg.data_check = adb_pkt_sum(pkt);
+
+	if (tx_count == ARRAY_SIZE(tx_queue)) {
+		error(L"adb transmit queue is full");
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	tx_queue[(tx_head + tx_count) % ARRAY_SIZE(tx_queue)] = *pkt;
+	if (++tx_count > 1)
+		return EFI_SUCCESS;
+
+	return adb_tx_start();
+}
+
+/* With delayed acks, the OKAY payload is the number of bytes
+   acknowledged.  It is stored in the queue entry of the packet as
+   several OKAY packets of a socket can be queued.  */
+EFI_STATUS adb_send_okay(UINT32 local, UINT32 remote, UINT32 acked)
+{
+	adb_pkt_t pkt = { .msg.data_length = 0 };
+	UINT32 *ack;
+
+	if (adb_delayed_ack && tx_count < ARRAY_SIZE(tx_queue)) {
+		ack = &tx_acks[(tx_head + tx_count) % ARRAY_SIZE(tx_queue)];
+		*ack = acked;
+		pkt.data = (unsigned char *)ack;
+		pkt.msg.data_length = sizeof(*ack);
+	}
+
+	return adb_send_pkt(&pkt, A_OKAY, local, remote);
+}
+
 static void adb_read_msg(void)
 {
 	EFI_STATUS ret;
@@ -140,26 +193,65 @@ static void cmd_unsupported(adb_pkt_t *pkt)
 	error(L"'%a' adb message is not supported", cmd);
 }
 
+/* The banner is "<system type>:<serial>:<properties>" where the
+   properties are ';' separated, one of them being the ',' separated
+   list of features.  */
+static BOOLEAN has_feature(adb_pkt_t *pkt, const char *feature)
+{
+	static const char key[] = "features=";
+	const char *p = (const char *)pkt->data;
+	const char *end = p + pkt->msg.data_length;
+	const char *token;
+	UINTN len = strlen((CHAR8 *)feature);
+
+	for (; p + sizeof(key) - 1 <= end; p++)
+		if (!memcmp(p, key, sizeof(key) - 1))
+			break;
+	if (p + sizeof(key) - 1 > end)
+		return FALSE;
+
+	for (p += sizeof(key) - 1; p < end && *p != ';' && *p; p++) {
+		for (token = p; p < end && *p != ',' && *p != ';' && *p; p++)
+			;
+		if ((UINTN)(p - token) == len && !memcmp(token, feature, len))
+			return TRUE;
+		if (p == end || *p != ',')
+			break;
+	}
+
+	return FALSE;
+}
+
 static void cmd_connect(adb_pkt_t *pkt)
 {
 	EFI_STATUS ret;
 	static adb_pkt_t out_pkt;
+	UINT32 version;
 
-	if (pkt->msg.arg0 != ADB_VERSION) {
+	if (pkt->msg.arg0 < ADB_VERSION_MIN) {
 		error(L"Unsupported adb version 0x%08x", pkt->msg.arg0);
 		return;
 	}
 
+	version = min((UINT32)ADB_VERSION, pkt->msg.arg0);
 	adb_max_payload = min((UINT32)ADB_MAX_PAYLOAD, pkt->msg.arg1);
-	debug(L"Negociated payload size is %d bytes", adb_max_payload);
+	adb_delayed_ack = has_feature(pkt, FEATURE_DELAYED_ACK);
+	debug(L"Negociated version is 0x%08x, payload size is %d bytes%a",
+	      version, adb_max_payload,
+	      adb_delayed_ack ? ", delayed acks" : "");
 
-	out_pkt.data = (unsigned char *)SYSTEM_TYPE "::";
+	out_pkt.data = (unsigned char *)SYSTEM_TYPE "::features=" FEATURE_DELAYED_ACK;
 	out_pkt.msg.data_length = strlen(out_pkt.data);
 
-	ret = adb_send_pkt(&out_pkt, pkt->msg.command, pkt->msg.arg0,
+	/* The host does not know the negociated version until it
+	   receives this packet, it has to be checksummed.  */
+	adb_version = ADB_VERSION_MIN;
+	ret = adb_send_pkt(&out_pkt, pkt->msg.command, version,
 			   adb_max_payload);
 	if (EFI_ERROR(ret))
 		error(L"Failed to send connection packet");
+
+	adb_version = version;
 }
 
 static void cmd_open(adb_pkt_t *pkt)
@@ -185,12 +277,13 @@ static void cmd_open(adb_pkt_t *pkt)
 			break;
 		}
 
-	asock_open(pkt->msg.arg0, srv, arg);
+	asock_open(pkt->msg.arg0, pkt->msg.arg1, srv, arg);
 }
 
 static void cmd_okay(adb_pkt_t *pkt)
 {
-	asock_okay(asock_find(pkt->msg.arg1, pkt->msg.arg0));
+	asock_okay(asock_find(pkt->msg.arg1, pkt->msg.arg0),
+		   pkt->data, pkt->msg.data_length);
 }
 
 static void cmd_close(adb_pkt_t *pkt)
@@ -233,10 +326,15 @@ static adb_handler_t *get_handler(adb_msg_t *msg)
 static void process_msg(void)
 {
 	adb_handler_t *handler;
+	EFI_TPL tpl;
 
 	if (adb_state != ADB_PROCESS_MSG)
 		return;
 
+	/* The OKAY fast path and the transmit queue run in the
+	   transport callbacks, do not let them preempt the handler.  */
+	tpl = uefi_call_wrapper(BS->RaiseTPL, 1, TPL_CALLBACK);
+
 	handler = get_handler(&adb_pkt_in.msg);
 	if (!handler)
 		error(L"Unknown command");
@@ -244,6 +342,8 @@ static void process_msg(void)
 		handler->fun(&adb_pkt_in);
 
 	adb_read_msg();
+
+	uefi_call_wrapper(BS->RestoreTPL, 1, tpl);
 }
 
 static void adb_process_rx(void *buf, unsigned len)
@@ -295,11 +395,19 @@ static void adb_process_rx(void *buf, unsigned len)
 			return;
 		}
 
-		if (adb_pkt_in.msg.data_check != adb_pkt_sum(&adb_pkt_in)) {
+		if (adb_version < ADB_VERSION_SKIP_CHECKSUM &&
+		    adb_pkt_in.msg.data_check != adb_pkt_sum(&adb_pkt_in)) {
 			error(L"Corrupted data detected");
 			return;
 		}
 
+		/* Delayed acks OKAY messages carry a payload.  */
+		if (adb_pkt_in.msg.command == A_OKAY) {
+			cmd_okay(&adb_pkt_in);
+			adb_read_msg();
+			return;
+		}
+
 		adb_state = ADB_PROCESS_MSG;
 		break;
 
@@ -312,14 +420,25 @@ static void adb_process_tx(__attribute__((__unused__)) void *buf,
 			   __attribute__((__unused__)) unsigned len)
 {
 	EFI_STATUS ret;
+	adb_pkt_t *pkt;
 
-	if (!delayed_pkt_data)
+	if (!tx_count)
 		return;
 
-	ret = transport_write(delayed_pkt_data->data, delayed_pkt_data->msg.data_length);
-	delayed_pkt_data = NULL;
-	if (EFI_ERROR(ret))
-		efi_perror(ret, L"Failed to send adb payload");
+	pkt = &tx_queue[tx_head];
+	if (tx_payload) {
+		tx_payload = FALSE;
+		ret = transport_write(pkt->data, pkt->msg.data_length);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to send adb payload");
+			tx_count = 0;
+		}
+		return;
+	}
+
+	tx_head = (tx_head + 1) % ARRAY_SIZE(tx_queue);
+	if (--tx_count)
+		adb_tx_start();
 }
 
 static enum boot_target exit_bt;
@@ -394,6 +513,9 @@ EFI_STATUS adb_init()
 	EFI_STATUS ret;
 
 	adb_pkt_in.data = in_buf;
+	adb_version = ADB_VERSION_MIN;
+	adb_delayed_ack = FALSE;
+	tx_head = tx_count = 0;
 	exit_bt = UNKNOWN_TARGET;
 
 	ret = transport_register(ADB_TRANSPORT, ARRAY_SIZE(ADB_TRANSPORT));
@@ -422,7 +544,7 @@ EFI_STATUS adb_run()
 
 EFI_STATUS adb_exit()
 {
-	asock_close_all();
 	transport_stop();
+	asock_close_all();
 	return EFI_SUCCESS;
 }
@@ -36,20 +36,52 @@
 #include "adb_socket.h"
 #include "service.h"
 
+/* Without delayed acks, the host sends a single OKAY for the WRTE
+   packets it receives while the previous ones are still queued on
+   its side: only one WRTE can be in flight.  With delayed acks, up to
+   ASOCK_WINDOW packets are in flight as long as the host has room for
+   them, the OKAY messages release the oldest buffers as their bytes
+   get acknowledged.  */
 struct asock {
 	UINT32 local;
 	UINT32 remote;
 	adb_pkt_t msg;
 	adb_pkt_t wrt;
-	unsigned char data[ADB_MAX_PAYLOAD];
+	unsigned char *data[ASOCK_WINDOW];
+	UINT32 length[ASOCK_WINDOW];
+	UINTN nb_buf;
+	UINTN next;
+	UINTN inflight;
+	INT64 window;		/* Bytes the host is ready to receive */
+	UINT32 acked;		/* Acknowledged bytes of the oldest buffer */
+	UINT32 received;	/* Bytes to acknowledge with the next OKAY */
 	service_t *service;
 	void *context;
 };
 
 static struct asock asocks[MAX_ADB_SOCKET];
 
+/* Output buffers are allocated when the socket is opened, before
+   the service starts reading its data, and kept for the following
+   connections.  */
+static EFI_STATUS alloc_buffers(asock_t s)
+{
+	UINTN i;
+
+	s->nb_buf = adb_delayed_ack ? ASOCK_WINDOW : 1;
+	for (i = 0; i < s->nb_buf; i++) {
+		if (s->data[i])
+			continue;
+		s->data[i] = AllocatePool(ADB_MAX_PAYLOAD);
+		if (!s->data[i])
+			return EFI_OUT_OF_RESOURCES;
+	}
+
+	return EFI_SUCCESS;
+}
+
 /* Host to device */
-EFI_STATUS asock_open(UINT32 remote, service_t *service, char *arg)
+EFI_STATUS asock_open(UINT32 remote, UINT32 window, service_t *service, char *arg)
 {
 	static adb_pkt_t fail_msg = { .msg.data_length = 0 };
 	EFI_STATUS ret;
@@ -62,6 +94,12 @@ EFI_STATUS asock_open(UINT32 remote, service_t *service, char *arg)
 		goto err;
 	}
 
+	if (adb_delayed_ack && !window) {
+		error(L"Missing receive window for %d remote", remote);
+		ret = EFI_INVALID_PARAMETER;
+		goto err;
+	}
+
 	for (i = 0; i < ARRAY_SIZE(asocks); i++)
 		if (asocks[i].local == 0) {
 			s = &asocks[i];
@@ -75,9 +113,19 @@ EFI_STATUS asock_open(UINT32 remote, service_t *service, char *arg)
 	}
 
 	s->remote = remote;
+	s->next = 0;
+	s->inflight = 0;
+	s->window = window;
+	s->acked = 0;
+	/* The first OKAY gives the host our receive window.  */
+	s->received = ADB_MIN_PAYLOAD;
 	s->service = service;
 	s->context = NULL;
 
+	ret = alloc_buffers(s);
+	if (EFI_ERROR(ret))
+		goto err;
+
 	ret = service->open(arg, &s->context);
 	if (EFI_ERROR(ret))
 		goto err;
@@ -126,11 +174,40 @@ EFI_STATUS asock_close(asock_t s)
 	return EFI_SUCCESS;
 }
 
-EFI_STATUS asock_okay(asock_t s)
+EFI_STATUS asock_okay(asock_t s, unsigned char *data, UINT32 length)
 {
+	INT32 acked;
+	UINTN first;
+
 	if (!s)
 		return EFI_INVALID_PARAMETER;
 
+	if (!adb_delayed_ack) {
+		s->inflight = 0;
+		return s->service->okay(s);
+	}
+
+	if (length != sizeof(acked)) {
+		error(L"Invalid OKAY payload size %d on socket %d/%d",
+		      length, s->local, s->remote);
+		return EFI_INVALID_PARAMETER;
+	}
+
+	memcpy(&acked, data, sizeof(acked));
+	s->window += acked;
+	if (acked > 0)
+		s->acked += acked;
+
+	while (s->inflight) {
+		first = (s->next + s->nb_buf - s->inflight) % s->nb_buf;
+		if (s->acked < s->length[first])
+			break;
+		s->acked -= s->length[first];
+		s->inflight--;
+	}
+	if (!s->inflight)
+		s->acked = 0;
+
 	return s->service->okay(s);
 }
 
@@ -139,27 +216,44 @@ EFI_STATUS asock_read(asock_t s, unsigned char *data, UINT32 length)
 	if (!s)
 		return EFI_INVALID_PARAMETER;
 
+	s->received = length;
 	return s->service->read(s, data, length);
 }
 
 /* Device to host */
 EFI_STATUS asock_write(asock_t s, unsigned char *data, UINT32 length)
 {
+	unsigned char *buf;
+
 	if (!s || length > adb_max_payload)
 		return EFI_INVALID_PARAMETER;
 
-	memcpy(s->data, data, length);
-	s->wrt.data = s->data;
+	buf = asock_buffer(s);
+	if (!buf)
+		return EFI_NOT_READY;
+
+	if (data != buf)
+		memcpy(buf, data, length);
+	s->length[s->next] = length;
+	s->next = (s->next + 1) % s->nb_buf;
+	s->inflight++;
+	s->window -= length;
+
+	s->wrt.data = buf;
 	s->wrt.msg.data_length = length;
 	return adb_send_pkt(&s->wrt, A_WRTE, s->local, s->remote);
 }
 
 EFI_STATUS asock_send_okay(asock_t s)
 {
+	UINT32 acked;
+
 	if (!s)
 		return EFI_INVALID_PARAMETER;
 
-	return adb_send_pkt(&s->msg, A_OKAY, s->local, s->remote);
+	acked = s->received;
+	s->received = 0;
+	return adb_send_okay(s->local, s->remote, acked);
 }
 
 EFI_STATUS asock_send_close(asock_t s)
@@ -176,6 +270,22 @@ void *asock_context(asock_t s)
 	return s ? s->context : NULL;
 }
 
+unsigned char *asock_buffer(asock_t s)
+{
+	if (!s || s->inflight == s->nb_buf)
+		return NULL;
+
+	if (adb_delayed_ack && s->window <= 0)
+		return NULL;
+
+	return s->data[s->next];
+}
+
+UINTN asock_inflight(asock_t s)
+{
+	return s ? s->inflight : 0;
+}
+
 asock_t asock_find(UINT32 local, UINT32 remote)
 {
 	asock_t s;
@@ -193,9 +303,16 @@ asock_t asock_find(UINT32 local, UINT32 remote)
 
 void asock_close_all()
 {
-	UINTN i;
+	UINTN i, j;
 
-	for (i = 0; i < ARRAY_SIZE(asocks); i++)
+	for (i = 0; i < ARRAY_SIZE(asocks); i++) {
 		if (asocks[i].local)
 			asock_close(&asocks[i]);
+
+		for (j = 0; j < ARRAY_SIZE(asocks[i].data); j++)
+			if (asocks[i].data[j]) {
+				FreePool(asocks[i].data[j]);
+				asocks[i].data[j] = NULL;
+			}
+	}
 }
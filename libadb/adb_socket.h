@@ -44,19 +44,31 @@ struct service;
 
 #define MAX_ADB_SOCKET 5
 
+/* Maximum number of WRTE packets a socket can have in flight, that
+ * is sent but not acknowledged by the host yet, when the host supports
+ * delayed acks.  Otherwise a single packet can be in flight.  */
+#ifndef ASOCK_WINDOW
+#define ASOCK_WINDOW 4
+#endif
+
 /* Host to device */
-EFI_STATUS asock_open(UINT32 remote, struct service *service, char *arg);
+EFI_STATUS asock_open(UINT32 remote, UINT32 window, struct service *service,
+		      char *arg);
 EFI_STATUS asock_close(asock_t s);
-EFI_STATUS asock_okay(asock_t s);
+EFI_STATUS asock_okay(asock_t s, unsigned char *data, UINT32 length);
 EFI_STATUS asock_read(asock_t s, unsigned char *data, UINT32 length);
 
-/* Device to host */
+/* Device to host.  asock_write() does not copy DATA if it points to
+ * the socket output buffer returned by asock_buffer().  It returns
+ * EFI_NOT_READY if no more packet can be in flight.  */
 EFI_STATUS asock_write(asock_t s, unsigned char *data, UINT32 length);
 EFI_STATUS asock_send_okay(asock_t s);
 EFI_STATUS asock_send_close(asock_t s);
 
 /* Tools */
 void *asock_context(asock_t s);
+unsigned char *asock_buffer(asock_t s);
+UINTN asock_inflight(asock_t s);
 asock_t asock_find(UINT32 local, UINT32 remote);
 void asock_close_all();
 
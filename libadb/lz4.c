@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <lib.h>
+
+#include "lz4.h"
+
+#define MINMATCH	4
+#define LASTLITERALS	5	/* The last 5 bytes are always literals */
+#define MFLIMIT		12	/* The last match starts 12 bytes before the end */
+#define MAX_DISTANCE	65535
+
+static inline UINT32 read32(const UINT8 *p)
+{
+	UINT32 v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline UINT32 hash(UINT32 v)
+{
+	return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+static UINT8 *write_length(UINT8 *op, UINTN len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+/* Worst case size of a sequence of LIT literals and a match of
+   MLEN bytes.  */
+static inline UINTN sequence_bound(UINTN lit, UINTN mlen)
+{
+	return 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1;
+}
+
+UINTN lz4_compress_block(const UINT8 *src, UINTN src_len,
+			 UINT8 *dst, UINTN dst_len,
+			 UINT16 table[LZ4_HASH_SIZE])
+{
+	const UINT8 *ip = src, *anchor = src, *end = src + src_len;
+	const UINT8 *mflimit = end - MFLIMIT, *matchlimit = end - LASTLITERALS;
+	const UINT8 *ref, *m;
+	UINT8 *op = dst, *token;
+	UINTN lit, mlen, offset;
+	UINT32 h;
+
+	if (src_len > LZ4_MAX_BLOCK_SIZE)
+		return 0;
+
+	if (src_len < MFLIMIT + 1)
+		goto last_literals;
+
+	memset(table, 0, LZ4_HASH_SIZE * sizeof(*table));
+
+	for (ip++; ip < mflimit;) {
+		h = hash(read32(ip));
+		ref = src + table[h];
+		table[h] = ip - src;
+
+		if (ref >= ip || ip - ref > MAX_DISTANCE ||
+		    read32(ref) != read32(ip)) {
+			/* Skip faster over incompressible data. */
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		for (m = ip + MINMATCH; m < matchlimit && *m == ref[m - ip]; m++)
+			;
+
+		lit = ip - anchor;
+		mlen = m - ip - MINMATCH;
+		if ((UINTN)(op - dst) + sequence_bound(lit, mlen) > dst_len)
+			return 0;
+
+		token = op++;
+		if (lit >= 15) {
+			*token = 15 << 4;
+			op = write_length(op, lit - 15);
+		} else
+			*token = lit << 4;
+		memcpy(op, anchor, lit);
+		op += lit;
+
+		offset = ip - ref;
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+
+		if (mlen >= 15) {
+			*token |= 15;
+			op = write_length(op, mlen - 15);
+		} else
+			*token |= mlen;
+
+		anchor = ip = m;
+		if (ip < mflimit)
+			table[hash(read32(ip - 2))] = ip - 2 - src;
+	}
+
+last_literals:
+	lit = end - anchor;
+	if ((UINTN)(op - dst) + 1 + lit / 255 + 1 + lit > dst_len)
+		return 0;
+
+	token = op++;
+	if (lit >= 15) {
+		*token = 15 << 4;
+		op = write_length(op, lit - 15);
+	} else
+		*token = lit << 4;
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	return op - dst;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef _LZ4_H_
+#define _LZ4_H_
+
+#include <efi.h>
+
+/* LZ4 block compression (cf. https://github.com/lz4/lz4/blob/dev/doc)
+ * for blocks of at most LZ4_MAX_BLOCK_SIZE bytes.  The caller
+ * provides the hash table so that no dynamic memory allocation is
+ * made.  */
+#define LZ4_MAX_BLOCK_SIZE	(64 * 1024)
+#define LZ4_HASH_LOG		12
+#define LZ4_HASH_SIZE		(1 << LZ4_HASH_LOG)
+
+/* LZ4 frame with independent blocks of at most 64 KiB, no block
+ * checksum and no content checksum or size.  */
+#define LZ4_FRAME_MAGIC		0x184D2204
+#define LZ4_FRAME_FLG		0x60
+#define LZ4_FRAME_BD		0x40
+#define LZ4_FRAME_HC		0x82	/* (xxh32(FLG, BD) >> 8) & 0xff */
+#define LZ4_FRAME_UNCOMPRESSED	0x80000000
+
+/* Compress SRC_LEN bytes of SRC into DST.  Return the compressed
+ * size, or 0 if it does not fit in DST_LEN bytes.  */
+UINTN lz4_compress_block(const UINT8 *src, UINTN src_len,
+			 UINT8 *dst, UINTN dst_len,
+			 UINT16 table[LZ4_HASH_SIZE]);
+
+#endif	/* _LZ4_H_ */
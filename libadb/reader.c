@@ -34,11 +34,14 @@
 #include <slot.h>
 
 #include "acpi.h"
+#include "block_reader.h"
+#include "lz4.h"
 #ifndef __LP64__
 #include "pae.h"
 #endif
 #include "reader.h"
 #include "sparse_format.h"
+#include "trace.h"
 
 /* Memory dump shared functions.  These functions do not make any
    dynamic memory allocation to avoid RAM corruption during the
@@ -173,6 +176,11 @@ static void memory_close(reader_ctx_t *ctx)
 #define SIZEOF_TOTALSZ		sizeof(((chunk_header_t *)0)->total_sz)
 #define MAX_CHUNK_SIZE		(((UINT64)1 << (SIZEOF_TOTALSZ * 8)) - EFI_PAGE_SIZE)
 
+struct page_chunk {
+	struct chunk_header hdr;
+	UINT32 fill;
+} __attribute__((packed));
+
 static struct ram_priv {
 	memory_t m;
 
@@ -181,6 +189,12 @@ static struct ram_priv {
 	UINTN cur_chunk;
 	struct sparse_header sheader;
 	struct chunk_header chunks[MAX_MEMORY_REGION_NB];
+
+	/* Per page mode: each page of the RAW chunks is sent as a
+	   chunk of its own, a FILL chunk if the page is uniform.  */
+	BOOLEAN per_page;
+	EFI_PHYSICAL_ADDRESS page_end;
+	struct page_chunk page;
 } ram_priv = {
 	.sheader = {
 		.magic = SPARSE_HEADER_MAGIC,
@@ -228,7 +242,10 @@ static EFI_STATUS ram_add_chunk(reader_ctx_t *ctx, struct ram_priv *priv, UINT16
 		ctx->len += size;
 	}
 
-	priv->sheader.total_chunks++;
+	if (priv->per_page && type == CHUNK_TYPE_RAW)
+		priv->sheader.total_chunks += cur->chunk_sz;
+	else
+		priv->sheader.total_chunks++;
 	priv->sheader.total_blks += cur->chunk_sz;
 
 	return EFI_SUCCESS;
@@ -313,16 +330,125 @@ next:
 	if (!priv->m.end)
 		priv->m.end = prev_end;
 
-	ctx->len += sizeof(priv->sheader);
+	/* The size of the per page stream depends on the memory
+	   content: ram_read() reports the end of the stream.  */
+	if (priv->per_page)
+		ctx->len = (UINT64)-1;
+	else
+		ctx->len += sizeof(priv->sheader);
 	return EFI_SUCCESS;
 
 err:
 	return EFI_ERROR(ret) ? ret : EFI_INVALID_PARAMETER;
 }
 
+static EFI_STATUS ram_init(reader_ctx_t *ctx, void *priv_p)
+{
+	((struct ram_priv *)priv_p)->per_page = FALSE;
+	return ram_build_chunks(ctx, priv_p);
+}
+
+static EFI_STATUS ram_init_per_page(reader_ctx_t *ctx, void *priv_p)
+{
+	((struct ram_priv *)priv_p)->per_page = TRUE;
+	return ram_build_chunks(ctx, priv_p);
+}
+
 static EFI_STATUS ram_open(reader_ctx_t *ctx, UINTN argc, char **argv)
 {
-	return memory_open(ctx, &ram_priv.m, ram_build_chunks, argc, argv);
+	return memory_open(ctx, &ram_priv.m, ram_init, argc, argv);
+}
+
+static EFI_STATUS ram_open_per_page(reader_ctx_t *ctx, UINTN argc, char **argv)
+{
+	return memory_open(ctx, &ram_priv.m, ram_init_per_page, argc, argv);
+}
+
+static BOOLEAN is_uniform_page(unsigned char *page, UINT64 len)
+{
+	UINT64 *words = (UINT64 *)page;
+	UINTN i;
+
+	if (len != EFI_PAGE_SIZE || (UINT32)words[0] != words[0] >> 32)
+		return FALSE;
+
+	for (i = 1; i < EFI_PAGE_SIZE / sizeof(*words); i++)
+		if (words[i] != words[0])
+			return FALSE;
+
+	return TRUE;
+}
+
+/* Send the chunk header of the page at PRIV->M.CUR.  */
+static EFI_STATUS ram_start_page(struct ram_priv *priv, unsigned char **buf, UINT64 *len)
+{
+#ifndef __LP64__
+	EFI_STATUS ret;
+#endif
+	unsigned char *page;
+	UINT64 page_len = EFI_PAGE_SIZE;
+
+	if (*len < sizeof(priv->page))
+		return EFI_INVALID_PARAMETER;
+
+#ifdef __LP64__
+	page = (unsigned char *)priv->m.cur;
+#else
+	ret = pae_map(priv->m.cur, &page, &page_len);
+	if (EFI_ERROR(ret))
+		return ret;
+#endif
+
+	priv->page.hdr.chunk_sz = 1;
+	priv->page_end = priv->m.cur + EFI_PAGE_SIZE;
+	*buf = (unsigned char *)&priv->page;
+
+	if (is_uniform_page(page, page_len)) {
+		priv->page.hdr.chunk_type = CHUNK_TYPE_FILL;
+		priv->page.hdr.total_sz = sizeof(priv->page);
+		priv->page.fill = *(UINT32 *)page;
+		priv->m.cur = priv->page_end;
+		*len = sizeof(priv->page);
+	} else {
+		priv->page.hdr.chunk_type = CHUNK_TYPE_RAW;
+		priv->page.hdr.total_sz = sizeof(priv->page.hdr) + EFI_PAGE_SIZE;
+		*len = sizeof(priv->page.hdr);
+	}
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS ram_read_per_page(struct ram_priv *priv, unsigned char **buf, UINT64 *len)
+{
+	struct chunk_header *chunk;
+
+	/* Continue to send the current page */
+	if (priv->m.cur != priv->page_end) {
+		*len = min(*len, priv->page_end - priv->m.cur);
+		return memory_read_current(&priv->m, buf, len);
+	}
+
+	if (priv->m.cur != priv->m.cur_end)
+		return ram_start_page(priv, buf, len);
+
+	/* End of the stream */
+	if (priv->cur_chunk == priv->chunk_nb) {
+		*len = 0;
+		return EFI_SUCCESS;
+	}
+
+	chunk = &priv->chunks[priv->cur_chunk++];
+	priv->m.cur_end = priv->m.cur + chunk->chunk_sz * EFI_PAGE_SIZE;
+	if (chunk->chunk_type == CHUNK_TYPE_RAW)
+		return ram_start_page(priv, buf, len);
+
+	if (*len < sizeof(*chunk))
+		return EFI_INVALID_PARAMETER;
+
+	*buf = (unsigned char *)chunk;
+	*len = sizeof(*chunk);
+	priv->m.cur = priv->page_end = priv->m.cur_end;
+	return EFI_SUCCESS;
 }
 
 static EFI_STATUS ram_read(reader_ctx_t *ctx, unsigned char **buf, UINT64 *len)
@@ -337,10 +463,13 @@ static EFI_STATUS ram_read(reader_ctx_t *ctx, unsigned char **buf, UINT64 *len)
 
 		*buf = (unsigned char *)&priv->sheader;
 		*len = sizeof(priv->sheader);
-		priv->m.cur = priv->m.cur_end = priv->m.start;
+		priv->m.cur = priv->m.cur_end = priv->page_end = priv->m.start;
 		return EFI_SUCCESS;
 	}
 
+	if (priv->per_page)
+		return ram_read_per_page(priv, buf, len);
+
 	/* Start new chunk */
 	if (priv->m.cur == priv->m.cur_end) {
 		if (priv->cur_chunk == priv->chunk_nb || *len < sizeof(*priv->chunks)) {
@@ -590,16 +719,181 @@ static EFI_STATUS vmcore_read(reader_ctx_t *ctx, unsigned char **buf, UINT64 *le
 	return memory_read_current(&priv->m, buf, len);
 }
 
-/* Partition reader */
-#define PART_READER_BUF_SIZE (10 * 1024 * 1024)
+/* Compressed memory dump readers.  The output of the ram or vmcore
+   reader is compressed on the fly as a LZ4 frame which can be
+   decompressed on the host with the lz4 tool.  As the memory dump
+   readers, they do not make any dynamic memory allocation.  */
+#define LZ4_FRAME_HEADER_SIZE	7
+#define LZ4_BLOCK_HEADER_SIZE	sizeof(UINT32)
+
+static struct lz4_priv {
+	BOOLEAN is_in_used;
+	BOOLEAN done;
+
+	/* Uncompressed stream */
+	reader_ctx_t inner;
+	EFI_STATUS (*read)(reader_ctx_t *, unsigned char **, UINT64 *);
+	unsigned char *pending;
+	UINT64 pending_len;
+
+	/* Current LZ4 block */
+	UINT8 in[LZ4_MAX_BLOCK_SIZE];
+	UINT8 out[LZ4_BLOCK_HEADER_SIZE + LZ4_MAX_BLOCK_SIZE];
+	UINTN out_cur;
+	UINTN out_len;
+	UINT16 table[LZ4_HASH_SIZE];
+} lz4_priv;
+
+static EFI_STATUS lz4_open(reader_ctx_t *ctx,
+			   EFI_STATUS (*open)(reader_ctx_t *, UINTN, char **),
+			   EFI_STATUS (*read)(reader_ctx_t *, unsigned char **, UINT64 *),
+			   UINTN argc, char **argv)
+{
+	EFI_STATUS ret;
+	struct lz4_priv *priv = &lz4_priv;
+	UINT32 magic = LZ4_FRAME_MAGIC;
+
+	if (priv->is_in_used)
+		return EFI_ALREADY_STARTED;
+
+	ret = open(&priv->inner, argc, argv);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	priv->is_in_used = TRUE;
+	priv->done = FALSE;
+	priv->read = read;
+	priv->pending_len = 0;
+
+	memcpy(priv->out, &magic, sizeof(magic));
+	priv->out[4] = LZ4_FRAME_FLG;
+	priv->out[5] = LZ4_FRAME_BD;
+	priv->out[6] = LZ4_FRAME_HC;
+	priv->out_cur = 0;
+	priv->out_len = LZ4_FRAME_HEADER_SIZE;
+
+	ctx->private = priv;
+	ctx->cur = 0;
+	ctx->len = (UINT64)-1;
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS ramz_open(reader_ctx_t *ctx, UINTN argc, char **argv)
+{
+	return lz4_open(ctx, ram_open_per_page, ram_read, argc, argv);
+}
+
+static EFI_STATUS vmcorez_open(reader_ctx_t *ctx, UINTN argc, char **argv)
+{
+	return lz4_open(ctx, vmcore_open, vmcore_read, argc, argv);
+}
+
+/* Compress the next LZ4_MAX_BLOCK_SIZE bytes of the inner stream.
+   Pieces of data returned by the inner reader which do not fit in
+   the current block are kept for the next one.  */
+static EFI_STATUS lz4_next_block(struct lz4_priv *priv)
+{
+	EFI_STATUS ret;
+	unsigned char *data;
+	UINT64 len;
+	UINTN in_len = 0;
+	UINT32 size;
+
+	while (in_len < sizeof(priv->in)) {
+		if (!priv->pending_len) {
+			if (priv->inner.cur == priv->inner.len)
+				break;
+
+			len = min((UINT64)sizeof(priv->in),
+				  priv->inner.len - priv->inner.cur);
+			ret = priv->read(&priv->inner, &data, &len);
+			if (EFI_ERROR(ret))
+				return ret;
+			if (len == 0)
+				break;
+
+			priv->inner.cur += len;
+			priv->pending = data;
+			priv->pending_len = len;
+		}
+
+		len = min(priv->pending_len, (UINT64)(sizeof(priv->in) - in_len));
+		memcpy(priv->in + in_len, priv->pending, len);
+		in_len += len;
+		priv->pending += len;
+		priv->pending_len -= len;
+	}
+
+	priv->out_cur = 0;
+
+	/* End mark */
+	if (in_len == 0) {
+		memset(priv->out, 0, LZ4_BLOCK_HEADER_SIZE);
+		priv->out_len = LZ4_BLOCK_HEADER_SIZE;
+		priv->done = TRUE;
+		return EFI_SUCCESS;
+	}
+
+	size = lz4_compress_block(priv->in, in_len,
+				  priv->out + LZ4_BLOCK_HEADER_SIZE, in_len - 1,
+				  priv->table);
+	if (!size) {
+		/* Incompressible data is stored as is */
+		memcpy(priv->out + LZ4_BLOCK_HEADER_SIZE, priv->in, in_len);
+		size = in_len;
+		priv->out_len = LZ4_BLOCK_HEADER_SIZE + size;
+		size |= LZ4_FRAME_UNCOMPRESSED;
+	} else
+		priv->out_len = LZ4_BLOCK_HEADER_SIZE + size;
+
+	memcpy(priv->out, &size, sizeof(size));
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS lz4_read(reader_ctx_t *ctx, unsigned char **buf, UINT64 *len)
+{
+	EFI_STATUS ret;
+	struct lz4_priv *priv = ctx->private;
+
+	if (priv->out_cur == priv->out_len) {
+		if (priv->done) {
+			*len = 0;
+			return EFI_SUCCESS;
+		}
+
+		ret = lz4_next_block(priv);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	*len = min(*len, (UINT64)(priv->out_len - priv->out_cur));
+	*buf = priv->out + priv->out_cur;
+	priv->out_cur += *len;
+
+	return EFI_SUCCESS;
+}
+
+static void lz4_close(reader_ctx_t *ctx)
+{
+	struct lz4_priv *priv = ctx->private;
+
+	memory_close(&priv->inner);
+	priv->is_in_used = FALSE;
+}
+
+/* Partition reader.  The partition is read ahead in chunks so that
+   the disk reads overlap with the transfer of the previous data. */
+#define PART_READER_CHUNK_SIZE (2 * 1024 * 1024)
+#define PART_READER_DEPTH 3
 
 struct part_priv {
 	struct gpt_partition_interface gparti;
-	BOOLEAN need_more_data;
-	unsigned char buf[PART_READER_BUF_SIZE];
+	struct block_reader *br;
+	unsigned char *buf;
 	UINTN buf_cur;
 	UINTN buf_len;
-	UINT64 offset;
 };
 
 static EFI_STATUS _part_open(reader_ctx_t *ctx, UINTN argc, char **argv, logical_unit_t log_unit)
@@ -617,7 +911,6 @@ static EFI_STATUS _part_open(reader_ctx_t *ctx, UINTN argc, char **argv, logical
 	if (!priv)
 		return EFI_OUT_OF_RESOURCES;
 
-
 	partname = stra_to_str((CHAR8 *)argv[0]);
 	if (!partname) {
 		error(L"Failed to convert partition name to CHAR16");
@@ -632,7 +925,6 @@ static EFI_STATUS _part_open(reader_ctx_t *ctx, UINTN argc, char **argv, logical
 		goto err;
 	}
 
-	priv->offset = gparti->part.starting_lba * gparti->bio->Media->BlockSize;
 	length = (gparti->part.ending_lba + 1 - gparti->part.starting_lba) *
 		gparti->bio->Media->BlockSize;
 
@@ -653,7 +945,13 @@ static EFI_STATUS _part_open(reader_ctx_t *ctx, UINTN argc, char **argv, logical
 
 	priv->buf_cur = 0;
 	priv->buf_len = 0;
-	priv->need_more_data = TRUE;
+
+	ret = block_reader_open(&priv->br, gparti, ctx->cur, ctx->len - ctx->cur,
+				PART_READER_CHUNK_SIZE, PART_READER_DEPTH);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to open the partition reader");
+		goto err;
+	}
 
 	return EFI_SUCCESS;
 
@@ -677,29 +975,31 @@ static EFI_STATUS part_read(reader_ctx_t *ctx, unsigned char **buf, UINT64 *len)
 	EFI_STATUS ret;
 	struct part_priv *priv = ctx->private;
 
-	if (priv->need_more_data) {
-		priv->buf_len = min(sizeof(priv->buf), ctx->len - ctx->cur);
-		ret = uefi_call_wrapper(priv->gparti.dio->ReadDisk, 5, priv->gparti.dio,
-					priv->gparti.bio->Media->MediaId,
-					priv->offset + ctx->cur, priv->buf_len, priv->buf);
-		if (EFI_ERROR(ret)) {
-			efi_perror(ret, L"Failed to read partition");
+	if (priv->buf_cur == priv->buf_len) {
+		ret = block_reader_next(priv->br, &priv->buf, &priv->buf_len);
+		if (EFI_ERROR(ret))
 			return ret;
-		}
+		if (priv->buf_len == 0)
+			return EFI_END_OF_MEDIA;
 
-		priv->need_more_data = FALSE;
 		priv->buf_cur = 0;
 	}
 
 	*len = min(*len, priv->buf_len - priv->buf_cur);
 	*buf = priv->buf + priv->buf_cur;
 	priv->buf_cur += *len;
-	if (priv->buf_cur == priv->buf_len)
-		priv->need_more_data = TRUE;
 
 	return EFI_SUCCESS;
 }
 
+static void part_close(reader_ctx_t *ctx)
+{
+	struct part_priv *priv = ctx->private;
+
+	block_reader_close(priv->br);
+	FreePool(priv);
+}
+
 /* ACPI table reader */
 static EFI_STATUS acpi_open(reader_ctx_t *ctx, UINTN argc, char **argv)
 {
@@ -987,6 +1287,28 @@ static EFI_STATUS bert_region_read(reader_ctx_t *ctx, unsigned char **buf, UINT6
 	return EFI_SUCCESS;
 }
 
+/* Boot trace reader */
+static EFI_STATUS trace_open(reader_ctx_t *ctx, UINTN argc,
+			     __attribute__((__unused__)) char **argv)
+{
+	EFI_STATUS ret;
+	UINTN size;
+
+	if (argc != 0)
+		return EFI_INVALID_PARAMETER;
+
+	ret = trace_export(&ctx->private, &size, (UINTN)-1);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to export the boot trace");
+		return ret;
+	}
+
+	ctx->cur = 0;
+	ctx->len = size;
+
+	return EFI_SUCCESS;
+}
+
 /* Interface */
 static EFI_STATUS read_from_private(reader_ctx_t *ctx, unsigned char **buf,
 				    __attribute__((__unused__)) UINT64 *len)
@@ -1008,16 +1330,19 @@ struct reader {
 } READERS[] = {
 	{ "ram",		ram_open,			ram_read,		memory_close },
 	{ "vmcore",		vmcore_open,			vmcore_read,		memory_close },
+	{ "ramz",		ramz_open,			lz4_read,		lz4_close },
+	{ "vmcorez",		vmcorez_open,			lz4_read,		lz4_close },
 	{ "acpi",		acpi_open,			read_from_private,	NULL },
-	{ "part",		part_open,			part_read,		free_private },
-	{ "factory-part",	factory_part_open,		part_read,		free_private },
+	{ "part",		part_open,			part_read,		part_close },
+	{ "factory-part",	factory_part_open,		part_read,		part_close },
 	{ "efivar",		efivar_open,			read_from_private,	free_private },
 	{ "mbr",		mbr_open,			read_from_private,	free_private },
 	{ "gpt-header",		gpt_header_open,		read_from_private,	free_private },
 	{ "gpt-parts",		gpt_parts_open,			read_from_private,	free_private },
 	{ "gpt-factory-header",	gpt_factory_header_open,	read_from_private,	free_private },
 	{ "gpt-factory-parts",	gpt_factory_parts_open,		read_from_private,	free_private },
-	{ "bert-region",	bert_region_open,		bert_region_read,	NULL }
+	{ "bert-region",	bert_region_open,		bert_region_read,	NULL },
+	{ "trace",		trace_open,			read_from_private,	free_private }
 };
 
 #define MAX_ARGS		8
@@ -69,16 +69,15 @@ typedef union {
 	} data;
 } sync_msg_t;
 
+/* Maximum size of a DATA chunk, the host rejects bigger ones.  */
 #define SYNC_DATA_MAX (64 * 1024)
 
 typedef struct {
 	state_t state;
 	reader_ctx_t reader_ctx;
-	BOOLEAN need_more_data;
-	unsigned char *buf;
-	UINT64 buf_cur;
-	UINT64 buf_len;
 	UINT64 sent;
+	UINTN window_full;
+	UINTN starved;
 } sync_ctx_t;
 static sync_ctx_t CONTEXTS[MAX_ADB_SOCKET];
 
@@ -126,60 +125,85 @@ static EFI_STATUS sync_service_close(asock_t s)
 	return EFI_SUCCESS;
 }
 
-static EFI_STATUS send_done(asock_t s, sync_ctx_t *ctx)
-{
-	sync_msg_t msg;
-
-	reader_close(&ctx->reader_ctx);
-
-	ctx->state = ESTABLISHED;
-
-	msg.req.id = ID_DONE;
-	msg.req.namelen = 0;
-	return asock_write(s, (unsigned char *)&msg, sizeof(msg.req));
-}
-
 #define DATA_PROGRESS_THRESHOLD (5 * 1024 * 1024)
 
-static EFI_STATUS send_more_data(asock_t s, sync_ctx_t *ctx)
+/* The sync protocol is a stream on top of the adb socket: pack as
+   many DATA chunks as the negociated payload size allows in a single
+   WRTE packet so that each host round trip carries up to
+   adb_max_payload bytes.  Room is always kept for the DONE message.  */
+static EFI_STATUS fill_packet(sync_ctx_t *ctx, unsigned char *pkt, UINT32 *size)
 {
 	EFI_STATUS ret;
-	UINT32 sent;
+	unsigned char *data;
+	UINT32 cur = 0;
+	UINT64 len;
 	sync_msg_t msg;
 
-	/* Need to load more data. */
-	if (ctx->need_more_data) {
-		ctx->buf_len = SYNC_DATA_MAX;
+	while (cur + 2 * sizeof(msg.data) < adb_max_payload) {
+		len = min((UINT64)SYNC_DATA_MAX,
+			  (UINT64)adb_max_payload - cur - 2 * sizeof(msg.data));
 
-		ret = reader_read(&ctx->reader_ctx, &ctx->buf, &ctx->buf_len);
+		ret = reader_read(&ctx->reader_ctx, &data, &len);
 		if (EFI_ERROR(ret))
 			return ret;
-		if (ctx->buf_len == 0) /* No more data to send. */
-			return send_done(s, ctx);
 
-		msg.data.id = ID_DATA;
-		msg.data.size = ctx->buf_len;
-		ctx->buf_cur = 0;
-		ctx->need_more_data = FALSE;
+		if (len == 0) { /* No more data to send. */
+			reader_close(&ctx->reader_ctx);
+			ctx->state = ESTABLISHED;
+			debug(L"%ld bytes sent, window full %d times, starved %d times",
+			      ctx->sent, ctx->window_full, ctx->starved);
+
+			msg.req.id = ID_DONE;
+			msg.req.namelen = 0;
+			memcpy(pkt + cur, &msg, sizeof(msg.req));
+			cur += sizeof(msg.req);
+			break;
+		}
 
-		return asock_write(s, (unsigned char *)&msg, sizeof(msg.data));
+		msg.data.id = ID_DATA;
+		msg.data.size = len;
+		memcpy(pkt + cur, &msg, sizeof(msg.data));
+		cur += sizeof(msg.data);
+		memcpy(pkt + cur, data, len);
+		cur += len;
+
+		ctx->sent += len;
+		if (ctx->sent >= DATA_PROGRESS_THRESHOLD &&
+		    ctx->sent % DATA_PROGRESS_THRESHOLD < len)
+			debug(L"%d MB have been sent", ctx->sent / 1024 / 1024);
 	}
 
-	sent = min((UINTN)adb_max_payload, ctx->buf_len - ctx->buf_cur);
-	ret = asock_write(s, ctx->buf + ctx->buf_cur, sent);
-	if (EFI_ERROR(ret))
-		return ret;
+	*size = cur;
+	return EFI_SUCCESS;
+}
 
-	ctx->buf_cur = ctx->buf_cur + sent;
-	if (ctx->buf_cur == ctx->buf_len)
-		ctx->need_more_data = TRUE;
+/* Keep as many packets in flight as the socket allows: with delayed
+   acks, the next packets are read and prepared while the previous
+   ones are on the wire instead of waiting for the host acknowledgment
+   of each of them.  */
+static EFI_STATUS send_more_data(asock_t s, sync_ctx_t *ctx)
+{
+	EFI_STATUS ret;
+	unsigned char *pkt;
+	UINT32 size;
+
+	while (ctx->state == SENDING_DATA) {
+		pkt = asock_buffer(s);
+		if (!pkt) {
+			ctx->window_full++;
+			break;
+		}
 
-	ctx->sent += sent;
-	if (ctx->sent >= DATA_PROGRESS_THRESHOLD &&
-	    ctx->sent % DATA_PROGRESS_THRESHOLD < sent)
-		debug(L"%d MB have been sent", ctx->sent / 1024 / 1024);
+		ret = fill_packet(ctx, pkt, &size);
+		if (EFI_ERROR(ret))
+			return ret;
 
-	return ret;
+		ret = asock_write(s, pkt, size);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	return EFI_SUCCESS;
 }
 
 static EFI_STATUS sync_service_okay(asock_t s)
@@ -190,8 +214,11 @@ static EFI_STATUS sync_service_okay(asock_t s)
 	if (!ctx)
 		return EFI_INVALID_PARAMETER;
 
-	if (ctx->state == SENDING_DATA)
+	if (ctx->state == SENDING_DATA) {
+		if (!asock_inflight(s))
+			ctx->starved++;
 		ret = send_more_data(s, ctx);
+	}
 
 	return ret;
 }
@@ -254,8 +281,9 @@ static EFI_STATUS sync_service_recv(asock_t s, sync_ctx_t *ctx, unsigned char *d
 		return ret;
 
 	ctx->sent = 0;
+	ctx->window_full = 0;
+	ctx->starved = 0;
 	ctx->state = SENDING_DATA;
-	ctx->need_more_data = TRUE;
 
 	return send_more_data(s, ctx);
 }
@@ -27,6 +27,7 @@ SHARED_SRC_FILES := \
 	fastboot_oem.c \
 	fastboot_flashing.c \
 	flash.c \
+	flash_jobs.c \
 	sparse.c \
 	info.c \
 	intel_variables.c \
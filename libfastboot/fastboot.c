@@ -44,6 +44,7 @@
 
 #include "uefi_utils.h"
 #include "gpt.h"
+#include "bufpool.h"
 #include "fastboot.h"
 #include "flash.h"
 #include "fastboot_oem.h"
@@ -66,16 +67,52 @@
 #define TIMEOUT 5
 #endif
 
+/* Variables are allocated from arenas of VAR_ARENA_COUNT entries,
+   looked up by a hash of their name and kept in publication order
+   for "getvar all".  */
+#define VAR_HASH_SIZE 256
+#define VAR_GROUP_HASH_SIZE 32
+#define VAR_ARENA_COUNT 128
+
 struct fastboot_var {
-	struct fastboot_var *next;
+	struct fastboot_var *next;	/* Publication order */
+	struct fastboot_var *prev;
+	struct fastboot_var *hnext;	/* Hash bucket */
+	struct fastboot_var **hpprev;
+	struct fastboot_var *gnext;	/* Prefix group */
+	struct var_group *group;
 	char name[MAX_VARIABLE_LENGTH];
 	char value[MAX_VARIABLE_LENGTH];
 	const char *(*get_value)(void);
 };
 
-struct fastboot_tx_buffer {
-	struct fastboot_tx_buffer *next;
-	char msg[MAGIC_LENGTH];
+/* Variables sharing the same name up to the ':' separator, like the
+   "partition-size:" ones, belong to the same group so that
+   delete_var_starting_with() only visits the groups and the variables
+   it deletes.  Groups are kept when they become empty, they are
+   filled again by refresh_partition_var().  */
+struct var_group {
+	struct var_group *next;
+	struct var_group *hnext;
+	struct fastboot_var *vars;
+	UINTN key_len;
+	char key[MAX_VARIABLE_LENGTH];
+};
+
+struct var_arena {
+	struct var_arena *next;
+	struct fastboot_var vars[VAR_ARENA_COUNT];
+};
+
+/* Responses buffered while a command runs are queued in a ring which
+   grows as needed.  */
+#define TX_RING_INIT_SIZE 64
+
+struct fastboot_tx_ring {
+	char (*msg)[MAGIC_LENGTH];
+	UINTN size;
+	UINTN head;		/* Oldest message */
+	UINTN count;
 };
 
 struct cmdlist {
@@ -98,8 +135,13 @@ enum fastboot_states {
 static cmdlist_t cmdlist;
 static char *command_buffer;
 static UINTN command_buffer_size;
-static struct fastboot_var *varlist;
-static struct fastboot_tx_buffer *txbuf_head;
+static struct fastboot_var *varlist, *varlist_tail;
+static struct fastboot_var *var_hash[VAR_HASH_SIZE];
+static struct var_group *var_groups;
+static struct var_group *var_group_hash[VAR_GROUP_HASH_SIZE];
+static struct var_arena *var_arenas;
+static struct fastboot_var *var_free;
+static struct fastboot_tx_ring txring;
 static enum fastboot_states fastboot_state;
 static enum fastboot_states next_state;
 
@@ -223,20 +265,89 @@ void fastboot_cmdlist_unregister(cmdlist_t *list)
 	*list = NULL;
 }
 
+static UINT32 var_name_hash(const char *name, UINTN len)
+{
+	UINT32 hash = 2166136261U;	/* FNV-1a */
+
+	while (len--) {
+		hash ^= (UINT8)*name++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static UINTN var_group_key_len(const char *name)
+{
+	CHAR8 *sep = strchr((CHAR8 *)name, ':');
+
+	return sep ? (UINTN)(sep - (CHAR8 *)name) + 1 : (UINTN)strlena((CHAR8 *)name);
+}
+
 struct fastboot_var *fastboot_getvar(const char *name)
 {
 	struct fastboot_var *var;
+	UINT32 hash = var_name_hash(name, strlena((CHAR8 *)name));
 
-	for (var = varlist; var; var = var->next)
+	for (var = var_hash[hash % VAR_HASH_SIZE]; var; var = var->hnext)
 		if (!strcmp((CHAR8 *)name, (const CHAR8 *)var->name))
 			return var;
 
 	return NULL;
 }
 
-static struct fastboot_var *fastboot_getvar_or_create(const char *name)
+static struct var_group *get_var_group(const char *name)
 {
+	struct var_group *group, **bucket;
+	UINTN key_len = var_group_key_len(name);
+
+	bucket = &var_group_hash[var_name_hash(name, key_len) % VAR_GROUP_HASH_SIZE];
+	for (group = *bucket; group; group = group->hnext)
+		if (group->key_len == key_len && !memcmp(group->key, name, key_len))
+			return group;
+
+	group = AllocateZeroPool(sizeof(*group));
+	if (!group)
+		return NULL;
+
+	CopyMem(group->key, name, key_len);
+	group->key_len = key_len;
+	group->hnext = *bucket;
+	*bucket = group;
+	group->next = var_groups;
+	var_groups = group;
+
+	return group;
+}
+
+static struct fastboot_var *alloc_var(void)
+{
+	struct var_arena *arena;
 	struct fastboot_var *var;
+	UINTN i;
+
+	if (!var_free) {
+		arena = AllocatePool(sizeof(*arena));
+		if (!arena)
+			return NULL;
+		arena->next = var_arenas;
+		var_arenas = arena;
+		for (i = 0; i < VAR_ARENA_COUNT; i++) {
+			arena->vars[i].next = var_free;
+			var_free = &arena->vars[i];
+		}
+	}
+
+	var = var_free;
+	var_free = var->next;
+	ZeroMem(var, sizeof(*var));
+	return var;
+}
+
+static struct fastboot_var *fastboot_getvar_or_create(const char *name)
+{
+	struct fastboot_var *var, **bucket;
+	struct var_group *group;
 	UINTN size;
 
 	size = strlena((CHAR8 *) name) + 1;
@@ -246,50 +357,113 @@ static struct fastboot_var *fastboot_getvar_or_create(const char *name)
 	}
 
 	var = fastboot_getvar(name);
+	if (var)
+		return var;
+
+	group = get_var_group(name);
+	var = group ? alloc_var() : NULL;
 	if (!var) {
-		var = AllocateZeroPool(sizeof(*var));
-		if (!var) {
-			error(L"Failed to allocate variable '%a'", name);
-			return NULL;
-		}
-		var->next = varlist;
-		varlist = var;
-		CopyMem(var->name, name, size);
+		error(L"Failed to allocate variable '%a'", name);
+		return NULL;
 	}
+	CopyMem(var->name, name, size);
+
+	var->prev = varlist_tail;
+	if (varlist_tail)
+		varlist_tail->next = var;
+	else
+		varlist = var;
+	varlist_tail = var;
+
+	bucket = &var_hash[var_name_hash(name, size - 1) % VAR_HASH_SIZE];
+	var->hnext = *bucket;
+	if (*bucket)
+		(*bucket)->hpprev = &var->hnext;
+	var->hpprev = bucket;
+	*bucket = var;
+
+	var->group = group;
+	var->gnext = group->vars;
+	group->vars = var;
 
 	return var;
 }
 
+/* Unlink VAR from the publication order and from its hash bucket and
+   release it.  The caller takes care of the group.  */
+static void release_var(struct fastboot_var *var)
+{
+	if (var->prev)
+		var->prev->next = var->next;
+	else
+		varlist = var->next;
+	if (var->next)
+		var->next->prev = var->prev;
+	else
+		varlist_tail = var->prev;
+
+	*var->hpprev = var->hnext;
+	if (var->hnext)
+		var->hnext->hpprev = var->hpprev;
+
+	var->next = var_free;
+	var_free = var;
+}
+
 static void delete_var_starting_with(const char *prefix)
 {
-	struct fastboot_var *var;
-	struct fastboot_var *old_varlist;
-	struct fastboot_var *next;
+	struct var_group *group;
+	struct fastboot_var *var, *next, **pvar;
+	UINTN len = strlena((CHAR8 *)prefix);
+
+	for (group = var_groups; group; group = group->next) {
+		if (group->key_len >= len) {
+			/* The whole group matches, or none of it. */
+			if (memcmp(prefix, group->key, len))
+				continue;
+			for (var = group->vars; var; var = next) {
+				next = var->gnext;
+				release_var(var);
+			}
+			group->vars = NULL;
+			continue;
+		}
 
-	old_varlist = varlist;
-	varlist = NULL;
+		if (memcmp(prefix, group->key, group->key_len))
+			continue;
 
-	for (var = old_varlist; var; var = next) {
-		next = var->next;
-		if (!memcmp(prefix, var->name, strlena((CHAR8 *)prefix))) {
-			FreePool(var);
-		} else {
-			var->next = varlist;
-			varlist = var;
+		for (pvar = &group->vars; *pvar; ) {
+			var = *pvar;
+			if (!memcmp(prefix, var->name, len)) {
+				*pvar = var->gnext;
+				release_var(var);
+			} else
+				pvar = &var->gnext;
 		}
 	}
 }
 
 static void fastboot_unpublish_all()
 {
-	struct fastboot_var *next, *var;
+	struct var_arena *arena, *next_arena;
+	struct var_group *group, *next_group;
 
-	for (var = varlist; var; var = next) {
-		next = var->next;
-		FreePool(var);
+	for (arena = var_arenas; arena; arena = next_arena) {
+		next_arena = arena->next;
+		FreePool(arena);
 	}
 
-	varlist = NULL;
+	for (group = var_groups; group; group = next_group) {
+		next_group = group->next;
+		FreePool(group);
+	}
+
+	var_arenas = NULL;
+	var_free = NULL;
+	var_groups = NULL;
+	varlist = varlist_tail = NULL;
+	ZeroMem(var_hash, sizeof(var_hash));
+	ZeroMem(var_group_hash, sizeof(var_group_hash));
 }
 
 EFI_STATUS fastboot_publish_dynamic(const char *name, const char *(get_value)(void))
@@ -494,6 +668,83 @@ static EFI_STATUS publish_slots(void)
 	return EFI_SUCCESS;
 }
 
+static EFI_STATUS publish_gpt_part(struct gpt_partition_interface *gparti)
+{
+	EFI_STATUS ret;
+	UINT64 size;
+
+	size = gparti->bio->Media->BlockSize
+		* (gparti->part.ending_lba + 1 - gparti->part.starting_lba);
+
+	ret = publish_part(gparti->part.name, size, &gparti->part.type);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	/* stay compatible with userdata/data naming */
+	if (!StrCmp(gparti->part.name, L"data"))
+		return publish_part(L"userdata", size, &gparti->part.type);
+	if (!StrCmp(gparti->part.name, L"userdata"))
+		return publish_part(L"data", size, &gparti->part.type);
+
+	return EFI_SUCCESS;
+}
+
+/* Partitions the variables have been published for, so that
+   refresh_partition_var() only publishes again the variables of the
+   partitions which have been added or changed.  */
+static struct part_snapshot {
+	UINT16 name[GPT_NAME_LEN];
+	EFI_GUID type;
+	UINT64 starting_lba;
+	UINT64 ending_lba;
+	BOOLEAN seen;
+} *part_snapshot;
+static UINTN part_snapshot_count;
+
+static void save_part_snapshot(struct gpt_partition_interface *gparti, UINTN part_count)
+{
+	UINTN i;
+
+	if (part_snapshot) {
+		FreePool(part_snapshot);
+		part_snapshot = NULL;
+	}
+	part_snapshot_count = 0;
+
+	if (!part_count)
+		return;
+
+	part_snapshot = AllocatePool(part_count * sizeof(*part_snapshot));
+	if (!part_snapshot)
+		return;
+
+	for (i = 0; i < part_count; i++) {
+		memcpy(part_snapshot[i].name, gparti[i].part.name,
+		       sizeof(part_snapshot[i].name));
+		memcpy(&part_snapshot[i].type, &gparti[i].part.type,
+		       sizeof(part_snapshot[i].type));
+		part_snapshot[i].starting_lba = gparti[i].part.starting_lba;
+		part_snapshot[i].ending_lba = gparti[i].part.ending_lba;
+	}
+	part_snapshot_count = part_count;
+}
+
+/* The partitions usually keep their order in the GPT, so the lookup
+   starts at the same index.  */
+static struct part_snapshot *find_part_snapshot(struct gpt_partition *part, UINTN index)
+{
+	UINTN i, j;
+
+	for (i = 0; i < part_snapshot_count; i++) {
+		j = (index + i) % part_snapshot_count;
+		if (!memcmp(part_snapshot[j].name, part->name,
+			    sizeof(part_snapshot[j].name)))
+			return &part_snapshot[j];
+	}
+
+	return NULL;
+}
+
 static EFI_STATUS publish_partsize(void)
 {
 	EFI_STATUS ret;
@@ -502,34 +753,79 @@ static EFI_STATUS publish_partsize(void)
 	UINTN i;
 
 	ret = gpt_list_partition(&gparti, &part_count, LOGICAL_UNIT_USER);
-	if (EFI_ERROR(ret) || part_count == 0)
+	if (EFI_ERROR(ret) || part_count == 0) {
+		save_part_snapshot(NULL, 0);
 		return EFI_SUCCESS;
+	}
 
 	for (i = 0; i < part_count; i++) {
-		UINT64 size;
+		ret = publish_gpt_part(&gparti[i]);
+		if (EFI_ERROR(ret)) {
+			save_part_snapshot(NULL, 0);
+			FreePool(gparti);
+			return ret;
+		}
+	}
 
-		size = gparti[i].bio->Media->BlockSize
-			* (gparti[i].part.ending_lba + 1 - gparti[i].part.starting_lba);
+	save_part_snapshot(gparti, part_count);
+	FreePool(gparti);
 
-		ret = publish_part(gparti[i].part.name, size, &gparti[i].part.type);
-		if (EFI_ERROR(ret))
-			return ret;
+	return EFI_SUCCESS;
+}
 
-		/* stay compatible with userdata/data naming */
-		if (!StrCmp(gparti[i].part.name, L"data")) {
-			ret = publish_part(L"userdata", size, &gparti[i].part.type);
-			if (EFI_ERROR(ret))
-				return ret;
-		} else if (!StrCmp(gparti[i].part.name, L"userdata")) {
-			ret = publish_part(L"data", size, &gparti[i].part.type);
-			if (EFI_ERROR(ret))
-				return ret;
+/* Publish the variables of the partitions added or changed since the
+   last publication.  If a partition has been removed, all the
+   partition variables are published again.  */
+static EFI_STATUS update_partsize(void)
+{
+	EFI_STATUS ret;
+	struct gpt_partition_interface *gparti;
+	struct part_snapshot *snap;
+	UINTN part_count, i, changed = 0;
+
+	if (!part_snapshot)
+		goto full;
+
+	ret = gpt_list_partition(&gparti, &part_count, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret) || part_count == 0)
+		goto full;
+
+	for (i = 0; i < part_snapshot_count; i++)
+		part_snapshot[i].seen = FALSE;
+
+	for (i = 0; i < part_count; i++) {
+		snap = find_part_snapshot(&gparti[i].part, i);
+		if (snap) {
+			snap->seen = TRUE;
+			if (snap->starting_lba == gparti[i].part.starting_lba &&
+			    snap->ending_lba == gparti[i].part.ending_lba &&
+			    !CompareGuid(&snap->type, &gparti[i].part.type))
+				continue;
 		}
+
+		ret = publish_gpt_part(&gparti[i]);
+		if (EFI_ERROR(ret)) {
+			FreePool(gparti);
+			goto full;
+		}
+		changed++;
 	}
 
-	FreePool(gparti);
+	for (i = 0; i < part_snapshot_count; i++)
+		if (!part_snapshot[i].seen) {
+			FreePool(gparti);
+			goto full;
+		}
 
+	debug(L"%d of %d partitions changed", changed, part_count);
+	save_part_snapshot(gparti, part_count);
+	FreePool(gparti);
 	return EFI_SUCCESS;
+
+full:
+	delete_var_starting_with("partition-");
+	delete_var_starting_with("has-slot");
+	return publish_partsize();
 }
 
 static const char *get_battery_voltage_var()
@@ -593,6 +889,44 @@ static const char *get_erase_block_size_var()
 	return erase_block_size;
 }
 
+static const char *format_bufpool_stat(char *str, UINTN len, UINTN value)
+{
+	int ret;
+
+	ret = efi_snprintf((CHAR8 *)str, len, (CHAR8 *)"0x%lX", value);
+	if (ret < 0 || ret >= (int)len)
+		return NULL;
+
+	return str;
+}
+
+static const char *get_bufpool_in_use_var()
+{
+	static char value[MAX_VARIABLE_LENGTH];
+	struct bufpool_stats stats;
+
+	bufpool_get_stats(&stats);
+	return format_bufpool_stat(value, sizeof(value), stats.in_use);
+}
+
+static const char *get_bufpool_cached_var()
+{
+	static char value[MAX_VARIABLE_LENGTH];
+	struct bufpool_stats stats;
+
+	bufpool_get_stats(&stats);
+	return format_bufpool_stat(value, sizeof(value), stats.cached);
+}
+
+static const char *get_bufpool_high_water_var()
+{
+	static char value[MAX_VARIABLE_LENGTH];
+	struct bufpool_stats stats;
+
+	bufpool_get_stats(&stats);
+	return format_bufpool_stat(value, sizeof(value), stats.high_water);
+}
+
 static const char *get_logical_block_size_var()
 {
 	static char logical_block_size[MAX_VARIABLE_LENGTH];
@@ -649,31 +983,48 @@ void fastboot_ack(const char *code, const char *fmt, va_list ap)
 		fastboot_state = STATE_ERROR;
 }
 
+static EFI_STATUS txring_grow(void)
+{
+	char (*msg)[MAGIC_LENGTH];
+	UINTN size, i;
+
+	size = txring.size ? txring.size * 2 : TX_RING_INIT_SIZE;
+	msg = AllocatePool(size * sizeof(*msg));
+	if (!msg)
+		return EFI_OUT_OF_RESOURCES;
+
+	for (i = 0; i < txring.count; i++)
+		memcpy(msg[i], txring.msg[(txring.head + i) % txring.size],
+		       sizeof(*msg));
+
+	if (txring.msg)
+		FreePool(txring.msg);
+	txring.msg = msg;
+	txring.size = size;
+	txring.head = 0;
+
+	return EFI_SUCCESS;
+}
+
 void fastboot_ack_buffered(const char *code, const char *fmt, va_list ap)
 {
-	struct fastboot_tx_buffer *new_txbuf;
-	struct fastboot_tx_buffer *txbuf;
 	EFI_STATUS ret;
+	char *msg;
 
-	new_txbuf = AllocateZeroPool(sizeof(*new_txbuf));
-	if (!new_txbuf) {
-		error(L"Failed to allocate memory");
-		return;
+	if (txring.count == txring.size) {
+		ret = txring_grow();
+		if (EFI_ERROR(ret)) {
+			error(L"Failed to allocate memory");
+			return;
+		}
 	}
 
-	ret = fastboot_build_ack_msg(new_txbuf->msg, code, fmt, ap);
-	if (EFI_ERROR(ret)) {
-		FreePool(new_txbuf);
+	msg = txring.msg[(txring.head + txring.count) % txring.size];
+	ret = fastboot_build_ack_msg(msg, code, fmt, ap);
+	if (EFI_ERROR(ret))
 		return;
-	}
-	if (!txbuf_head)
-		txbuf_head = new_txbuf;
-	else {
-		txbuf = txbuf_head;
-		while (txbuf->next)
-			txbuf = txbuf->next;
-		txbuf->next = new_txbuf;
-	}
+
+	txring.count++;
 	fastboot_state = STATE_TX;
 }
 
@@ -730,16 +1081,15 @@ void fastboot_okay(const char *fmt, ...)
 static void flush_tx_buffer(void)
 {
 	EFI_STATUS ret;
-	struct fastboot_tx_buffer *msg;
-	static CHAR8 buf[sizeof(msg->msg)];
+	static CHAR8 buf[MAGIC_LENGTH];
 
-	msg = txbuf_head;
-	txbuf_head = txbuf_head->next;
-	if (!txbuf_head)
+	/* The ring may grow while the write is pending, so the
+	   message is copied out of it. */
+	memcpy(buf, txring.msg[txring.head], sizeof(buf));
+	txring.head = (txring.head + 1) % txring.size;
+	if (!--txring.count)
 		fastboot_state = next_state;
 
-	memcpy(buf, msg->msg, sizeof(buf));
-	FreePool(msg);
 	ret = transport_write(buf, sizeof(buf));
 	if (EFI_ERROR(ret))
 		fastboot_state = STATE_ERROR;
@@ -758,8 +1108,6 @@ EFI_STATUS refresh_partition_var(void)
 {
 	EFI_STATUS ret;
 
-	delete_var_starting_with("partition-");
-	delete_var_starting_with("has-slot");
 	delete_var_starting_with("slot-");
 	delete_var_starting_with("current-slot");
 
@@ -773,7 +1121,7 @@ EFI_STATUS refresh_partition_var(void)
 	if (EFI_ERROR(ret))
 		return ret;
 
-	return publish_partsize();
+	return update_partsize();
 }
 
 static void cmd_flash(INTN argc, CHAR8 **argv)
@@ -1324,6 +1672,18 @@ static EFI_STATUS fastboot_init()
 	if (EFI_ERROR(ret))
 		goto error;
 
+	ret = fastboot_publish_dynamic("buffer-pool-in-use", get_bufpool_in_use_var);
+	if (EFI_ERROR(ret))
+		goto error;
+
+	ret = fastboot_publish_dynamic("buffer-pool-cached", get_bufpool_cached_var);
+	if (EFI_ERROR(ret))
+		goto error;
+
+	ret = fastboot_publish_dynamic("buffer-pool-high-water", get_bufpool_high_water_var);
+	if (EFI_ERROR(ret))
+		goto error;
+
 	ret = publish_partsize();
 	if (EFI_ERROR(ret))
 		goto error;
@@ -1458,6 +1818,15 @@ EFI_STATUS fastboot_start(void **bootimage, void **efiimage, UINTN *imagesize,
 	*efiimage = fastboot_efiimage;
 	*imagesize = fastboot_imagesize;
 
+	/* The image received in the download buffer now belongs to
+	   the caller.  A new download buffer is allocated if fastboot
+	   is started again. */
+	if (dl.data && (fastboot_bootimage == dl.data ||
+			fastboot_efiimage == dl.data)) {
+		dl.data = NULL;
+		dl.max_size = dl.size = 0;
+	}
+
 exit:
 	fastboot_free();
 	return ret;
@@ -1471,7 +1840,12 @@ EFI_STATUS fastboot_stop(void *bootimage, void *efiimage, UINTN imagesize,
 	fastboot_imagesize = imagesize;
 	fastboot_target = target;
 
-	if (imagesize && (bootimage || efiimage)) {
+	/* An image in the download buffer is not copied, the download
+	   buffer is handed over by fastboot_start(). */
+	if (imagesize && dl.data &&
+	    (bootimage == dl.data || efiimage == dl.data))
+		imgbuffer = dl.data;
+	else if (imagesize && (bootimage || efiimage)) {
 		imgbuffer = AllocatePool(imagesize);
 		if (!imgbuffer) {
 			error(L"Failed to allocate image buffer");
@@ -1509,4 +1883,5 @@ void fastboot_free()
 	fastboot_ui_destroy();
 #endif
 	gpt_free_cache();
+	bufpool_flush();
 }
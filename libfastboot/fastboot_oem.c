@@ -290,6 +290,39 @@ static void cmd_oem_gethashes(INTN argc, CHAR8 **argv)
 	fastboot_okay("");
 }
 
+static void cmd_oem_flash_verify(INTN argc, CHAR8 **argv)
+{
+	static const char *MODES[] = {
+		[FLASH_VERIFY_NONE] = "none",
+		[FLASH_VERIFY_SAMPLED] = "sampled",
+		[FLASH_VERIFY_ALL] = "all"
+	};
+	EFI_STATUS ret;
+	UINTN i;
+
+	if (argc != 2) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(MODES); i++)
+		if (!strcmp(argv[1], (CHAR8 *)MODES[i]))
+			break;
+
+	if (i == ARRAY_SIZE(MODES)) {
+		fastboot_fail("Invalid value");
+		return;
+	}
+
+	ret = flash_set_verify(i);
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Failed to set the flash verify mode, %r", ret);
+		return;
+	}
+
+	fastboot_okay("");
+}
+
 static void cmd_oem_set_storage(INTN argc, CHAR8 **argv)
 {
 	EFI_STATUS ret;
@@ -464,6 +497,32 @@ static void cmd_oem_rm(INTN argc, CHAR8 **argv)
 	fastboot_okay("");
 }
 
+static void cmd_oem_flash_write_depth(INTN argc, CHAR8 **argv)
+{
+	EFI_STATUS ret;
+	unsigned long value;
+	char *endptr;
+
+	if (argc != 2) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	value = strtoul((char *)argv[1], &endptr, 10);
+	if (*endptr != '\0' || !value || value > FLASH_MAX_WRITE_DEPTH) {
+		fastboot_fail("Invalid value");
+		return;
+	}
+
+	ret = flash_set_write_depth(value);
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Failed to set the flash write depth, %r", ret);
+		return;
+	}
+
+	fastboot_okay("");
+}
+
 static void cmd_oem_set_watchdog_counter_max(INTN argc, CHAR8 **argv)
 {
 	EFI_STATUS ret;
@@ -782,6 +841,8 @@ static struct fastboot_cmd COMMANDS[] = {
 #endif
 #endif
 	{ "get-hashes",			LOCKED,		cmd_oem_gethashes  },
+	{ "flash-verify",		LOCKED,		cmd_oem_flash_verify },
+	{ "flash-write-depth",		LOCKED,		cmd_oem_flash_write_depth },
 	{ "get-provisioning-logs",	LOCKED,		cmd_oem_get_logs },
 #ifdef BOOTLOADER_POLICY
 	{ "get-action-nonce",		LOCKED,		cmd_oem_get_action_nonce },
@@ -35,6 +35,8 @@
 #include <efi.h>
 #include <efilib.h>
 #include <lib.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
 #include <fastboot.h>
 #include <android.h>
 #include <slot.h>
@@ -43,12 +45,15 @@
 #include "gpt.h"
 #include "gpt_bin.h"
 #include "flash.h"
+#include "flash_jobs.h"
 #include "storage.h"
 #include "sparse.h"
 #include "oemvars.h"
 #include "vars.h"
 #include "bootloader.h"
 #include "authenticated_action.h"
+#include "protocol/DiskIo2.h"
+#include "bufpool.h"
 #if defined(IOC_USE_SLCAN) || defined(IOC_USE_CBC)
 #include "ioc_uart_protocol.h"
 #endif
@@ -56,60 +61,492 @@
 #include "aes_gcm.h"
 #include "keybox_provision.h"
 #endif
-static struct gpt_partition_interface gparti;
-static UINT64 cur_offset;
+/* Write-verify mode.  While a partition is flashed, the SHA-256 of
+   the logical image is computed: the skipped ranges are accounted as
+   zeros so that the digest matches the one of the image expanded by
+   simg2img on the host.  The written data of the verified blocks,
+   all of them or one out of VERIFY_SAMPLE_STRIDE, is hashed
+   separately and compared to the data read back from the partition
+   once the image is flashed.  */
+#define VERIFY_BLOCK_SIZE (64 * 1024)
+#define VERIFY_SAMPLE_STRIDE 64
+#define VERIFY_READ_SIZE (1024 * 1024)
+
+static enum flash_verify verify_mode = FLASH_VERIFY_NONE;
+
+struct verify_extent {
+	UINT64 start;
+	UINT64 len;
+};
+
+/* The written data is gathered into a request buffer until the next
+   boundary of write_size bytes is reached, so that the device gets
+   large writes aligned on its preferred transfer size whatever the
+   layout of the sparse image chunks is.  write_size is
+   FLASH_WRITE_CHUNK rounded up to the device preferred write unit.
+
+   When the partition device supports the Disk I/O 2 protocol, up to
+   write_depth requests are kept in flight so that the device is busy
+   while the next chunk of the image is parsed.  */
+#define FLASH_WRITE_CHUNK (1024 * 1024)
 
-#define part_start (gparti.part.starting_lba * gparti.bio->Media->BlockSize)
-#define part_end ((gparti.part.ending_lba + 1) * gparti.bio->Media->BlockSize)
+static UINTN write_depth = 4;
 
-#define is_inside_partition(off, sz) \
-		(off >= part_start && off + sz <= part_end)
+struct flash_write_req {
+	VOID *data;
+	BOOLEAN pending;
+	BOOLEAN completed;	/* Event already consumed by write_done() */
+	EFI_DISK_IO2_TOKEN token;
+};
 
-EFI_STATUS flash_skip(UINT64 size)
+/* State of the flashing of one partition.  Each partition being
+   flashed has its own context so that several of them can be
+   opened at the same time, on the same or on different storage
+   devices.  The sparse image parser is given the context to write
+   into.  */
+struct flash_ctx {
+	struct gpt_partition_interface gparti;
+	CHAR16 label[GPT_NAME_LEN + 1];
+	UINT64 cur_offset;
+	BOOLEAN verify_active;
+	EVP_MD_CTX verify_image_ctx;
+	EVP_MD_CTX verify_written_ctx;
+	struct verify_extent *verify_extents;
+	UINTN verify_nb_extents;
+	UINTN verify_max_extents;
+	EFI_DISK_IO2_PROTOCOL *dio2;
+	struct flash_write_req reqs[FLASH_MAX_WRITE_DEPTH];
+	UINTN depth;
+	UINTN next;
+	UINTN write_unit;
+	UINTN write_size;
+	UINT64 buf_start;
+	UINTN buf_len;
+	UINT64 written;
+	UINT64 written_aligned;
+};
+
+#define part_start(ctx) ((ctx)->gparti.part.starting_lba * (ctx)->gparti.bio->Media->BlockSize)
+#define part_end(ctx) (((ctx)->gparti.part.ending_lba + 1) * (ctx)->gparti.bio->Media->BlockSize)
+
+#define is_inside_partition(ctx, off, sz) \
+		(off >= part_start(ctx) && off + sz <= part_end(ctx))
+
+EFI_STATUS flash_set_verify(enum flash_verify mode)
 {
-	if (!is_inside_partition(cur_offset, size)) {
-		error(L"Attempt to skip outside of partition [%ld %ld] [%ld %ld]",
-				part_start, part_end, cur_offset, cur_offset + size);
+	if (mode > FLASH_VERIFY_ALL)
+		return EFI_INVALID_PARAMETER;
+
+	verify_mode = mode;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS flash_set_write_depth(UINTN depth)
+{
+	if (!depth || depth > FLASH_MAX_WRITE_DEPTH)
 		return EFI_INVALID_PARAMETER;
+
+	write_depth = depth;
+	return EFI_SUCCESS;
+}
+
+static void verify_stop(struct flash_ctx *ctx)
+{
+	if (!ctx->verify_active)
+		return;
+
+	EVP_MD_CTX_cleanup(&ctx->verify_image_ctx);
+	EVP_MD_CTX_cleanup(&ctx->verify_written_ctx);
+	if (ctx->verify_extents) {
+		FreePool(ctx->verify_extents);
+		ctx->verify_extents = NULL;
+	}
+	ctx->verify_nb_extents = ctx->verify_max_extents = 0;
+	ctx->verify_active = FALSE;
+}
+
+static void verify_start(struct flash_ctx *ctx)
+{
+	verify_stop(ctx);
+	if (verify_mode == FLASH_VERIFY_NONE)
+		return;
+
+	EVP_MD_CTX_init(&ctx->verify_image_ctx);
+	EVP_DigestInit_ex(&ctx->verify_image_ctx, EVP_sha256(), NULL);
+	EVP_MD_CTX_init(&ctx->verify_written_ctx);
+	EVP_DigestInit_ex(&ctx->verify_written_ctx, EVP_sha256(), NULL);
+	ctx->verify_active = TRUE;
+}
+
+static EFI_STATUS verify_add_extent(struct flash_ctx *ctx, UINT64 start, UINT64 len)
+{
+	struct verify_extent *last;
+
+	if (ctx->verify_nb_extents) {
+		last = &ctx->verify_extents[ctx->verify_nb_extents - 1];
+		if (last->start + last->len == start) {
+			last->len += len;
+			return EFI_SUCCESS;
+		}
+	}
+
+	if (ctx->verify_nb_extents == ctx->verify_max_extents) {
+		ctx->verify_extents = ReallocatePool(ctx->verify_extents,
+						     ctx->verify_max_extents * sizeof(*ctx->verify_extents),
+						     (ctx->verify_max_extents + 256) * sizeof(*ctx->verify_extents));
+		if (!ctx->verify_extents)
+			return EFI_OUT_OF_RESOURCES;
+		ctx->verify_max_extents += 256;
+	}
+
+	ctx->verify_extents[ctx->verify_nb_extents].start = start;
+	ctx->verify_extents[ctx->verify_nb_extents].len = len;
+	ctx->verify_nb_extents++;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS verify_written(struct flash_ctx *ctx, VOID *data,
+				 UINT64 offset, UINTN size)
+{
+	EFI_STATUS ret;
+	UINT64 block, len;
+
+	EVP_DigestUpdate(&ctx->verify_image_ctx, data, size);
+
+	for (; size; size -= len, data += len, offset += len) {
+		block = (offset - part_start(ctx)) / VERIFY_BLOCK_SIZE;
+		len = min((UINT64)size, part_start(ctx) + (block + 1) * VERIFY_BLOCK_SIZE - offset);
+		if (verify_mode == FLASH_VERIFY_SAMPLED &&
+		    block % VERIFY_SAMPLE_STRIDE)
+			continue;
+
+		EVP_DigestUpdate(&ctx->verify_written_ctx, data, len);
+		ret = verify_add_extent(ctx, offset, len);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to record the written range");
+			verify_stop(ctx);
+			return ret;
+		}
+	}
+
+	return EFI_SUCCESS;
+}
+
+static void verify_skipped(struct flash_ctx *ctx, UINT64 size)
+{
+	static const CHAR8 zero[4096];
+	UINTN len;
+
+	for (; size; size -= len) {
+		len = min(size, (UINT64)sizeof(zero));
+		EVP_DigestUpdate(&ctx->verify_image_ctx, zero, len);
+	}
+}
+
+static EFI_STATUS verify_read_back(struct flash_ctx *ctx, CHAR8 *hash)
+{
+	EFI_STATUS ret = EFI_SUCCESS;
+	EVP_MD_CTX mdctx;
+	CHAR8 *buffer;
+	UINT64 offset, left;
+	UINTN i, len;
+
+	buffer = AllocatePool(VERIFY_READ_SIZE);
+	if (!buffer)
+		return EFI_OUT_OF_RESOURCES;
+
+	EVP_MD_CTX_init(&mdctx);
+	EVP_DigestInit_ex(&mdctx, EVP_sha256(), NULL);
+
+	for (i = 0; i < ctx->verify_nb_extents; i++) {
+		offset = ctx->verify_extents[i].start;
+		for (left = ctx->verify_extents[i].len; left; left -= len) {
+			len = min(left, (UINT64)VERIFY_READ_SIZE);
+			ret = uefi_call_wrapper(ctx->gparti.dio->ReadDisk, 5, ctx->gparti.dio,
+						ctx->gparti.bio->Media->MediaId,
+						offset, len, buffer);
+			if (EFI_ERROR(ret)) {
+				efi_perror(ret, L"Failed to read back the partition");
+				goto out;
+			}
+			EVP_DigestUpdate(&mdctx, buffer, len);
+			offset += len;
+		}
+	}
+
+out:
+	EVP_DigestFinal_ex(&mdctx, hash, NULL);
+	EVP_MD_CTX_cleanup(&mdctx);
+	FreePool(buffer);
+	return ret;
+}
+
+static EFI_STATUS verify_finish(struct flash_ctx *ctx)
+{
+	EFI_STATUS ret;
+	CHAR8 image[SHA256_DIGEST_LENGTH];
+	CHAR8 written[SHA256_DIGEST_LENGTH];
+	CHAR8 disk[SHA256_DIGEST_LENGTH];
+	CHAR8 hashstr[SHA256_DIGEST_LENGTH * 2 + 1];
+
+	if (!ctx->verify_active)
+		return EFI_SUCCESS;
+
+	EVP_DigestFinal_ex(&ctx->verify_image_ctx, image, NULL);
+	EVP_DigestFinal_ex(&ctx->verify_written_ctx, written, NULL);
+
+	ret = verify_read_back(ctx, disk);
+	verify_stop(ctx);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (memcmp(written, disk, sizeof(disk))) {
+		error(L"Read back data of %s does not match the image", ctx->label);
+		return EFI_CRC_ERROR;
+	}
+
+	ret = bytes_to_hex_stra(image, sizeof(image), hashstr, sizeof(hashstr));
+	if (EFI_ERROR(ret))
+		return ret;
+
+	fastboot_info("target: /%s", ctx->label);
+	fastboot_info("sha256: %a", hashstr);
+
+	return EFI_SUCCESS;
+}
+
+static BOOLEAN write_done(struct flash_write_req *req)
+{
+	if (req->pending && !req->completed &&
+	    uefi_call_wrapper(BS->CheckEvent, 1, req->token.Event) != EFI_NOT_READY)
+		req->completed = TRUE;
+
+	return !req->pending || req->completed;
+}
+
+static EFI_STATUS wait_write(struct flash_write_req *req)
+{
+	EFI_STATUS ret;
+
+	if (!req->pending)
+		return EFI_SUCCESS;
+
+	while (!write_done(req))
+		;
+	req->pending = req->completed = FALSE;
+
+	ret = req->token.TransactionStatus;
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to write bytes");
+
+	return ret;
+}
+
+static EFI_STATUS submit_write(struct flash_ctx *ctx, VOID *data,
+			       UINT64 offset, UINTN len)
+{
+	EFI_STATUS ret;
+	struct flash_write_req *req = &ctx->reqs[ctx->next];
+
+	ctx->written += len;
+	if (offset % ctx->write_unit == 0 && len % ctx->write_unit == 0)
+		ctx->written_aligned += len;
+
+	if (ctx->dio2 && data == req->data) {
+		req->token.TransactionStatus = EFI_SUCCESS;
+		ret = uefi_call_wrapper(ctx->dio2->WriteDiskEx, 6, ctx->dio2,
+					ctx->gparti.bio->Media->MediaId, offset,
+					&req->token, len, data);
+		if (!EFI_ERROR(ret)) {
+			req->pending = TRUE;
+			ctx->next = (ctx->next + 1) % ctx->depth;
+			return EFI_SUCCESS;
+		}
+		if (ret != EFI_UNSUPPORTED) {
+			efi_perror(ret, L"Failed to write bytes");
+			return ret;
+		}
+
+		debug(L"Asynchronous write is not supported, using Disk I/O");
+		ctx->dio2 = NULL;
 	}
-	cur_offset += size;
+
+	ret = uefi_call_wrapper(ctx->gparti.dio->WriteDisk, 5, ctx->gparti.dio,
+				ctx->gparti.bio->Media->MediaId, offset, len, data);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to write bytes");
+
+	return ret;
+}
+
+static EFI_STATUS submit_buffer(struct flash_ctx *ctx)
+{
+	UINTN len = ctx->buf_len;
+
+	if (!len)
+		return EFI_SUCCESS;
+
+	ctx->buf_len = 0;
+	return submit_write(ctx, ctx->reqs[ctx->next].data, ctx->buf_start, len);
+}
+
+static EFI_STATUS wait_all_writes(struct flash_ctx *ctx)
+{
+	EFI_STATUS ret = EFI_SUCCESS, req_ret;
+	UINTN i;
+
+	for (i = 0; i < ctx->depth; i++) {
+		req_ret = wait_write(&ctx->reqs[(ctx->next + i) % ctx->depth]);
+		if (!EFI_ERROR(ret))
+			ret = req_ret;
+	}
+
+	return ret;
+}
+
+/* Write the buffered data, wait for all the writes in flight and
+   flush the device cache.  */
+static EFI_STATUS flash_ctx_drain(struct flash_ctx *ctx)
+{
+	EFI_STATUS ret, wait_ret;
+	EFI_DISK_IO2_TOKEN token = { .Event = NULL };
+	EFI_DISK_IO2_PROTOCOL *dio2 = ctx->dio2;
+
+	ret = submit_buffer(ctx);
+	wait_ret = wait_all_writes(ctx);
+	if (EFI_ERROR(ret))
+		return ret;
+	if (EFI_ERROR(wait_ret))
+		return wait_ret;
+
+	if (!dio2)
+		return EFI_SUCCESS;
+
+	ret = uefi_call_wrapper(dio2->FlushDiskEx, 2, dio2, &token);
+	if (EFI_ERROR(ret) && ret != EFI_UNSUPPORTED) {
+		efi_perror(ret, L"Failed to flush the disk");
+		return ret;
+	}
+
 	return EFI_SUCCESS;
 }
 
-EFI_STATUS flash_write(VOID *data, UINTN size)
+static EFI_STATUS get_write_buffer(struct flash_ctx *ctx, UINT64 offset)
 {
 	EFI_STATUS ret;
+	struct flash_write_req *req = &ctx->reqs[ctx->next];
+
+	ret = wait_write(req);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (!req->data) {
+		ret = bufpool_get(ctx->write_size, ctx->gparti.bio->Media->IoAlign,
+				  &req->data);
+		if (EFI_ERROR(ret)) {
+			req->data = NULL;
+			return ret;
+		}
+	}
+
+	ctx->buf_start = offset;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS write_combined(struct flash_ctx *ctx, VOID *data, UINTN size)
+{
+	EFI_STATUS ret;
+	UINT64 offset = ctx->cur_offset, end;
+	UINTN len;
+
+	for (; size; size -= len, data += len, offset += len) {
+		if (ctx->buf_len && ctx->buf_start + ctx->buf_len != offset) {
+			ret = submit_buffer(ctx);
+			if (EFI_ERROR(ret))
+				return ret;
+		}
+
+		if (!ctx->buf_len) {
+			/* Blocking writes do not need a copy of the
+			   data which is already aligned.  */
+			if (!ctx->dio2 && offset % ctx->write_size == 0 &&
+			    size >= ctx->write_size) {
+				len = size - size % ctx->write_size;
+				ret = submit_write(ctx, data, offset, len);
+				if (EFI_ERROR(ret))
+					return ret;
+				continue;
+			}
+
+			ret = get_write_buffer(ctx, offset);
+			if (EFI_ERROR(ret))
+				return ret;
+		}
+
+		end = (ctx->buf_start / ctx->write_size + 1) * ctx->write_size;
+		len = min((UINT64)size, end - offset);
+		memcpy(ctx->reqs[ctx->next].data + ctx->buf_len, data, len);
+		ctx->buf_len += len;
+
+		if (offset + len == end) {
+			ret = submit_buffer(ctx);
+			if (EFI_ERROR(ret))
+				return ret;
+		}
+	}
 
-	if (!gparti.bio)
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS flash_skip(struct flash_ctx *ctx, UINT64 size)
+{
+	if (!is_inside_partition(ctx, ctx->cur_offset, size)) {
+		error(L"Attempt to skip outside of partition [%ld %ld] [%ld %ld]",
+				part_start(ctx), part_end(ctx), ctx->cur_offset, ctx->cur_offset + size);
 		return EFI_INVALID_PARAMETER;
+	}
+	if (ctx->verify_active)
+		verify_skipped(ctx, size);
 
-	if (!is_inside_partition(cur_offset, size)) {
+	ctx->cur_offset += size;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS flash_write(struct flash_ctx *ctx, VOID *data, UINTN size)
+{
+	EFI_STATUS ret;
+
+	if (!is_inside_partition(ctx, ctx->cur_offset, size)) {
 		error(L"Attempt to write outside of partition [%ld %ld] [%ld %ld]",
-				part_start, part_end, cur_offset, cur_offset + size);
+				part_start(ctx), part_end(ctx), ctx->cur_offset, ctx->cur_offset + size);
 		return EFI_INVALID_PARAMETER;
 	}
-	ret = uefi_call_wrapper(gparti.dio->WriteDisk, 5, gparti.dio, gparti.bio->Media->MediaId, cur_offset, size, data);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to write bytes");
+	ret = write_combined(ctx, data, size);
+	if (EFI_ERROR(ret))
 		return ret;
+
+	if (ctx->verify_active) {
+		ret = verify_written(ctx, data, ctx->cur_offset, size);
+		if (EFI_ERROR(ret))
+			return ret;
 	}
 
-	cur_offset += size;
+	ctx->cur_offset += size;
 	return EFI_SUCCESS;
 }
 
-EFI_STATUS flash_fill(UINT32 pattern, UINTN size)
+EFI_STATUS flash_fill(struct flash_ctx *ctx, UINT32 pattern, UINTN size)
 {
 	EFI_STATUS ret;
 	UINT32 *aligned_buf;
-	VOID *buf;
 	UINTN i, buf_size, write_size;
+	EFI_BLOCK_IO_MEDIA *media = ctx->gparti.bio->Media;
 
-	if (!gparti.bio || !size || size % gparti.bio->Media->BlockSize)
+	if (!size || size % media->BlockSize)
 		return EFI_INVALID_PARAMETER;
 
-	buf_size = min(gparti.bio->Media->BlockSize * N_BLOCK, size);
-	ret = alloc_aligned(&buf, (VOID **)&aligned_buf, buf_size, gparti.bio->Media->IoAlign);
+	buf_size = min(media->BlockSize * N_BLOCK, size);
+	ret = bufpool_get(buf_size, media->IoAlign, (VOID **)&aligned_buf);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Unable to allocate the pattern buf");
 		return ret;
@@ -120,16 +557,109 @@ EFI_STATUS flash_fill(UINT32 pattern, UINTN size)
 
 	for (; size; size -= write_size) {
 		write_size = min(size, buf_size);
-		ret = flash_write(aligned_buf, write_size);
+		ret = flash_write(ctx, aligned_buf, write_size);
 		if (EFI_ERROR(ret))
 			goto out;
 	}
 
 out:
-	FreePool(buf);
+	bufpool_put(aligned_buf);
 	return ret;
 }
 
+/* Preferred write unit of the device in bytes: the physical block
+   or the optimal transfer length granularity reported by the Block
+   I/O protocol revision 3.  */
+static UINTN get_write_unit(EFI_BLOCK_IO *bio)
+{
+	EFI_BLOCK_IO_MEDIA *media = bio->Media;
+	UINTN blocks = 1;
+
+	if (bio->Revision >= EFI_BLOCK_IO_PROTOCOL_REVISION3) {
+		blocks = max(blocks, (UINTN)media->LogicalBlocksPerPhysicalBlock);
+		blocks = max(blocks, (UINTN)media->OptimalTransferLengthGranularity);
+	}
+
+	return min(blocks * media->BlockSize, (UINTN)FLASH_WRITE_CHUNK);
+}
+
+void flash_ctx_free(struct flash_ctx *ctx)
+{
+	UINTN i;
+
+	for (i = 0; i < ctx->depth; i++) {
+		wait_write(&ctx->reqs[i]);
+		bufpool_put(ctx->reqs[i].data);
+		if (ctx->reqs[i].token.Event)
+			uefi_call_wrapper(BS->CloseEvent, 1, ctx->reqs[i].token.Event);
+	}
+
+	verify_stop(ctx);
+	FreePool(ctx);
+}
+
+/* The "factory:" prefix selects a partition of the factory logical
+   unit instead of the user one.  */
+static const CHAR16 *parse_label(const CHAR16 *label, logical_unit_t *log_unit)
+{
+	static const CHAR16 FACTORY_PREFIX[] = L"factory:";
+
+	*log_unit = LOGICAL_UNIT_USER;
+	if (StrnCmp(label, FACTORY_PREFIX, ARRAY_SIZE(FACTORY_PREFIX) - 1))
+		return label;
+
+	*log_unit = LOGICAL_UNIT_FACTORY;
+	return label + ARRAY_SIZE(FACTORY_PREFIX) - 1;
+}
+
+static EFI_STATUS flash_ctx_open(const CHAR16 *label, struct flash_ctx **ctx_p)
+{
+	EFI_STATUS ret;
+	EFI_GUID guid = EFI_DISK_IO2_PROTOCOL_GUID;
+	struct flash_ctx *ctx;
+	logical_unit_t log_unit;
+	UINTN i;
+
+	ctx = AllocateZeroPool(sizeof(*ctx));
+	if (!ctx)
+		return EFI_OUT_OF_RESOURCES;
+
+	label = parse_label(label, &log_unit);
+	ret = gpt_get_partition_by_label(label, &ctx->gparti, log_unit);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get partition %s", label);
+		FreePool(ctx);
+		return ret;
+	}
+
+	StrNCpy(ctx->label, label, GPT_NAME_LEN);
+	ctx->cur_offset = part_start(ctx);
+	ctx->write_unit = get_write_unit(ctx->gparti.bio);
+	ctx->write_size = ALIGN(FLASH_WRITE_CHUNK, ctx->write_unit);
+	ctx->depth = 1;
+
+	if (write_depth > 1) {
+		ret = uefi_call_wrapper(BS->HandleProtocol, 3, ctx->gparti.handle,
+					&guid, (void **)&ctx->dio2);
+		if (EFI_ERROR(ret))
+			ctx->dio2 = NULL;
+	}
+
+	for (i = 0; ctx->dio2 && i < write_depth; i++) {
+		ret = uefi_call_wrapper(BS->CreateEvent, 5, 0, 0, NULL, NULL,
+					&ctx->reqs[i].token.Event);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to create the disk write event");
+			flash_ctx_free(ctx);
+			return ret;
+		}
+		ctx->depth = i + 1;
+	}
+
+	*ctx_p = ctx;
+	return EFI_SUCCESS;
+}
+
 static EFI_STATUS flash_into_esp(VOID *data, UINTN size, CHAR16 *label)
 {
 	EFI_STATUS ret;
@@ -274,28 +804,28 @@ static EFI_STATUS flash_ioc(VOID *data, UINTN size)
 static EFI_STATUS flash_new_bootimage(VOID *kernel, UINTN kernel_size,
 				      VOID *ramdisk, UINTN ramdisk_size)
 {
+	struct flash_ctx *ctx;
 	struct boot_img_hdr *bootimage, *new_bootimage;
 	VOID *new_cur, *cur;
 	UINTN new_size, partlen, page_size;
 	EFI_STATUS ret;
 
-	ret = gpt_get_partition_by_label(slot_label(BOOT_LABEL), &gparti, LOGICAL_UNIT_USER);
+	ret = flash_ctx_open(slot_label(BOOT_LABEL), &ctx);
 	if (EFI_ERROR(ret)) {
 		error(L"Unable to get information on the boot partition");
 		return ret;
 	}
-	partlen = (gparti.part.ending_lba + 1 - gparti.part.starting_lba)
-		* gparti.bio->Media->BlockSize;
+	partlen = part_end(ctx) - part_start(ctx);
 
 	bootimage = AllocatePool(sizeof(*bootimage));
 	if (!bootimage) {
 		error(L"Unable to allocate bootimage buffer");
-		return EFI_OUT_OF_RESOURCES;
+		ret = EFI_OUT_OF_RESOURCES;
+		goto free_ctx;
 	}
 
-	ret = uefi_call_wrapper(gparti.dio->ReadDisk, 5, gparti.dio,
-				gparti.bio->Media->MediaId,
-				gparti.part.starting_lba * gparti.bio->Media->BlockSize,
+	ret = uefi_call_wrapper(ctx->gparti.dio->ReadDisk, 5, ctx->gparti.dio,
+				ctx->gparti.bio->Media->MediaId, part_start(ctx),
 				sizeof(*bootimage), bootimage);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to load the current bootimage");
@@ -318,12 +848,12 @@ static EFI_STATUS flash_new_bootimage(VOID *kernel, UINTN kernel_size,
 				   bootimage_size(bootimage));
 	if (!bootimage) {
 		error(L"Unable to increase the bootimage buffer size");
-		return EFI_OUT_OF_RESOURCES;
+		ret = EFI_OUT_OF_RESOURCES;
+		goto free_ctx;
 	}
 
-	ret = uefi_call_wrapper(gparti.dio->ReadDisk, 5, gparti.dio,
-				gparti.bio->Media->MediaId,
-				gparti.part.starting_lba * gparti.bio->Media->BlockSize,
+	ret = uefi_call_wrapper(ctx->gparti.dio->ReadDisk, 5, ctx->gparti.dio,
+				ctx->gparti.bio->Media->MediaId, part_start(ctx),
 				bootimage_size(bootimage), bootimage);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to load the current bootimage");
@@ -385,13 +915,16 @@ static EFI_STATUS flash_new_bootimage(VOID *kernel, UINTN kernel_size,
 	}
 
 	/* Flash new the bootimage. */
-	cur_offset = gparti.part.starting_lba * gparti.bio->Media->BlockSize;
-	ret = flash_write(new_bootimage, new_size);
+	ret = flash_write(ctx, new_bootimage, new_size);
+	if (!EFI_ERROR(ret))
+		ret = flash_ctx_drain(ctx);
 
 	FreePool(new_bootimage);
 
 out:
 	FreePool(bootimage);
+free_ctx:
+	flash_ctx_free(ctx);
 	return ret;
 }
 
@@ -408,46 +941,177 @@ static EFI_STATUS flash_ramdisk(VOID *data, UINTN size)
 static CHAR16 *DM_VERITY_PARTITIONS[] =
 	{ SYSTEM_LABEL, VENDOR_LABEL, OEM_LABEL };
 
-EFI_STATUS flash_partition(VOID *data, UINTN size, CHAR16 *label)
+/* While a bundle is flashed, the GPT refresh is done once all its
+   entries have been flashed.  */
+static BOOLEAN defer_gpt_refresh;
+static BOOLEAN gpt_refresh_pending;
+
+EFI_STATUS flash_partition_start(CHAR16 *label, struct flash_ctx **ctx_p)
+{
+	EFI_STATUS ret;
+
+	ret = flash_ctx_open(label, ctx_p);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	verify_start(*ctx_p);
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS flash_partition_done(struct flash_ctx *ctx)
 {
 	EFI_STATUS ret;
 	UINTN i;
 
-	ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to get partition %s", label);
+	ret = flash_ctx_drain(ctx);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (ctx->written)
+		info(L"Wrote %ld KB, %ld%% in writes aligned on %d bytes",
+		     ctx->written / 1024, ctx->written_aligned * 100 / ctx->written,
+		     ctx->write_unit);
+
+	ret = verify_finish(ctx);
+	if (EFI_ERROR(ret))
 		return ret;
+
+	if (!CompareGuid(&ctx->gparti.part.type, &EfiPartTypeSystemPartitionGuid)) {
+		if (defer_gpt_refresh)
+			gpt_refresh_pending = TRUE;
+		else {
+			ret = gpt_refresh();
+			if (EFI_ERROR(ret))
+				return ret;
+		}
 	}
 
-	cur_offset = gparti.part.starting_lba * gparti.bio->Media->BlockSize;
+	for (i = 0; i < ARRAY_SIZE(DM_VERITY_PARTITIONS); i++)
+		if (!StrCmp(DM_VERITY_PARTITIONS[i], ctx->label))
+			return slot_set_verity_corrupted(FALSE);
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS flash_partition(VOID *data, UINTN size, CHAR16 *label)
+{
+	EFI_STATUS ret;
+	struct flash_ctx *ctx;
+
+	ret = flash_partition_start(label, &ctx);
+	if (EFI_ERROR(ret))
+		return ret;
 
 	if (is_sparse_image(data, size))
-		ret = flash_sparse(data, size);
+		ret = flash_sparse(ctx, data, size);
 	else
-		ret = flash_write(data, size);
+		ret = flash_write(ctx, data, size);
+
+	if (!EFI_ERROR(ret))
+		ret = flash_partition_done(ctx);
 
+	flash_ctx_free(ctx);
+	return ret;
+}
+
+EFI_STATUS flash_partition_stream(sparse_read_t read, void *read_ctx, CHAR16 *label)
+{
+	EFI_STATUS ret;
+	struct flash_ctx *ctx;
+
+	ret = flash_partition_start(label, &ctx);
 	if (EFI_ERROR(ret))
 		return ret;
 
-	if (!CompareGuid(&gparti.part.type, &EfiPartTypeSystemPartitionGuid)) {
-		ret = gpt_refresh();
-		if (EFI_ERROR(ret))
-			return ret;
+	ret = flash_sparse_stream(ctx, read, read_ctx);
+
+	if (!EFI_ERROR(ret))
+		ret = flash_partition_done(ctx);
+
+	flash_ctx_free(ctx);
+	return ret;
+}
+
+/* The entries of a bundle, see flash.h, are flashed by
+ * flash_images().
+ */
+static EFI_STATUS get_bundle_image(VOID *data, UINTN size,
+				   struct bundle_entry *entry, UINT32 index,
+				   struct flash_image *image)
+{
+	if (entry->offset > size || entry->size > size - entry->offset) {
+		error(L"Bundle entry %d is out of the bundle", index);
+		return EFI_INVALID_PARAMETER;
 	}
 
-	for (i = 0; i < ARRAY_SIZE(DM_VERITY_PARTITIONS); i++)
-		if (!StrCmp(DM_VERITY_PARTITIONS[i], label))
-			return slot_set_verity_corrupted(FALSE);
+	memcpy(image->label, entry->label, sizeof(entry->label));
+	image->label[GPT_NAME_LEN] = 0;
+	if (!image->label[0] || !StrCmp(image->label, L"bundle")) {
+		error(L"Bundle entry %d has an invalid label", index);
+		return EFI_INVALID_PARAMETER;
+	}
+
+	image->data = data + entry->offset;
+	image->size = entry->size;
+	if ((entry->flags & BUNDLE_ENTRY_SPARSE) &&
+	    !is_sparse_image(image->data, image->size)) {
+		error(L"Bundle entry %s is not a sparse image", image->label);
+		return EFI_INVALID_PARAMETER;
+	}
 
 	return EFI_SUCCESS;
 }
 
+static EFI_STATUS flash_bundle(VOID *data, UINTN size)
+{
+	EFI_STATUS ret = EFI_SUCCESS;
+	struct bundle_header *hdr = data;
+	struct bundle_entry *entries = (struct bundle_entry *)&hdr[1];
+	struct flash_image *images;
+	CHAR16 *labels;
+	UINT32 i;
+
+	if (size < sizeof(*hdr) || hdr->magic != BUNDLE_MAGIC ||
+	    hdr->version != BUNDLE_VERSION ||
+	    hdr->nentries > (size - sizeof(*hdr)) / sizeof(*entries)) {
+		error(L"Invalid bundle header");
+		return EFI_INVALID_PARAMETER;
+	}
+
+	if (!hdr->nentries)
+		return EFI_SUCCESS;
+
+	images = AllocatePool(hdr->nentries * sizeof(*images));
+	labels = AllocatePool(hdr->nentries * (GPT_NAME_LEN + 1) * sizeof(*labels));
+	if (!images || !labels) {
+		ret = EFI_OUT_OF_RESOURCES;
+		goto out;
+	}
+
+	for (i = 0; i < hdr->nentries; i++) {
+		images[i].label = &labels[i * (GPT_NAME_LEN + 1)];
+		ret = get_bundle_image(data, size, &entries[i], i, &images[i]);
+		if (EFI_ERROR(ret))
+			goto out;
+	}
+
+	ret = flash_images(images, hdr->nentries);
+
+out:
+	if (images)
+		FreePool(images);
+	if (labels)
+		FreePool(labels);
+	return ret;
+}
+
 static struct label_exception {
 	CHAR16 *name;
 	EFI_STATUS (*flash_func)(VOID *data, UINTN size);
 } LABEL_EXCEPTIONS[] = {
 	{ L"gpt", flash_gpt },
 	{ L"gpt-gpp1", flash_gpt_gpp1 },
+	{ L"bundle", flash_bundle },
 #ifndef USER
 	{ L"efirun", flash_efirun },
 	{ L"mbr", flash_mbr },
@@ -472,24 +1136,92 @@ static struct label_exception {
 #endif
 };
 
-EFI_STATUS flash(VOID *data, UINTN size, CHAR16 *label)
+static struct label_exception *get_label_exception(CHAR16 *label)
 {
 	UINTN i;
 
+	for (i = 0; i < ARRAY_SIZE(LABEL_EXCEPTIONS); i++)
+		if (!StrCmp(LABEL_EXCEPTIONS[i].name, label))
+			return &LABEL_EXCEPTIONS[i];
+
+	return NULL;
+}
+
+#ifndef USER
+static const CHAR16 ESP_PATH_PREFIX[] = L"/ESP/";
+
+static BOOLEAN is_esp_path(CHAR16 *label)
+{
+	return !StrnCmp(ESP_PATH_PREFIX, label, ARRAY_SIZE(ESP_PATH_PREFIX) - 1);
+}
+#endif
+
+EFI_STATUS flash(VOID *data, UINTN size, CHAR16 *label)
+{
+	struct label_exception *exception;
+
 #ifndef USER
 	/* special case for writing inside esp partition */
-	CHAR16 esp[] = L"/ESP/";
-	if (!StrnCmp(esp, label, StrLen(esp)))
-		return flash_into_esp(data, size, &label[ARRAY_SIZE(esp) - 1]);
+	if (is_esp_path(label))
+		return flash_into_esp(data, size, &label[ARRAY_SIZE(ESP_PATH_PREFIX) - 1]);
 #endif
 	/* special cases */
-	for (i = 0; i < ARRAY_SIZE(LABEL_EXCEPTIONS); i++)
-		if (!StrCmp(LABEL_EXCEPTIONS[i].name, label))
-			return LABEL_EXCEPTIONS[i].flash_func(data, size);
+	exception = get_label_exception(label);
+	if (exception)
+		return exception->flash_func(data, size);
 
 	return flash_partition(data, size, label);
 }
 
+BOOLEAN flash_ctx_ready(struct flash_ctx *ctx)
+{
+	return write_done(&ctx->reqs[ctx->next]);
+}
+
+EFI_HANDLE flash_ctx_disk(struct flash_ctx *ctx)
+{
+	return ctx->gparti.handle;
+}
+
+UINTN flash_ctx_write_size(struct flash_ctx *ctx)
+{
+	return ctx->write_size;
+}
+
+CHAR16 *flash_ctx_label(struct flash_ctx *ctx)
+{
+	return ctx->label;
+}
+
+BOOLEAN is_special_label(CHAR16 *label)
+{
+#ifndef USER
+	if (is_esp_path(label))
+		return TRUE;
+#endif
+	return get_label_exception(label) != NULL;
+}
+
+EFI_STATUS flash_images(struct flash_image *images, UINTN nb)
+{
+	EFI_STATUS ret, refresh_ret;
+
+	defer_gpt_refresh = TRUE;
+	gpt_refresh_pending = FALSE;
+
+	ret = flash_jobs(images, nb);
+
+	defer_gpt_refresh = FALSE;
+	if (gpt_refresh_pending) {
+		gpt_refresh_pending = FALSE;
+		refresh_ret = gpt_refresh();
+		if (!EFI_ERROR(ret) && EFI_ERROR(refresh_ret))
+			ret = refresh_ret;
+	}
+
+	return ret;
+}
+
 EFI_STATUS flash_file(EFI_HANDLE image, CHAR16 *filename, CHAR16 *label)
 {
 	EFI_STATUS ret;
@@ -549,6 +1281,7 @@ static EFI_STATUS erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio, EFI_LBA sta
 
 EFI_STATUS erase_by_label(CHAR16 *label)
 {
+	struct gpt_partition_interface gparti;
 	EFI_STATUS ret;
 
 	ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
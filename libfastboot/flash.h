@@ -37,9 +37,14 @@
 
 #include <efi.h>
 
-EFI_STATUS flash_skip(UINT64 size);
-EFI_STATUS flash_write(VOID *data, UINTN size);
-EFI_STATUS flash_fill(UINT32 pattern, UINTN size);
+#include "gpt.h"
+#include "sparse.h"
+
+struct flash_ctx;
+
+EFI_STATUS flash_skip(struct flash_ctx *ctx, UINT64 size);
+EFI_STATUS flash_write(struct flash_ctx *ctx, VOID *data, UINTN size);
+EFI_STATUS flash_fill(struct flash_ctx *ctx, UINT32 pattern, UINTN size);
 
 /* return value for flash() function */
 
@@ -50,6 +55,54 @@ EFI_STATUS flash_file(EFI_HANDLE image, CHAR16 *filename, CHAR16 *label);
 EFI_STATUS erase_by_label(CHAR16 *label);
 EFI_STATUS garbage_disk(void);
 EFI_STATUS flash_partition(VOID *data, UINTN size, CHAR16 *label);
+EFI_STATUS flash_partition_stream(sparse_read_t read, void *ctx, CHAR16 *label);
+
+/* Flash several images at once, the images of partitions lying on
+   different disks are flashed at the same time.  */
+struct flash_image {
+	CHAR16 *label;
+	VOID *data;
+	UINTN size;
+};
+
+EFI_STATUS flash_images(struct flash_image *images, UINTN nb);
+
+/* A bundle is a single download holding several images to flash:
+ * a bundle_header followed by NENTRIES bundle_entry, each of them
+ * pointing to an image stored at OFFSET bytes from the beginning of
+ * the bundle.
+ */
+#define BUNDLE_MAGIC 0x4c444e42	/* "BNDL" */
+#define BUNDLE_VERSION 1
+#define BUNDLE_ENTRY_SPARSE 0x1
+
+struct bundle_header {
+	UINT32 magic;
+	UINT32 version;
+	UINT32 nentries;
+	UINT32 reserved;
+} __attribute__((packed));
+
+struct bundle_entry {
+	CHAR16 label[GPT_NAME_LEN];
+	UINT64 offset;
+	UINT64 size;
+	UINT32 flags;
+	UINT32 reserved;
+} __attribute__((packed));
+
+enum flash_verify {
+	FLASH_VERIFY_NONE,
+	FLASH_VERIFY_SAMPLED,
+	FLASH_VERIFY_ALL
+};
+
+EFI_STATUS flash_set_verify(enum flash_verify mode);
+
+/* Maximum number of asynchronous writes in flight */
+#define FLASH_MAX_WRITE_DEPTH 16
+
+EFI_STATUS flash_set_write_depth(UINTN depth);
 EFI_STATUS fill_zero(EFI_BLOCK_IO *bio, UINT64 start, UINT64 end);
 
 #endif	/* _FLASH_H_ */
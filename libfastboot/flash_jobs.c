@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+
+#include "flash.h"
+#include "flash_jobs.h"
+#include "sparse.h"
+
+/* The partitions lying on different disks, for instance on the user
+   and on the factory logical units, are flashed at the same time:
+   each job has its own flash context, hence its own Disk I/O 2 write
+   queue, and is given a slice of one write request whenever its next
+   request is available.  The next slice of an image is parsed while
+   the writes of the other jobs are in flight.  The images of the same
+   disk are flashed one after the other, in order.  The special labels
+   are flashed once the previous jobs are done as they may depend on
+   them, e.g. "gpt".  */
+#define FLASH_MAX_JOBS 4
+
+struct flash_job {
+	struct flash_ctx *ctx;
+	struct sparse_ctx *sparse;
+	VOID *data;
+	UINTN size;
+};
+
+static void flash_job_free(struct flash_job *job)
+{
+	if (job->sparse)
+		flash_sparse_free(job->sparse);
+	flash_ctx_free(job->ctx);
+}
+
+static EFI_STATUS flash_job_open(struct flash_image *image, struct flash_job *job)
+{
+	EFI_STATUS ret;
+
+	ret = flash_partition_start(image->label, &job->ctx);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	job->sparse = NULL;
+	job->data = image->data;
+	job->size = image->size;
+	if (!is_sparse_image(image->data, image->size))
+		return EFI_SUCCESS;
+
+	ret = flash_sparse_start(job->ctx, image->data, image->size, FALSE,
+				 &job->sparse);
+	if (EFI_ERROR(ret))
+		flash_ctx_free(job->ctx);
+
+	return ret;
+}
+
+static EFI_STATUS flash_job_step(struct flash_job *job, BOOLEAN *done)
+{
+	EFI_STATUS ret;
+	UINTN len;
+
+	if (job->sparse)
+		return flash_sparse_step(job->sparse, flash_ctx_write_size(job->ctx), done);
+
+	len = min(job->size, flash_ctx_write_size(job->ctx));
+	ret = flash_write(job->ctx, job->data, len);
+	job->data += len;
+	job->size -= len;
+	*done = !job->size;
+
+	return ret;
+}
+
+static BOOLEAN flash_jobs_use(struct flash_job *jobs, UINTN nb, EFI_HANDLE disk)
+{
+	UINTN i;
+
+	for (i = 0; i < nb; i++)
+		if (flash_ctx_disk(jobs[i].ctx) == disk)
+			return TRUE;
+
+	return FALSE;
+}
+
+static void flash_jobs_abort(struct flash_job *jobs, UINTN *nb)
+{
+	for (; *nb; (*nb)--)
+		flash_job_free(&jobs[*nb - 1]);
+}
+
+/* Run the jobs until none of them writes to DISK or, if DISK is NULL,
+   until all of them are done.  The first failure aborts all the
+   jobs.  */
+static EFI_STATUS flash_jobs_run(struct flash_job *jobs, UINTN *nb, EFI_HANDLE disk)
+{
+	EFI_STATUS ret;
+	BOOLEAN done;
+	UINTN i;
+
+	while (*nb && (!disk || flash_jobs_use(jobs, *nb, disk))) {
+		for (i = 0; i < *nb; ) {
+			if (!flash_ctx_ready(jobs[i].ctx)) {
+				i++;
+				continue;
+			}
+
+			ret = flash_job_step(&jobs[i], &done);
+			if (!EFI_ERROR(ret) && done)
+				ret = flash_partition_done(jobs[i].ctx);
+			if (EFI_ERROR(ret)) {
+				efi_perror(ret, L"Failed to flash %s",
+					   flash_ctx_label(jobs[i].ctx));
+				flash_jobs_abort(jobs, nb);
+				return ret;
+			}
+
+			if (!done) {
+				i++;
+				continue;
+			}
+
+			debug(L"Flash of %s done", flash_ctx_label(jobs[i].ctx));
+			flash_job_free(&jobs[i]);
+			jobs[i] = jobs[--(*nb)];
+		}
+	}
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS flash_jobs(struct flash_image *images, UINTN nb)
+{
+	EFI_STATUS ret = EFI_SUCCESS, flags = 0;
+	struct flash_job jobs[FLASH_MAX_JOBS], job;
+	UINTN i, nb_jobs = 0;
+
+	for (i = 0; i < nb; i++) {
+		info(L"Flashing %s ...", images[i].label);
+
+		if (is_special_label(images[i].label)) {
+			ret = flash_jobs_run(jobs, &nb_jobs, NULL);
+			if (EFI_ERROR(ret))
+				break;
+
+			ret = flash(images[i].data, images[i].size, images[i].label);
+			if (EFI_ERROR(ret)) {
+				efi_perror(ret, L"Failed to flash %s", images[i].label);
+				break;
+			}
+			flags |= ret;
+			continue;
+		}
+
+		ret = flash_job_open(&images[i], &job);
+		if (EFI_ERROR(ret))
+			break;
+
+		/* The new job only joins the running ones once the
+		   previous images of its disk are flashed.  */
+		ret = flash_jobs_run(jobs, &nb_jobs, flash_ctx_disk(job.ctx));
+		if (!EFI_ERROR(ret) && nb_jobs == FLASH_MAX_JOBS)
+			ret = flash_jobs_run(jobs, &nb_jobs, flash_ctx_disk(jobs[0].ctx));
+		if (EFI_ERROR(ret)) {
+			flash_job_free(&job);
+			break;
+		}
+		jobs[nb_jobs++] = job;
+	}
+
+	if (EFI_ERROR(ret))
+		flash_jobs_abort(jobs, &nb_jobs);
+	else
+		ret = flash_jobs_run(jobs, &nb_jobs, NULL);
+
+	return EFI_ERROR(ret) ? ret : EFI_SUCCESS | flags;
+}
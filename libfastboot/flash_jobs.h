@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _FLASH_JOBS_H_
+#define _FLASH_JOBS_H_
+
+#include <efi.h>
+
+#include "flash.h"
+
+/* Scheduler of flash_images(), see flash_jobs.c.  The flash contexts
+   it drives are provided by flash.c.  */
+EFI_STATUS flash_jobs(struct flash_image *images, UINTN nb);
+
+EFI_STATUS flash_partition_start(CHAR16 *label, struct flash_ctx **ctx_p);
+EFI_STATUS flash_partition_done(struct flash_ctx *ctx);
+void flash_ctx_free(struct flash_ctx *ctx);
+
+/* TRUE if the next write request of CTX is available.  */
+BOOLEAN flash_ctx_ready(struct flash_ctx *ctx);
+EFI_HANDLE flash_ctx_disk(struct flash_ctx *ctx);
+UINTN flash_ctx_write_size(struct flash_ctx *ctx);
+CHAR16 *flash_ctx_label(struct flash_ctx *ctx);
+
+/* TRUE if LABEL is not a plain partition, e.g. "gpt" or an ESP path.  */
+BOOLEAN is_special_label(CHAR16 *label);
+
+#endif	/* _FLASH_JOBS_H_ */
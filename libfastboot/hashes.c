@@ -44,6 +44,7 @@
 #include "android.h"
 #include "signature.h"
 #include "security.h"
+#include "block_reader.h"
 #if defined(USE_ACPIO) && defined(USE_ACPI)
 #include "acpi.h"
 #endif
@@ -432,19 +433,28 @@ static EFI_STATUS read_partition(struct gpt_partition_interface *gparti, UINT64
 	return ret;
 }
 
-#define CHUNK 1024 * 1024
-#define MIN(a, b) ((a < b) ? (a) : (b))
+#define CHUNK (1024 * 1024)
+#define CHUNK_DEPTH 3
 static EFI_STATUS hash_partition(struct gpt_partition_interface *gparti, UINT64 len, CHAR8 *hash)
 {
 	EVP_MD_CTX mdctx;
-	CHAR8 *buffer;
-	UINT64 offset;
-	UINT64 chunklen;
-	EFI_STATUS ret = EFI_INVALID_PARAMETER;
+	struct block_reader *br;
+	unsigned char *buffer;
+	UINTN chunklen;
+	EFI_STATUS ret;
 
-	buffer = AllocatePool(CHUNK);
-	if (!buffer)
-		return EFI_OUT_OF_RESOURCES;
+	if (len > part_size(gparti)) {
+		debug(L"attempt to read outside of partition %s, (len %lld partition len %lld)",
+		      gparti->part.name, len, part_size(gparti));
+		return EFI_END_OF_MEDIA;
+	}
+
+	/* The next chunks are read while the current one is digested. */
+	ret = block_reader_open(&br, gparti, 0, len, CHUNK, CHUNK_DEPTH);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"read partition %s failed", gparti->part.name);
+		return ret;
+	}
 
 	if (!selected_md)
 		set_hash_algorithm(NULL);
@@ -452,18 +462,21 @@ static EFI_STATUS hash_partition(struct gpt_partition_interface *gparti, UINT64
 	EVP_MD_CTX_init(&mdctx);
 	EVP_DigestInit_ex(&mdctx, selected_md, NULL);
 
-	for (offset = 0; offset < len; offset += CHUNK) {
-		chunklen = MIN(len - offset, CHUNK);
-		ret = read_partition(gparti, offset, chunklen, buffer);
-		if (EFI_ERROR(ret))
+	for (;;) {
+		ret = block_reader_next(br, &buffer, &chunklen);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"read partition %s failed", gparti->part.name);
 			goto free;
+		}
+		if (!chunklen)
+			break;
 		EVP_DigestUpdate(&mdctx, buffer, chunklen);
 	}
 	EVP_DigestFinal_ex(&mdctx, hash, NULL);
 
 free:
 	EVP_MD_CTX_cleanup(&mdctx);
-	FreePool(buffer);
+	block_reader_close(br);
 	return ret;
 }
 
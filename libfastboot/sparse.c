@@ -36,8 +36,10 @@
 #include <efilib.h>
 #include <lib.h>
 #include "uefi_utils.h"
+#include "bufpool.h"
 
 #include "flash.h"
+#include "sparse.h"
 #include "sparse_format.h"
 
 /* Hunks buffer size.  */
@@ -45,8 +47,22 @@ static const unsigned int BUFFER_SIZE = 10 * 1024 * 1024;
 /* Hunks that are larger than this threshold won't be buffered.  This
    threshold MUST be smaller than the buffer size.  */
 static const unsigned int HUNK_SIZE_THRESHOLD = 1024 * 1024;
-static void *buffer;
-static unsigned int cur_size;
+
+/* State of the flashing of one sparse image into the flash context
+   FCTX.  The in memory images are parsed chunk by chunk by
+   flash_sparse_step() which can stop in the middle of a chunk.  */
+struct sparse_ctx {
+	struct flash_ctx *fctx;
+	void *buffer;
+	unsigned int cur_size;
+
+	struct sparse_header *sph;
+	CHAR8 *pos;
+	UINT64 size;
+	UINT64 left;
+	unsigned int chunk;
+	UINT64 chunk_done;
+};
 
 BOOLEAN is_sparse_image(void *data, UINT64 size)
 {
@@ -75,68 +91,76 @@ BOOLEAN is_sparse_image(void *data, UINT64 size)
 	return TRUE;
 }
 
-static EFI_STATUS init_buffer()
+static EFI_STATUS init_buffer(struct sparse_ctx *s)
 {
-	buffer = AllocatePool(BUFFER_SIZE);
-	if (!buffer) {
+	EFI_STATUS ret;
+
+	ret = bufpool_get(BUFFER_SIZE, 0, (VOID **)&s->buffer);
+	if (EFI_ERROR(ret)) {
+		s->buffer = NULL;
 		debug(L"Allocation failed, sparse file buffer is disabled");
 		return EFI_OUT_OF_RESOURCES;
 	}
 
-	cur_size = 0;
+	s->cur_size = 0;
 	return EFI_SUCCESS;
 }
 
-static void free_buffer()
+static void free_buffer(struct sparse_ctx *s)
 {
-	if (!buffer)
+	if (!s->buffer)
 		return;
 
-	FreePool(buffer);
-	buffer = NULL;
+	bufpool_put(s->buffer);
+	s->buffer = NULL;
 }
 
-static EFI_STATUS flush_buffer()
+static EFI_STATUS flush_buffer(struct sparse_ctx *s)
 {
 	EFI_STATUS ret = EFI_SUCCESS;
 
-	if (buffer && cur_size != 0)
-		ret = flash_write(buffer, cur_size);
+	if (s->buffer && s->cur_size != 0)
+		ret = flash_write(s->fctx, s->buffer, s->cur_size);
 
-	cur_size = 0;
+	s->cur_size = 0;
 	return ret;
 }
 
-static EFI_STATUS flash_raw_data(void *data, unsigned size)
+static EFI_STATUS flash_raw_data(struct sparse_ctx *s, void *data, unsigned size)
 {
 	EFI_STATUS ret;
 
-	if (!buffer)
-		return flash_write(data, size);
+	if (!s->buffer)
+		return flash_write(s->fctx, data, size);
 
 	if (size > HUNK_SIZE_THRESHOLD) {
-		ret = flush_buffer();
+		ret = flush_buffer(s);
 		if (EFI_ERROR(ret))
 			return ret;
-		return flash_write(data, size);
+		return flash_write(s->fctx, data, size);
 	}
 
-	if (size + cur_size > BUFFER_SIZE) {
-		ret = flush_buffer();
+	if (size + s->cur_size > BUFFER_SIZE) {
+		ret = flush_buffer(s);
 		if (EFI_ERROR(ret))
 			return ret;
 	}
 
-	memcpy(buffer + cur_size, data, size);
-	cur_size += size;
+	memcpy(s->buffer + s->cur_size, data, size);
+	s->cur_size += size;
 
 	return EFI_SUCCESS;
 }
 
-static EFI_STATUS flash_chunk(struct sparse_header *sph, struct chunk_header *ckh, CHAR8 *data, unsigned int size)
+/* Flash the part of the chunk CKH not flashed yet, up to *BUDGET
+   bytes.  Skipped blocks do not consume any budget.  */
+static EFI_STATUS flash_chunk(struct sparse_ctx *s, struct chunk_header *ckh,
+			      CHAR8 *data, unsigned int size, UINT64 *budget)
 {
 	EFI_STATUS ret;
+	struct sparse_header *sph = s->sph;
 	UINT64 chunk_szb = (UINT64)ckh->chunk_sz * (UINT64)sph->blk_sz;
+	UINT64 len;
 
 	switch (ckh->chunk_type) {
 	case CHUNK_TYPE_RAW:
@@ -144,65 +168,265 @@ static EFI_STATUS flash_chunk(struct sparse_header *sph, struct chunk_header *ck
 			error(L"inconsistent raw chunk");
 			return EFI_INVALID_PARAMETER;
 		}
-		return flash_raw_data(data, size);
+		len = min(chunk_szb - s->chunk_done, *budget);
+		ret = flash_raw_data(s, data + s->chunk_done, len);
+		break;
 	case CHUNK_TYPE_DONT_CARE:
-		ret = flush_buffer();
+		ret = flush_buffer(s);
 		if (EFI_ERROR(ret))
 			return ret;
-		return flash_skip(chunk_szb);
+		s->chunk_done = chunk_szb;
+		return flash_skip(s->fctx, chunk_szb);
 	case CHUNK_TYPE_FILL:
-		ret = flush_buffer();
+		ret = flush_buffer(s);
 		if (EFI_ERROR(ret))
 			return ret;
-		return flash_fill(*((UINT32 *) data), chunk_szb);
+		len = chunk_szb - s->chunk_done;
+		if (len > *budget)
+			len = ALIGN(*budget, sph->blk_sz);
+		ret = flash_fill(s->fctx, *((UINT32 *) data), len);
+		break;
 	case CHUNK_TYPE_CRC32:
 		debug(L"crc chunk not implemented yet %d", size);
-		break;
+		s->chunk_done = chunk_szb;
+		return EFI_SUCCESS;
 	default:
 		error(L"Unknow chunk type %04x", ckh->chunk_type);
 		return EFI_INVALID_PARAMETER;
 	}
+
+	s->chunk_done += len;
+	*budget -= min(*budget, len);
+	return ret;
+}
+
+EFI_STATUS flash_sparse_start(struct flash_ctx *fctx, void *data, UINT64 size,
+			      BOOLEAN buffered, struct sparse_ctx **s_p)
+{
+	struct sparse_ctx *s;
+
+	s = AllocateZeroPool(sizeof(*s));
+	if (!s)
+		return EFI_OUT_OF_RESOURCES;
+
+	s->fctx = fctx;
+	s->sph = data;
+	s->size = size;
+	s->pos = (CHAR8 *)data + s->sph->file_hdr_sz;
+	s->left = size;
+	if (buffered)
+		init_buffer(s);
+
+	*s_p = s;
 	return EFI_SUCCESS;
 }
 
-EFI_STATUS flash_sparse(void *data, UINT64 size)
+/* Flash the next BUDGET bytes of the image, *DONE is set once the
+   whole image is flashed.  */
+EFI_STATUS flash_sparse_step(struct sparse_ctx *s, UINT64 budget, BOOLEAN *done)
 {
-	struct sparse_header *sph;
-	CHAR8 *s;
-	UINT64 rlen;
+	EFI_STATUS ret;
+	struct sparse_header *sph = s->sph;
+	struct chunk_header *ckh;
+
+	*done = FALSE;
+	for (; s->chunk < sph->total_chunks && budget; s->chunk++) {
+		ckh = (struct chunk_header *)s->pos;
+
+		if (!s->chunk_done) {
+			if (s->left < sph->chunk_hdr_sz || s->left < ckh->total_sz) {
+				error(L"sparse chunk truncated, %ld, %ld", s->left, s->size);
+				return EFI_INVALID_PARAMETER;
+			}
+			if (ckh->total_sz < sph->chunk_hdr_sz) {
+				error(L"sparse chunk malformated, %d, %d", ckh->total_sz, sph->chunk_hdr_sz);
+				return EFI_INVALID_PARAMETER;
+			}
+		}
+
+		ret = flash_chunk(s, ckh, s->pos + sph->chunk_hdr_sz,
+				  ckh->total_sz - sph->chunk_hdr_sz, &budget);
+		if (EFI_ERROR(ret))
+			return ret;
+
+		if (s->chunk_done < (UINT64)ckh->chunk_sz * sph->blk_sz)
+			return EFI_SUCCESS;
+
+		s->chunk_done = 0;
+		s->pos += ckh->total_sz;
+		s->left -= ckh->total_sz;
+	}
+
+	if (s->chunk < sph->total_chunks)
+		return EFI_SUCCESS;
+
+	*done = TRUE;
+	return flush_buffer(s);
+}
+
+void flash_sparse_free(struct sparse_ctx *s)
+{
+	free_buffer(s);
+	FreePool(s);
+}
+
+EFI_STATUS flash_sparse(struct flash_ctx *fctx, void *data, UINT64 size)
+{
+	EFI_STATUS ret;
+	struct sparse_ctx *s;
+	BOOLEAN done;
+
+	ret = flash_sparse_start(fctx, data, size, TRUE, &s);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = flash_sparse_step(s, (UINT64)-1, &done);
+	flash_sparse_free(s);
+	return ret;
+}
+
+static EFI_STATUS stream_copy(sparse_read_t read, void *ctx, void *dst, UINTN size)
+{
+	EFI_STATUS ret;
+	void *data;
+	UINTN len;
+
+	ret = read(ctx, size, size, &data, &len);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"sparse stream truncated");
+		return ret;
+	}
+
+	memcpy(dst, data, size);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS stream_skip(sparse_read_t read, void *ctx, UINTN size)
+{
+	void *data;
+	UINTN len;
+
+	return size ? read(ctx, size, size, &data, &len) : EFI_SUCCESS;
+}
+
+/* flash_raw_data() takes an unsigned int size. */
+#define STREAM_MAX_PIECE (1U << 30)
+
+static EFI_STATUS stream_raw(struct sparse_ctx *s, sparse_read_t read, void *ctx,
+			     struct sparse_header *sph, UINT64 size)
+{
+	EFI_STATUS ret;
+	void *data;
+	UINTN len;
+
+	for (; size; size -= len) {
+		ret = read(ctx, sph->blk_sz, min(size, (UINT64)STREAM_MAX_PIECE), &data, &len);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"sparse stream truncated");
+			return ret;
+		}
+
+		ret = flash_raw_data(s, data, len);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS stream_chunk(struct sparse_ctx *s, sparse_read_t read, void *ctx,
+			       struct sparse_header *sph, struct chunk_header *ckh)
+{
+	EFI_STATUS ret;
+	UINT64 chunk_szb = (UINT64)ckh->chunk_sz * (UINT64)sph->blk_sz;
+	UINT64 data_sz = ckh->total_sz - sph->chunk_hdr_sz;
+	UINT32 value;
+
+	switch (ckh->chunk_type) {
+	case CHUNK_TYPE_RAW:
+		if (data_sz != chunk_szb) {
+			error(L"inconsistent raw chunk");
+			return EFI_INVALID_PARAMETER;
+		}
+		return stream_raw(s, read, ctx, sph, chunk_szb);
+	case CHUNK_TYPE_DONT_CARE:
+		if (data_sz) {
+			error(L"inconsistent skip chunk");
+			return EFI_INVALID_PARAMETER;
+		}
+		ret = flush_buffer(s);
+		if (EFI_ERROR(ret))
+			return ret;
+		return flash_skip(s->fctx, chunk_szb);
+	case CHUNK_TYPE_FILL:
+		if (data_sz != sizeof(value)) {
+			error(L"inconsistent fill chunk");
+			return EFI_INVALID_PARAMETER;
+		}
+		ret = stream_copy(read, ctx, &value, sizeof(value));
+		if (EFI_ERROR(ret))
+			return ret;
+		ret = flush_buffer(s);
+		if (EFI_ERROR(ret))
+			return ret;
+		return flash_fill(s->fctx, value, chunk_szb);
+	case CHUNK_TYPE_CRC32:
+		debug(L"crc chunk not implemented yet %d", data_sz);
+		return stream_skip(read, ctx, data_sz);
+	default:
+		error(L"Unknow chunk type %04x", ckh->chunk_type);
+		return EFI_INVALID_PARAMETER;
+	}
+}
+
+/* Same as flash_sparse() but the image is provided piece by piece by
+   READ: the chunks are flashed as they come, whatever the number and
+   the size of the pieces.  */
+EFI_STATUS flash_sparse_stream(struct flash_ctx *fctx, sparse_read_t read, void *ctx)
+{
+	EFI_STATUS ret_flush_buffer, ret;
+	struct sparse_ctx s = { .fctx = fctx };
+	struct sparse_header sph;
+	struct chunk_header ckh;
 	unsigned int i;
-	EFI_STATUS ret_flush_buffer, ret = EFI_SUCCESS;
 
-	rlen = size;
-	s = data;
-	sph = data;
-	s += sph->file_hdr_sz;
+	ret = stream_copy(read, ctx, &sph, sizeof(sph));
+	if (EFI_ERROR(ret))
+		return ret;
 
-	init_buffer();
+	if (!is_sparse_image(&sph, sizeof(sph)) || !sph.blk_sz ||
+	    sph.blk_sz % sizeof(UINT32)) {
+		error(L"sparse file expected");
+		return EFI_INVALID_PARAMETER;
+	}
 
-	for (i = 0; i < sph->total_chunks; i++) {
-		struct chunk_header *ckh;
-		ckh = (struct chunk_header *) s;
+	ret = stream_skip(read, ctx, sph.file_hdr_sz - sizeof(sph));
+	if (EFI_ERROR(ret))
+		return ret;
 
-		if (rlen < sph->chunk_hdr_sz || rlen < ckh->total_sz) {
-			error(L"sparse chunk truncated, %ld, %ld", rlen, size);
-			ret = EFI_INVALID_PARAMETER;
+	init_buffer(&s);
+
+	for (i = 0; i < sph.total_chunks; i++) {
+		ret = stream_copy(read, ctx, &ckh, sizeof(ckh));
+		if (EFI_ERROR(ret))
 			break;
-		}
-		if (ckh->total_sz < sph->chunk_hdr_sz) {
-			error(L"sparse chunk malformated, %d, %d", ckh->total_sz, sph->chunk_hdr_sz);
+
+		ret = stream_skip(read, ctx, sph.chunk_hdr_sz - sizeof(ckh));
+		if (EFI_ERROR(ret))
+			break;
+
+		if (ckh.total_sz < sph.chunk_hdr_sz) {
+			error(L"sparse chunk malformated, %d, %d", ckh.total_sz, sph.chunk_hdr_sz);
 			ret = EFI_INVALID_PARAMETER;
 			break;
 		}
-		ret = flash_chunk(sph, ckh, s + sph->chunk_hdr_sz, ckh->total_sz - sph->chunk_hdr_sz);
+
+		ret = stream_chunk(&s, read, ctx, &sph, &ckh);
 		if (EFI_ERROR(ret))
 			break;
-
-		s += ckh->total_sz;
-		rlen -= ckh->total_sz;
 	}
 
-	ret_flush_buffer = flush_buffer();
-	free_buffer();
+	ret_flush_buffer = flush_buffer(&s);
+	free_buffer(&s);
 	return EFI_ERROR(ret) ? ret : ret_flush_buffer;
 }
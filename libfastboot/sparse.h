@@ -37,7 +37,26 @@
 
 #include <efi.h>
 
-int is_sparse_image(void *data, UINT64 size);
-EFI_STATUS flash_sparse(void *data, UINT64 size);
+struct flash_ctx;
+struct sparse_ctx;
+
+BOOLEAN is_sparse_image(void *data, UINT64 size);
+EFI_STATUS flash_sparse(struct flash_ctx *fctx, void *data, UINT64 size);
+
+/* Incremental flashing of an in memory sparse image, BUFFERED gathers
+   the small raw chunks in a 10 MB buffer.  */
+EFI_STATUS flash_sparse_start(struct flash_ctx *fctx, void *data, UINT64 size,
+			      BOOLEAN buffered, struct sparse_ctx **s);
+EFI_STATUS flash_sparse_step(struct sparse_ctx *s, UINT64 budget, BOOLEAN *done);
+void flash_sparse_free(struct sparse_ctx *s);
+
+/* Sparse image streaming, for the images which do not fit in memory.
+   The read callback returns in *DATA a pointer to the next *LEN bytes
+   of the image, with UNIT <= *LEN <= MAX and *LEN a multiple of UNIT
+   unless *LEN is MAX.  *DATA is valid until the next call.  */
+typedef EFI_STATUS (*sparse_read_t)(void *ctx, UINTN unit, UINTN max,
+				    void **data, UINTN *len);
+
+EFI_STATUS flash_sparse_stream(struct flash_ctx *fctx, sparse_read_t read, void *ctx);
 
 #endif	/* _SPARSE_H_ */
@@ -25,18 +25,58 @@ endif
 KERNELFLINGER_IMAGES := $(wildcard $(TARGET_KERNELFLINGER_IMAGES_DIR)/*.png)
 KERNELFLINGER_FONTS := $(wildcard $(TARGET_KERNELFLINGER_FONT_DIR)/*.png)
 
-$(img_res): $(KERNELFLINGER_IMAGES)
+# Images which must show up instantly are embedded pre-decoded so
+# that they do not go through PNG inflate.  RAW images are used in
+# place from a read-only section, RLE images are a compact run-length
+# encoding which decodes at memcpy speed.
+ifndef KERNELFLINGER_RAW_IMAGES
+KERNELFLINGER_RAW_IMAGES :=
+endif
+ifndef KERNELFLINGER_RLE_IMAGES
+KERNELFLINGER_RLE_IMAGES := crash_event low_battery empty_battery splash_intel
+endif
+
+image_files = $(filter $(addprefix %/,$(addsuffix .png,$(1))),$(KERNELFLINGER_IMAGES))
+image_name = $(subst .png,,$(notdir $(1)))
+
+KERNELFLINGER_RAW_IMAGE_FILES := $(call image_files,$(KERNELFLINGER_RAW_IMAGES))
+KERNELFLINGER_RLE_IMAGE_FILES := $(filter-out $(KERNELFLINGER_RAW_IMAGE_FILES),\
+	$(call image_files,$(KERNELFLINGER_RLE_IMAGES)))
+KERNELFLINGER_PNG_IMAGE_FILES := $(filter-out $(KERNELFLINGER_RAW_IMAGE_FILES) \
+	$(KERNELFLINGER_RLE_IMAGE_FILES),$(KERNELFLINGER_IMAGES))
+
+$(img_res): $(KERNELFLINGER_IMAGES) $(PNG2C)
 	$(hide) mkdir -p $(dir $@)
 	$(hide) echo "/* Do not modify this auto-generated file. */" > $@
-	$(hide) $(foreach file,$(KERNELFLINGER_IMAGES),\
+	$(hide) $(foreach file,$(KERNELFLINGER_RAW_IMAGE_FILES),\
+         $(PNG2C) -i $(file) -o - -f BGRA -e RAW -p __$(call image_name,$(file)) >> $@;)
+	$(hide) $(foreach file,$(KERNELFLINGER_RLE_IMAGE_FILES),\
+         $(PNG2C) -i $(file) -o - -f BGRA -e RLE -p __$(call image_name,$(file)) >> $@;)
+	$(hide) $(foreach file,$(KERNELFLINGER_PNG_IMAGE_FILES),\
          echo "extern uint8_t _binary_"$(subst .,_,$(notdir $(file)))"_start;" >> $@;)
-	$(hide) $(foreach file,$(KERNELFLINGER_IMAGES),\
+	$(hide) $(foreach file,$(KERNELFLINGER_PNG_IMAGE_FILES),\
          echo "extern uint32_t _binary_"$(subst .,_,$(notdir $(file)))"_size;" >> $@;)
 	$(hide) echo "ui_image_t ui_images[] = {" >> $@
-	$(hide) $(foreach file,$(KERNELFLINGER_IMAGES),\
+	$(hide) $(foreach file,$(KERNELFLINGER_PNG_IMAGE_FILES),\
          echo "{ .name = \""$(subst .png,,$(notdir $(file)))"\", "\
+		".format = UI_IMAGE_PNG, "\
 		".data = (UINT8 *)&_binary_"$(subst .,_,$(notdir $(file)))"_start, "\
 		".size = (UINTN)&_binary_"$(subst .,_,$(notdir $(file)))"_size}," >> $@;)
+	$(hide) $(foreach file,$(KERNELFLINGER_RAW_IMAGE_FILES),\
+         echo "{ .name = \""$(call image_name,$(file))"\", "\
+		".format = UI_IMAGE_BLT, "\
+		".data = __"$(call image_name,$(file))"_dat, "\
+		".size = sizeof(__"$(call image_name,$(file))"_dat), "\
+		".blt = (EFI_GRAPHICS_OUTPUT_BLT_PIXEL *)__"$(call image_name,$(file))"_dat, "\
+		".width = __"$(call image_name,$(file))"_width, "\
+		".height = __"$(call image_name,$(file))"_height}," >> $@;)
+	$(hide) $(foreach file,$(KERNELFLINGER_RLE_IMAGE_FILES),\
+         echo "{ .name = \""$(call image_name,$(file))"\", "\
+		".format = UI_IMAGE_RLE, "\
+		".data = __"$(call image_name,$(file))"_dat, "\
+		".size = sizeof(__"$(call image_name,$(file))"_dat), "\
+		".width = __"$(call image_name,$(file))"_width, "\
+		".height = __"$(call image_name,$(file))"_height}," >> $@;)
 	$(hide) echo "};" >> $@
 
 $(font_res): $(KERNELFLINGER_FONTS) $(PNG2C) $(GEN_FONTS)
@@ -115,6 +155,8 @@ LOCAL_SRC_FILES := \
 	log.c \
 	em.c \
 	gpt.c \
+	block_reader.c \
+	bufpool.c \
 	storage.c \
 	pci.c \
 	mmc.c \
@@ -137,6 +179,7 @@ LOCAL_SRC_FILES := \
 	rpmb/rpmb_nvme.c \
 	rpmb/rpmb_storage_common.c \
 	timer.c \
+	trace.c \
 	nvme.c \
 	virtual_media.c \
 	general_block.c \
@@ -202,7 +245,7 @@ ifneq ($(strip $(KERNELFLINGER_USE_UI)),false)
 	ui_boot_menu.c \
 	ui_confirm.c
     LOCAL_GENERATED_SOURCES := \
-        $(foreach file,$(KERNELFLINGER_IMAGES),\
+        $(foreach file,$(KERNELFLINGER_PNG_IMAGE_FILES),\
 	    $(res_intermediates)/$(notdir $(file:png=o)))
 else
     LOCAL_SRC_FILES += \
@@ -46,6 +46,7 @@
 #include "protocol/AcpiTableProtocol.h"
 #include "security.h"
 #include "targets.h"
+#include "trace.h"
 
 static struct ACPI_TABLE_LOADED {
 	UINTN index[ACPI_TABLE_MAX_LOAD_NUM];
@@ -171,8 +172,10 @@ static EFI_STATUS acpi_image_load_partition(const CHAR16 *label, VOID **image)
 		return EFI_OUT_OF_RESOURCES;
 	}
 	debug(L"Reading %s image: %d bytes", label, (*acpi_info).img_size);
+	TRACE_BEGIN(TRACE_READ_DISK, (*acpi_info).img_size >> 10);
 	ret = uefi_call_wrapper(gpart.dio->ReadDisk, 5, gpart.dio, (*acpi_info).MediaId,
 				(*acpi_info).partition_start, (*acpi_info).img_size, acpiimage);
+	TRACE_END(TRACE_READ_DISK, (*acpi_info).img_size >> 10);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"ReadDisk Error for %s image read", label);
 		FreePool(acpi_info);
@@ -336,6 +339,7 @@ EFI_STATUS install_acpi_table_from_partitions(VOID *image,
 					      enum boot_target target)
 {
 	int is_acpio;
+	TRACE_SCOPE(TRACE_ACPI_INSTALL, 0);
 
 	if (!strcmp(part_name, "acpi")) {
 		is_acpio = 0;
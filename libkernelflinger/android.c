@@ -52,11 +52,13 @@
 #include "slot.h"
 #include "pae.h"
 #include "timer.h"
+#include "trace.h"
 #include "android_vb.h"
 #ifdef RPMB_STORAGE
 #include "rpmb_storage.h"
 #endif
 #include "acpi.h"
+#include "protocol/MpService.h"
 #ifdef USE_FIRSTSTAGE_MOUNT
 #include "firststage_mount.h"
 #endif
@@ -430,6 +432,7 @@ static inline EFI_STATUS handover_jump(EFI_HANDLE image,
         clear_rpmb_key();
 #endif
         log(L"handover jump ...\n");
+        log_flush();
 
         ret = setup_gdt();
         if (EFI_ERROR(ret)) {
@@ -1238,6 +1241,7 @@ static EFI_STATUS handover_kernel(CHAR8 *bootimage, EFI_HANDLE parent_image)
         ui_free();
 
         log_flush_to_var(FALSE);
+        trace_save_to_var();
 
         boot_params = (struct boot_params *)(UINTN)boot_addr;
         memset(boot_params, 0x0, 16384);
@@ -1300,8 +1304,10 @@ EFI_STATUS android_image_load_partition(
                 return EFI_OUT_OF_RESOURCES;
 
         debug(L"Reading full boot image (%d bytes)", img_size);
+        TRACE_BEGIN(TRACE_READ_DISK, img_size >> 10);
         ret = uefi_call_wrapper(gpart.dio->ReadDisk, 5, gpart.dio, MediaId, partition_start,
                                 img_size, bootimage);
+        TRACE_END(TRACE_READ_DISK, img_size >> 10);
         if (EFI_ERROR(ret)) {
                 efi_perror(ret, L"ReadDisk");
                 FreePool(bootimage);
@@ -1604,37 +1610,223 @@ EFI_STATUS write_bcb(
 }
 
 
+/* The memory is cleared in chunks of CLEAR_CHUNK_SZ bytes handed out
+ * to the processors on a first come first served basis.  The
+ * application processors cannot use any boot service and the ia32
+ * ones cannot reach the memory above 4 GiB which is cleared by the
+ * boot processor through the PAE mapping.
+ */
+#define CLEAR_CHUNK_SZ (16 * 1024 * 1024)
+#ifdef __LP64__
+#define AP_MEMORY_LIMIT ((EFI_PHYSICAL_ADDRESS)-1)
+#else
+#define AP_MEMORY_LIMIT ((EFI_PHYSICAL_ADDRESS)1 << 32)
+#endif
+
+struct clear_memory_ctx {
+        CHAR8 *entries;
+        UINTN nr_entries;
+        UINTN entry_sz;
+        volatile UINTN next_chunk;
+        volatile UINTN nr_busy;         /* Processors clearing a chunk */
+        volatile UINTN nr_workers;      /* Processors which cleared a chunk */
+};
+
+/* Non-temporal stores do not pollute the caches shared by the
+ * processors with data which is never read back.
+ */
+static void clear_memory_nt(UINTN *buf, UINTN len)
+{
+        UINTN *end = buf + len / sizeof(*buf);
+
+        for (; buf < end; buf++)
+                asm volatile("movnti %1, %0" : "=m" (*buf) : "r" ((UINTN)0));
+        asm volatile("sfence" ::: "memory");
+}
+
+static BOOLEAN get_clear_chunk(struct clear_memory_ctx *ctx, UINTN chunk,
+                               EFI_PHYSICAL_ADDRESS *start, UINT64 *len)
+{
+        EFI_MEMORY_DESCRIPTOR *entry;
+        EFI_PHYSICAL_ADDRESS end;
+        CHAR8 *entries = ctx->entries;
+        UINTN i, nr_chunks;
+
+        for (i = 0; i < ctx->nr_entries; entries += ctx->entry_sz, i++) {
+                entry = (EFI_MEMORY_DESCRIPTOR *)entries;
+                if (entry->Type != EfiConventionalMemory ||
+                    entry->PhysicalStart >= AP_MEMORY_LIMIT)
+                        continue;
+
+                end = entry->PhysicalStart + entry->NumberOfPages * EFI_PAGE_SIZE;
+                end = min(end, AP_MEMORY_LIMIT);
+                nr_chunks = (end - entry->PhysicalStart + CLEAR_CHUNK_SZ - 1) / CLEAR_CHUNK_SZ;
+                if (chunk >= nr_chunks) {
+                        chunk -= nr_chunks;
+                        continue;
+                }
+
+                *start = entry->PhysicalStart + (UINT64)chunk * CLEAR_CHUNK_SZ;
+                *len = min(end - *start, (UINT64)CLEAR_CHUNK_SZ);
+                return TRUE;
+        }
+
+        return FALSE;
+}
+
+/* Runs on all the processors.  The stack canary word is left
+ * untouched as other processors may be checking it: it is restored
+ * by the boot processor anyway.  A processor is accounted busy before
+ * it claims a chunk so that once all the chunks are claimed, the
+ * clearing is complete when NR_BUSY drops to zero.
+ */
+static VOID EFIAPI clear_memory_worker(VOID *arg)
+{
+        struct clear_memory_ctx *ctx = arg;
+        EFI_PHYSICAL_ADDRESS start, end;
+        BOOLEAN worked = FALSE;
+        UINT64 len;
+
+        __sync_fetch_and_add(&ctx->nr_busy, 1);
+        while (get_clear_chunk(ctx, __sync_fetch_and_add(&ctx->next_chunk, 1),
+                               &start, &len)) {
+                end = start + len;
+                if (start <= STACK_CANARY_LOCATION && STACK_CANARY_LOCATION < end) {
+                        clear_memory_nt((UINTN *)(UINTN)start, STACK_CANARY_LOCATION - start);
+                        start = STACK_CANARY_LOCATION + sizeof(UINTN);
+                }
+                clear_memory_nt((UINTN *)(UINTN)start, end - start);
+                worked = TRUE;
+        }
+        if (worked)
+                __sync_fetch_and_add(&ctx->nr_workers, 1);
+        __sync_fetch_and_sub(&ctx->nr_busy, 1);
+}
+
+/* Locates the MP services and creates the event they signal once
+ * the application processors are done.  It allocates memory, it must
+ * be called before the memory map is taken.  Returns NULL if the
+ * application processors cannot be used.
+ */
+static EFI_MP_SERVICES_PROTOCOL *clear_memory_get_aps(EFI_EVENT *event)
+{
+        EFI_STATUS ret;
+        EFI_GUID guid = EFI_MP_SERVICES_PROTOCOL_GUID;
+        EFI_MP_SERVICES_PROTOCOL *mp;
+
+        ret = LibLocateProtocol(&guid, (void **)&mp);
+        if (EFI_ERROR(ret)) {
+                debug(L"Clearing memory on the boot processor only: %r", ret);
+                return NULL;
+        }
+
+        ret = uefi_call_wrapper(BS->CreateEvent, 5, 0, 0, NULL, NULL, event);
+        if (EFI_ERROR(ret)) {
+                efi_perror(ret, L"Failed to create the MP services event");
+                return NULL;
+        }
+
+        return mp;
+}
+
+/* Starts the clearing on the application processors and returns
+ * immediately so that the boot processor can take its share of the
+ * work.  EVENT is signaled by the MP services once the application
+ * processors are done, which can only happen at a TPL lower than
+ * TPL_NOTIFY: the application processors are not used if the caller
+ * already runs at TPL_NOTIFY or above.  Returns FALSE if the
+ * application processors are not used.
+ */
+static BOOLEAN clear_memory_start_aps(struct clear_memory_ctx *ctx,
+                                      EFI_MP_SERVICES_PROTOCOL *mp,
+                                      EFI_EVENT event, EFI_TPL tpl)
+{
+        EFI_STATUS ret;
+
+        if (!mp)
+                return FALSE;
+
+        if (tpl >= TPL_NOTIFY) {
+                debug(L"Clearing memory on the boot processor only at TPL %d", tpl);
+                return FALSE;
+        }
+
+        ret = uefi_call_wrapper(mp->StartupAllAPs, 7, mp,
+                                clear_memory_worker, FALSE, event,
+                                0, ctx, NULL);
+        if (EFI_ERROR(ret)) {
+                debug(L"Clearing memory on the boot processor only: %r", ret);
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
+/* Wait for the application processors still clearing a chunk.  All
+ * the chunks have been claimed when the boot processor worker
+ * returns: an application processor starting later has nothing to
+ * do.
+ */
+static void clear_memory_wait_aps(struct clear_memory_ctx *ctx)
+{
+        while (ctx->nr_busy)
+                asm volatile("pause" ::: "memory");
+}
+
 EFI_STATUS android_clear_memory()
 {
         EFI_STATUS ret = EFI_SUCCESS;
         UINTN nr_entries, key, entry_sz;
         CHAR8 *mem_entries;
         UINT32 entry_ver;
-        UINTN i;
         CHAR8 *mem_map;
         EFI_TPL OldTpl;
+        struct clear_memory_ctx ctx;
+        EFI_MP_SERVICES_PROTOCOL *mp;
+        EFI_EVENT event = NULL;
+        BOOLEAN aps_started;
+#ifndef __LP64__
+        UINTN i;
+#endif
 
         UINTN stack_canary = *(UINTN *)STACK_CANARY_LOCATION;
 
+        mp = clear_memory_get_aps(&event);
+
         OldTpl = uefi_call_wrapper(BS->RaiseTPL, 1, TPL_NOTIFY);
         mem_entries = (CHAR8 *)LibMemoryMap(&nr_entries, &key, &entry_sz, &entry_ver);
         if (!mem_entries) {
                 uefi_call_wrapper(BS->RestoreTPL, 1, OldTpl);
+                if (mp)
+                        uefi_call_wrapper(BS->CloseEvent, 1, event);
                 return EFI_OUT_OF_RESOURCES;
         }
 
         sort_memory_map(mem_entries, nr_entries, entry_sz);
         mem_map = mem_entries;
 
+        ctx.entries = mem_entries;
+        ctx.nr_entries = nr_entries;
+        ctx.entry_sz = entry_sz;
+        ctx.next_chunk = 0;
+        ctx.nr_busy = 0;
+        ctx.nr_workers = 0;
+        aps_started = clear_memory_start_aps(&ctx, mp, event, OldTpl);
+        clear_memory_worker(&ctx);
+
+        /* The memory above 4 GiB is cleared by the boot processor
+         * while the application processors complete the low memory.
+         * PAE is only enabled once the boot processor is done with
+         * the low memory as it remaps a part of it.
+         */
 #ifndef __LP64__
         ret = pae_init(mem_entries, nr_entries, entry_sz);
         if (EFI_ERROR(ret))
                 goto err;
-#endif
 
         for (i = 0; i < nr_entries; mem_entries += entry_sz, i++) {
                 EFI_MEMORY_DESCRIPTOR *entry;
-                EFI_PHYSICAL_ADDRESS start;
+                EFI_PHYSICAL_ADDRESS start, end;
                 UINT64 map_sz, len;
                 void *buf;
 
@@ -1642,28 +1834,39 @@ EFI_STATUS android_clear_memory()
                 if (entry->Type != EfiConventionalMemory)
                         continue;
 
-                start = entry->PhysicalStart;
-                map_sz = entry->NumberOfPages * EFI_PAGE_SIZE;
+                end = entry->PhysicalStart + entry->NumberOfPages * EFI_PAGE_SIZE;
+                if (end <= AP_MEMORY_LIMIT)
+                        continue;
+
+                start = max(entry->PhysicalStart, AP_MEMORY_LIMIT);
+                map_sz = end - start;
 
                 for (; map_sz > 0; map_sz -= len, start += len) {
                         len = map_sz;
-#ifdef __LP64__
-                        buf = (void *)start;
-#else
                         ret = pae_map(start, (unsigned char **)&buf, &len);
                         if (EFI_ERROR(ret))
                                 goto pae_err;
-#endif
                         uefi_call_wrapper(BS->SetMem, 3, buf, len, 0);
                 }
         }
 
-#ifndef __LP64__
 pae_err:
         pae_exit();
 err:
 #endif
+        /* The memory map must not change before the application
+         * processors are done, hence the wait at TPL_NOTIFY. */
+        clear_memory_wait_aps(&ctx);
         uefi_call_wrapper(BS->RestoreTPL, 1, OldTpl);
+        debug(L"Memory cleared by %d processor(s)", ctx.nr_workers);
+
+        /* Let the MP services collect the application processors. */
+        if (aps_started)
+                while (uefi_call_wrapper(BS->CheckEvent, 1, event) == EFI_NOT_READY)
+                        ;
+        if (mp)
+                uefi_call_wrapper(BS->CloseEvent, 1, event);
+
         FreePool((void *)mem_map);
         *(UINTN *)STACK_CANARY_LOCATION = stack_canary;
 
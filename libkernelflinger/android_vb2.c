@@ -34,6 +34,7 @@
 #include "slot.h"
 #include "pae.h"
 #include "timer.h"
+#include "trace.h"
 #ifdef RPMB_STORAGE
 #include "rpmb_storage.h"
 #endif
@@ -310,12 +311,14 @@ EFI_STATUS android_image_load_partition_avb(
         if (allow_verification_error)
                 flags |= AVB_SLOT_VERIFY_FLAGS_ALLOW_VERIFICATION_ERROR;
 
+        TRACE_BEGIN(TRACE_AVB_VERIFY, 0);
         verify_result = avb_slot_verify(ops,
                         requested_partitions,
                         slot_suffix,
                         flags,
                         AVB_HASHTREE_ERROR_MODE_RESTART,
                         slot_data);
+        TRACE_END(TRACE_AVB_VERIFY, 0);
 
         debug(L"avb_slot_verify ret %d\n", verify_result);
 
@@ -361,7 +364,9 @@ EFI_STATUS android_image_load_partition_avb_ab(
         if (allow_verification_error)
                 flags |= AVB_SLOT_VERIFY_FLAGS_ALLOW_VERIFICATION_ERROR;
 
+        TRACE_BEGIN(TRACE_AVB_VERIFY, 0);
         flow_result = avb_ab_flow(&ab_ops, requested_partitions, flags, AVB_HASHTREE_ERROR_MODE_RESTART, slot_data);
+        TRACE_END(TRACE_AVB_VERIFY, 0);
         ret = get_avb_flow_result(*slot_data,
                 allow_verification_error,
                 flow_result,
@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+
+#include "block_reader.h"
+#include "bufpool.h"
+#include "protocol/DiskIo2.h"
+
+struct block_reader_buf {
+	unsigned char *data;
+	UINT64 offset;
+	UINTN len;
+	BOOLEAN pending;
+	EFI_DISK_IO2_TOKEN token;
+};
+
+struct block_reader {
+	EFI_DISK_IO *dio;
+	EFI_DISK_IO2_PROTOCOL *dio2;
+	UINT32 media_id;
+	UINT64 cur;
+	UINT64 end;
+	UINTN chunk_size;
+	UINTN depth;
+	UINTN head;
+	BOOLEAN held;
+	struct block_reader_buf bufs[BLOCK_READER_MAX_DEPTH];
+};
+
+static EFI_STATUS submit_read(struct block_reader *br, struct block_reader_buf *b)
+{
+	EFI_STATUS ret;
+
+	b->offset = br->cur;
+	b->len = min((UINT64)br->chunk_size, br->end - br->cur);
+	b->pending = b->len != 0;
+	if (!b->pending)
+		return EFI_SUCCESS;
+
+	br->cur += b->len;
+	if (!br->dio2)
+		return EFI_SUCCESS;
+
+	b->token.TransactionStatus = EFI_SUCCESS;
+	ret = uefi_call_wrapper(br->dio2->ReadDiskEx, 6, br->dio2, br->media_id,
+				b->offset, &b->token, b->len, b->data);
+	if (ret == EFI_UNSUPPORTED) {
+		debug(L"Asynchronous read is not supported, using Disk I/O");
+		br->dio2 = NULL;
+		return EFI_SUCCESS;
+	}
+	if (EFI_ERROR(ret)) {
+		b->pending = FALSE;
+		efi_perror(ret, L"Failed to queue the disk read");
+	}
+
+	return ret;
+}
+
+static EFI_STATUS wait_read(struct block_reader *br, struct block_reader_buf *b)
+{
+	EFI_STATUS ret;
+
+	if (!b->pending)
+		return EFI_SUCCESS;
+
+	b->pending = FALSE;
+	if (br->dio2 && b->token.Event) {
+		while (uefi_call_wrapper(BS->CheckEvent, 1, b->token.Event) == EFI_NOT_READY)
+			;
+		ret = b->token.TransactionStatus;
+	} else
+		ret = uefi_call_wrapper(br->dio->ReadDisk, 5, br->dio, br->media_id,
+					b->offset, b->len, b->data);
+
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to read the disk");
+
+	return ret;
+}
+
+EFI_STATUS block_reader_open(struct block_reader **br_p,
+			     struct gpt_partition_interface *gparti,
+			     UINT64 offset, UINT64 len,
+			     UINTN chunk_size, UINTN depth)
+{
+	EFI_STATUS ret;
+	EFI_GUID guid = EFI_DISK_IO2_PROTOCOL_GUID;
+	struct block_reader *br;
+	UINTN i;
+
+	if (!br_p || !gparti || !chunk_size || !depth ||
+	    depth > BLOCK_READER_MAX_DEPTH)
+		return EFI_INVALID_PARAMETER;
+
+	br = AllocateZeroPool(sizeof(*br));
+	if (!br)
+		return EFI_OUT_OF_RESOURCES;
+
+	br->dio = gparti->dio;
+	br->media_id = gparti->bio->Media->MediaId;
+	br->cur = gparti->part.starting_lba * gparti->bio->Media->BlockSize + offset;
+	br->end = br->cur + len;
+	br->chunk_size = chunk_size;
+	br->depth = depth;
+
+	ret = uefi_call_wrapper(BS->HandleProtocol, 3, gparti->handle,
+				&guid, (void **)&br->dio2);
+	if (EFI_ERROR(ret))
+		br->dio2 = NULL;
+
+	for (i = 0; i < depth; i++) {
+		ret = bufpool_get(chunk_size, 0, (VOID **)&br->bufs[i].data);
+		if (EFI_ERROR(ret)) {
+			br->bufs[i].data = NULL;
+			goto err;
+		}
+
+		if (!br->dio2)
+			continue;
+
+		ret = uefi_call_wrapper(BS->CreateEvent, 5, 0, 0, NULL, NULL,
+					&br->bufs[i].token.Event);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to create the disk read event");
+			goto err;
+		}
+	}
+
+	for (i = 0; i < depth; i++) {
+		ret = submit_read(br, &br->bufs[i]);
+		if (EFI_ERROR(ret))
+			goto err;
+	}
+
+	*br_p = br;
+	return EFI_SUCCESS;
+
+err:
+	block_reader_close(br);
+	return ret;
+}
+
+EFI_STATUS block_reader_next(struct block_reader *br, unsigned char **buf,
+			     UINTN *len)
+{
+	EFI_STATUS ret;
+	struct block_reader_buf *b;
+
+	if (!br || !buf || !len)
+		return EFI_INVALID_PARAMETER;
+
+	/* The buffer returned by the previous call is released, use
+	   it for the next read ahead. */
+	if (br->held) {
+		br->held = FALSE;
+		ret = submit_read(br, &br->bufs[(br->head + br->depth - 1) % br->depth]);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	b = &br->bufs[br->head];
+	ret = wait_read(br, b);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	*buf = b->data;
+	*len = b->len;
+	if (b->len) {
+		br->head = (br->head + 1) % br->depth;
+		br->held = TRUE;
+	}
+
+	return EFI_SUCCESS;
+}
+
+void block_reader_close(struct block_reader *br)
+{
+	UINTN i;
+
+	if (!br)
+		return;
+
+	/* Pending reads target our buffers, wait for them to
+	   complete before releasing these buffers. */
+	for (i = 0; i < br->depth; i++) {
+		struct block_reader_buf *b = &br->bufs[i];
+
+		if (br->dio2 && b->pending)
+			wait_read(br, b);
+		if (b->token.Event)
+			uefi_call_wrapper(BS->CloseEvent, 1, b->token.Event);
+		bufpool_put(b->data);
+	}
+
+	FreePool(br);
+}
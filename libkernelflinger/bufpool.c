@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+
+#include "bufpool.h"
+
+#define BUFPOOL_MAX_BUFFERS 64
+
+static struct bufpool_buf {
+	EFI_PHYSICAL_ADDRESS base;
+	UINTN pages;
+	VOID *data;
+	UINTN size;
+	BOOLEAN used;
+} bufs[BUFPOOL_MAX_BUFFERS];
+
+static struct bufpool_stats stats;
+
+static UINTN size_class(UINTN size)
+{
+	UINTN class;
+
+	if (size > BUFPOOL_MAX_SIZE)
+		return EFI_SIZE_TO_PAGES(size) * EFI_PAGE_SIZE;
+
+	for (class = BUFPOOL_MIN_SIZE; class < size; class *= 2)
+		if (class + class / 2 >= size)
+			return class + class / 2;
+
+	return class;
+}
+
+static void free_buf(struct bufpool_buf *b)
+{
+	uefi_call_wrapper(BS->FreePages, 2, b->base, b->pages);
+	stats.cached -= b->size;
+	b->pages = 0;
+	b->base = 0;
+	b->data = NULL;
+	b->size = 0;
+}
+
+void bufpool_flush(void)
+{
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(bufs); i++)
+		if (bufs[i].pages && !bufs[i].used)
+			free_buf(&bufs[i]);
+}
+
+static EFI_STATUS alloc_buf(struct bufpool_buf *b, UINTN size, UINTN align)
+{
+	EFI_STATUS ret;
+	EFI_PHYSICAL_ADDRESS base;
+	UINTN extra = align > EFI_PAGE_SIZE ? align : 0;
+	UINTN pages = EFI_SIZE_TO_PAGES(size + extra);
+
+	/* B stays empty until the pages are allocated, bufpool_flush()
+	   must not see it.  */
+	ret = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAnyPages,
+				EfiLoaderData, pages, &base);
+	if (ret == EFI_OUT_OF_RESOURCES && stats.cached) {
+		bufpool_flush();
+		ret = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAnyPages,
+					EfiLoaderData, pages, &base);
+	}
+	if (EFI_ERROR(ret))
+		return ret;
+
+	b->pages = pages;
+	b->base = base;
+	b->data = (VOID *)(UINTN)base;
+	if (extra)
+		b->data = (VOID *)(((UINTN)base + align - 1) & ~(align - 1));
+	b->size = size;
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS bufpool_get(UINTN size, UINTN align, VOID **buf)
+{
+	EFI_STATUS ret;
+	struct bufpool_buf *b, *empty = NULL;
+	UINTN i, class;
+
+	if (!size || !buf || (align & (align - 1)))
+		return EFI_INVALID_PARAMETER;
+
+	class = size_class(size);
+	for (i = 0; i < ARRAY_SIZE(bufs); i++) {
+		b = &bufs[i];
+		if (!b->pages) {
+			if (!empty)
+				empty = b;
+			continue;
+		}
+		if (!b->used && b->size == class &&
+		    (!align || (UINTN)b->data % align == 0)) {
+			stats.cached -= b->size;
+			stats.hits++;
+			goto found;
+		}
+	}
+
+	if (!empty)
+		return EFI_OUT_OF_RESOURCES;
+
+	b = empty;
+	ret = alloc_buf(b, class, align);
+	if (EFI_ERROR(ret))
+		return ret;
+	stats.misses++;
+
+found:
+	b->used = TRUE;
+	stats.in_use += b->size;
+	stats.high_water = max(stats.high_water, stats.in_use + stats.cached);
+	*buf = b->data;
+	return EFI_SUCCESS;
+}
+
+void bufpool_put(VOID *buf)
+{
+	struct bufpool_buf *b;
+	UINTN i;
+
+	if (!buf)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(bufs); i++) {
+		b = &bufs[i];
+		if (b->pages && b->used && b->data == buf)
+			break;
+	}
+	if (i == ARRAY_SIZE(bufs)) {
+		error(L"%a: %p is not a pool buffer", __func__, buf);
+		return;
+	}
+
+	b->used = FALSE;
+	stats.in_use -= b->size;
+	stats.cached += b->size;
+	if (b->size > BUFPOOL_MAX_SIZE || stats.cached > BUFPOOL_MAX_CACHED)
+		free_buf(b);
+}
+
+void bufpool_get_stats(struct bufpool_stats *s)
+{
+	*s = stats;
+}
@@ -39,6 +39,7 @@
 #include "gpt.h"
 #include "gpt_bin.h"
 #include "storage.h"
+#include "trace.h"
 
 #define PROTECTIVE_MBR 0xEE
 
@@ -439,6 +440,7 @@ EFI_STATUS gpt_get_partition_by_label(const CHAR16 *label,
 {
 	struct gpt_partition *part;
 	EFI_STATUS ret;
+	TRACE_SCOPE(TRACE_GPT_LOOKUP, 0);
 
 	if (!label || !gpart)
 		return EFI_INVALID_PARAMETER;
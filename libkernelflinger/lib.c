@@ -65,6 +65,9 @@
 
 #include <efi.h>
 #include <efilib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "lib.h"
 #include "vars.h"
@@ -919,6 +922,7 @@ VOID pause(UINTN seconds)
 
 VOID halt_system(VOID)
 {
+        log_flush();
         uefi_call_wrapper(RT->ResetSystem, 4, EfiResetShutdown, EFI_SUCCESS,
                           0, NULL);
         error(L"Failed to halt the device ... looping forever");
@@ -940,6 +944,7 @@ VOID reboot(CHAR16 *target, EFI_RESET_TYPE type)
                 }
         }
 
+        log_flush();
         uefi_call_wrapper(RT->ResetSystem, 4, type, EFI_SUCCESS,
                           0, target);
         error(L"Failed to reboot the device ... looping forever");
@@ -971,20 +976,187 @@ EFI_STATUS alloc_aligned(VOID **free_addr, VOID **aligned_addr,
         return EFI_SUCCESS;
 }
 
+/* memcpy() and memset() use "rep movsb" and "rep stosb" when the
+ * processor supports Enhanced REP MOVSB/STOSB and SSE2 loops
+ * otherwise.  The copies of MEM_NT_THRESHOLD bytes or more use
+ * non-temporal stores so that they do not evict the whole cache.
+ * The processor features are read once, on the first call.
+ */
+#define CPUID_EXT_FEATURES_LEAF 7
+#define CPUID_EBX_ERMS (1 << 9)
+#define CPUID_EDX_FSRM (1 << 4)
+
+#define MEM_FEATURES_READ (1 << 0)
+#define MEM_ERMS (1 << 1)
+#define MEM_FSRM (1 << 2)
+
+/* Without Fast Short REP MOV, the start-up cost of the string
+ * instructions is only worth it for large enough sizes. */
+#define MEM_REP_MIN_SIZE 128
+#define MEM_NT_THRESHOLD (4 * 1024 * 1024)
+
+static UINT32 mem_features;
+
+static UINT32 get_mem_features(void)
+{
+        UINT32 reg[4];
+
+        if (mem_features & MEM_FEATURES_READ)
+                return mem_features;
+
+        mem_features = MEM_FEATURES_READ;
+        cpuid(0, reg);
+        if (reg[0] < CPUID_EXT_FEATURES_LEAF)
+                return mem_features;
+
+        cpuid_count(CPUID_EXT_FEATURES_LEAF, 0, reg);
+        if (reg[1] & CPUID_EBX_ERMS)
+                mem_features |= MEM_ERMS;
+        if (reg[3] & CPUID_EDX_FSRM)
+                mem_features |= MEM_FSRM;
+
+        return mem_features;
+}
+
+static BOOLEAN use_rep_string(size_t n)
+{
+        UINT32 features = get_mem_features();
+
+        return (features & MEM_FSRM) ||
+                ((features & MEM_ERMS) && n >= MEM_REP_MIN_SIZE);
+}
+
+static inline void rep_movsb(void *dest, const void *src, size_t n)
+{
+        asm volatile("rep movsb"
+                     : "+D" (dest), "+S" (src), "+c" (n)
+                     : : "memory");
+}
+
+static inline void rep_stosb(void *dest, int c, size_t n)
+{
+        asm volatile("rep stosb"
+                     : "+D" (dest), "+c" (n)
+                     : "a" (c) : "memory");
+}
+
+#ifdef __SSE2__
+static void copy_sse2(UINT8 *d, const UINT8 *s, size_t n, BOOLEAN nt)
+{
+        __m128i x0, x1, x2, x3;
+
+        for (; n && ((UINTN)d & 15); n--)
+                *d++ = *s++;
+
+        for (; n >= 64; n -= 64, d += 64, s += 64) {
+                x0 = _mm_loadu_si128((const __m128i *)s);
+                x1 = _mm_loadu_si128((const __m128i *)(s + 16));
+                x2 = _mm_loadu_si128((const __m128i *)(s + 32));
+                x3 = _mm_loadu_si128((const __m128i *)(s + 48));
+                if (nt) {
+                        _mm_stream_si128((__m128i *)d, x0);
+                        _mm_stream_si128((__m128i *)(d + 16), x1);
+                        _mm_stream_si128((__m128i *)(d + 32), x2);
+                        _mm_stream_si128((__m128i *)(d + 48), x3);
+                } else {
+                        _mm_store_si128((__m128i *)d, x0);
+                        _mm_store_si128((__m128i *)(d + 16), x1);
+                        _mm_store_si128((__m128i *)(d + 32), x2);
+                        _mm_store_si128((__m128i *)(d + 48), x3);
+                }
+        }
+        if (nt)
+                _mm_sfence();
+
+        for (; n >= 16; n -= 16, d += 16, s += 16)
+                _mm_store_si128((__m128i *)d,
+                                _mm_loadu_si128((const __m128i *)s));
+
+        for (; n; n--)
+                *d++ = *s++;
+}
+
+static void set_sse2(UINT8 *d, int c, size_t n)
+{
+        __m128i x = _mm_set1_epi8((char)c);
+
+        for (; n && ((UINTN)d & 15); n--)
+                *d++ = (UINT8)c;
+
+        for (; n >= 64; n -= 64, d += 64) {
+                _mm_store_si128((__m128i *)d, x);
+                _mm_store_si128((__m128i *)(d + 16), x);
+                _mm_store_si128((__m128i *)(d + 32), x);
+                _mm_store_si128((__m128i *)(d + 48), x);
+        }
+
+        for (; n >= 16; n -= 16, d += 16)
+                _mm_store_si128((__m128i *)d, x);
+
+        for (; n; n--)
+                *d++ = (UINT8)c;
+}
+
+static int compare_sse2(const UINT8 *a, const UINT8 *b, size_t n)
+{
+        UINT32 mask;
+        UINTN i;
+
+        for (; n >= 16; n -= 16, a += 16, b += 16) {
+                mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)a),
+                                                        _mm_loadu_si128((const __m128i *)b)));
+                if (mask != 0xffff) {
+                        i = __builtin_ctz(~mask);
+                        return a[i] - b[i];
+                }
+        }
+
+        for (; n; n--, a++, b++)
+                if (*a != *b)
+                        return *a - *b;
+
+        return 0;
+}
+#endif
+
 int memcmp(const void *s1, const void *s2, size_t n)
 {
+#ifdef __SSE2__
+        return compare_sse2(s1, s2, n);
+#else
         return CompareMem(s1, s2, n);
+#endif
 }
 
 void *memset(void *s, int c, size_t n)
 {
-        SetMem(s, n, (UINT8)c);
+        if (use_rep_string(n))
+                rep_stosb(s, c, n);
+        else
+#ifdef __SSE2__
+                set_sse2(s, c, n);
+#else
+                SetMem(s, n, (UINT8)c);
+#endif
         return s;
 }
 
 void *memcpy(void *dest, const void *source, size_t count)
 {
-        CopyMem(dest, source, (UINTN)count);
+#ifdef __SSE2__
+        if (count >= MEM_NT_THRESHOLD) {
+                copy_sse2(dest, source, count, TRUE);
+                return dest;
+        }
+#endif
+        if (use_rep_string(count))
+                rep_movsb(dest, source, count);
+        else
+#ifdef __SSE2__
+                copy_sse2(dest, source, count, FALSE);
+#else
+                CopyMem(dest, source, (UINTN)count);
+#endif
         return dest;
 }
 
@@ -1064,25 +1236,30 @@ UINT64 efi_time_to_ctime(EFI_TIME *time)
                 (UINT64)time->Second;
 }
 
-VOID cpuid(UINT32 op, UINT32 reg[4])
+VOID cpuid_count(UINT32 op, UINT32 subop, UINT32 reg[4])
 {
 #if __LP64__
         asm volatile("xchg{q}\t{%%}rbx, %q1\n\t"
                      "cpuid\n\t"
                      "xchg{q}\t{%%}rbx, %q1\n\t"
                      : "=a" (reg[0]), "=&r" (reg[1]), "=c" (reg[2]), "=d" (reg[3])
-                     : "a" (op));
+                     : "a" (op), "c" (subop));
 #else
         asm volatile("pushl %%ebx      \n\t" /* save %ebx */
                      "cpuid            \n\t"
                      "movl %%ebx, %1   \n\t" /* save what cpuid just put in %ebx */
                      "popl %%ebx       \n\t" /* restore the old %ebx */
                      : "=a"(reg[0]), "=r"(reg[1]), "=c"(reg[2]), "=d"(reg[3])
-                     : "a"(op)
+                     : "a"(op), "c"(subop)
                      : "cc");
 #endif
 }
 
+VOID cpuid(UINT32 op, UINT32 reg[4])
+{
+        cpuid_count(op, 0, reg);
+}
+
 EFI_STATUS generate_random_numbers(CHAR8 *data, UINTN size)
 {
 #define RDRAND_SUPPORT (1 << 30)
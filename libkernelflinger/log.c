@@ -50,6 +50,25 @@ static SERIAL_IO_INTERFACE *serial;
 static CHAR16 buf16[BUFFER_SIZE];
 static CHAR8 buf8[BUFFER_SIZE];
 
+/* Serial output is decoupled from the log producers: messages are
+ * appended to a single-producer/single-consumer ring which is drained
+ * to the serial port by a periodic timer event, at idle points and
+ * fully before leaving the boot services or halting the system.  The
+ * ring indexes are free running, the ring size must be a power of
+ * two. */
+#define SERIAL_RING_SIZE	(64 * 1024)
+#define SERIAL_DRAIN_PERIOD	100000	/* 10 ms in 100 ns units */
+#define SERIAL_DRAIN_MAX	64	/* bytes per timer tick */
+#define SERIAL_IDLE_DRAIN_MAX	512	/* bytes per idle point */
+
+static CHAR8 serial_ring[SERIAL_RING_SIZE];
+static volatile UINTN ring_head, ring_tail;
+static volatile BOOLEAN producing, draining;
+static UINTN dropped, dropped_reported;
+static EFI_EVENT drain_event;
+
+#define compiler_barrier() asm volatile("" ::: "memory")
+
 #define LOG_BUF_SIZE 4096
 static CHAR8 log_buf[LOG_BUF_SIZE];
 static UINTN pos, last_pos;
@@ -117,6 +136,108 @@ static void log_append_to_buffer(CHAR8 *msg, UINTN length)
 	pos += length;
 }
 
+static void serial_ring_push(CHAR8 *msg, UINTN length)
+{
+	UINTN head = ring_head, offset, len;
+
+	/* Nested producer, typically from an event notification
+	 * function which interrupted another log call. */
+	if (producing) {
+		dropped += length;
+		return;
+	}
+	producing = TRUE;
+
+	if (length > SERIAL_RING_SIZE - (head - ring_tail)) {
+		dropped += length;
+		goto out;
+	}
+
+	offset = head & (SERIAL_RING_SIZE - 1);
+	len = min(length, SERIAL_RING_SIZE - offset);
+	memcpy(serial_ring + offset, msg, len);
+	memcpy(serial_ring, msg + len, length - len);
+
+	compiler_barrier();
+	ring_head = head + length;
+
+out:
+	producing = FALSE;
+}
+
+static void serial_report_drops(void)
+{
+	CHAR16 msg16[64];
+	CHAR8 msg8[64];
+	UINTN length;
+
+	length = SPrint(msg16, sizeof(msg16),
+			L"[log: %d bytes dropped]\n",
+			dropped - dropped_reported) + 1;
+	if (EFI_ERROR(str_to_stra(msg8, msg16, length)))
+		return;
+
+	length--;
+	if (!EFI_ERROR(uefi_call_wrapper(serial->Write, 3, serial,
+					 &length, msg8)))
+		dropped_reported = dropped;
+}
+
+/* Write up to MAX bytes of the ring to the serial port. */
+static void serial_drain(UINTN max)
+{
+	UINTN tail, offset, len;
+
+	if (!serial || draining)
+		return;
+	draining = TRUE;
+
+	if (dropped != dropped_reported)
+		serial_report_drops();
+
+	for (tail = ring_tail; ring_head != tail && max; max -= len) {
+		offset = tail & (SERIAL_RING_SIZE - 1);
+		len = min(ring_head - tail, SERIAL_RING_SIZE - offset);
+		len = min(len, max);
+		if (EFI_ERROR(uefi_call_wrapper(serial->Write, 3, serial,
+						&len, serial_ring + offset)))
+			break;
+
+		tail += len;
+		compiler_barrier();
+		ring_tail = tail;
+	}
+
+	draining = FALSE;
+}
+
+static void EFIAPI serial_drain_notify(__attribute__((__unused__)) EFI_EVENT event,
+				       __attribute__((__unused__)) void *context)
+{
+	serial_drain(SERIAL_DRAIN_MAX);
+}
+
+void log_drain(void)
+{
+	serial_drain(SERIAL_IDLE_DRAIN_MAX);
+}
+
+void log_flush(void)
+{
+	serial_drain(SERIAL_RING_SIZE);
+}
+
+void log_exit(void)
+{
+	log_flush();
+	if (!drain_event)
+		return;
+
+	uefi_call_wrapper(BS->SetTimer, 3, drain_event, TimerCancel, 0);
+	uefi_call_wrapper(BS->CloseEvent, 1, drain_event);
+	drain_event = NULL;
+}
+
 static EFI_STATUS serial_init()
 {
 	EFI_STATUS ret;
@@ -137,6 +258,24 @@ static EFI_STATUS serial_init()
 	if (EFI_ERROR(ret))
 		return ret;
 
+	/* Without a periodic drain, the serial output stays
+	 * synchronous. */
+	ret = uefi_call_wrapper(BS->CreateEvent, 5,
+				EVT_TIMER | EVT_NOTIFY_SIGNAL,
+				TPL_CALLBACK, serial_drain_notify,
+				NULL, &drain_event);
+	if (EFI_ERROR(ret)) {
+		drain_event = NULL;
+		return EFI_SUCCESS;
+	}
+
+	ret = uefi_call_wrapper(BS->SetTimer, 3, drain_event,
+				TimerPeriodic, SERIAL_DRAIN_PERIOD);
+	if (EFI_ERROR(ret)) {
+		uefi_call_wrapper(BS->CloseEvent, 1, drain_event);
+		drain_event = NULL;
+	}
+
 	return EFI_SUCCESS;
 }
 
@@ -154,8 +293,9 @@ void vlog(const CHAR16 *fmt, va_list args)
 
 	/* Drop the NUL termination character */
 	length--;
-	if (EFI_ERROR(uefi_call_wrapper(serial->Write, 3, serial, &length, buf8)))
-		return;
+	serial_ring_push(buf8, length);
+	if (!drain_event)
+		log_flush();
 
 	log_append_to_buffer(buf8, length);
 }
@@ -41,8 +41,17 @@
 #define NVME_GENERIC_TIMEOUT                  (EFI_TIMER_PERIOD_SECONDS(5))
 #define NVME_MAX_WRITE_ZEROS_BLOCKS           0x10000
 
+#define NVME_CTRL_ONCS_DSM                    (1 << 2)
 #define NVME_CTRL_ONCS_WRITE_ZEROES           (1 << 3)
 
+/* Dataset Management deallocate, up to 256 ranges per command */
+#define NVME_CMD_DSM              0x09
+#define NVME_DSM_ATTR_DEALLOCATE  (1 << 2)
+#define NVME_DSM_MAX_RANGES       256
+#define NVME_DSM_MAX_RANGE_BLOCKS 0xFFFFFFFF
+#define NVME_DLFEAT_READ_MASK     0x07
+#define NVME_DLFEAT_READ_ZEROES   0x01
+
 #define NVME_RW_FUA               (1 << 14)
 #define NVME_CMD_WRITE_ZEROS      0x08
 #define NVME_CONTROLLER_ID        0
@@ -57,6 +66,12 @@ typedef struct {
 	UINT64                          NamespaceUuid;
 } NVME_NAMESPACE_DEVICE_PATH;
 
+typedef struct {
+	UINT32                          Cattr;
+	UINT32                          Nlb;
+	UINT64                          Slba;
+} NVME_DSM_RANGE;
+
 
 EFI_STATUS get_nvme_passthru(EFI_DEVICE_PATH *FilePath, VOID **Interface)
 {
@@ -87,14 +102,12 @@ static NVME_NAMESPACE_DEVICE_PATH *get_nvme_device_path(EFI_DEVICE_PATH *p)
 	return NULL;
 }
 
-static BOOLEAN is_nvme_supported_write_zeros(EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *NvmePassthru)
+static EFI_STATUS nvme_identify(EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *NvmePassthru,
+				UINT32 NamespaceId, UINT32 Cns, VOID *Data, UINT32 Size)
 {
-	NVME_ADMIN_CONTROLLER_DATA CtrlData;
-
 	EFI_NVM_EXPRESS_PASS_THRU_COMMAND_PACKET CommandPacket;
 	EFI_NVM_EXPRESS_COMMAND                  Command;
 	EFI_NVM_EXPRESS_COMPLETION               Completion;
-	EFI_STATUS                               Status;
 
 	ZeroMem(&CommandPacket, sizeof(EFI_NVM_EXPRESS_PASS_THRU_COMMAND_PACKET));
 	ZeroMem(&Command, sizeof(EFI_NVM_EXPRESS_COMMAND));
@@ -105,27 +118,103 @@ static BOOLEAN is_nvme_supported_write_zeros(EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL
 	/* According to Nvm Express 1.1 spec Figure 38, When not used, the field shall be cleared to 0h.
 	 * For the Identify command, the Namespace Identifier is only used for the Namespace data structure.
 	 */
-	Command.Nsid        = 0;
+	Command.Nsid        = NamespaceId;
 
 	CommandPacket.NvmeCmd        = &Command;
 	CommandPacket.NvmeCompletion = &Completion;
-	CommandPacket.TransferBuffer = (VOID *) &CtrlData;
-	CommandPacket.TransferLength = sizeof(NVME_ADMIN_CONTROLLER_DATA);
+	CommandPacket.TransferBuffer = Data;
+	CommandPacket.TransferLength = Size;
 	CommandPacket.CommandTimeout = NVME_GENERIC_TIMEOUT;
 	CommandPacket.QueueType      = NVME_ADMIN_QUEUE;
 
-	/* Set bit 0 (Cns bit) to 1 to identify a controller */
-	Command.Cdw10                = 1;
+	/* Cns is 1 to identify a controller, 0 to identify a namespace */
+	Command.Cdw10                = Cns;
 	Command.Flags                = CDW10_VALID;
 
-	Status = NvmePassthru->PassThru(NvmePassthru, NVME_CONTROLLER_ID, &CommandPacket, NULL);
+	return NvmePassthru->PassThru(NvmePassthru, NVME_CONTROLLER_ID, &CommandPacket, NULL);
+}
+
+static UINT16 nvme_get_oncs(EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *NvmePassthru)
+{
+	NVME_ADMIN_CONTROLLER_DATA CtrlData;
+	EFI_STATUS                 Status;
+
+	Status = nvme_identify(NvmePassthru, 0, 1, &CtrlData, sizeof(CtrlData));
+	if (EFI_ERROR(Status))
+		return 0;
+
+	return CtrlData.Oncs;
+}
+
+/* Deallocated blocks are only guaranteed to read as zeros if the
+ * namespace says so in the DLFEAT field.
+ */
+static BOOLEAN is_nvme_deallocate_zeroing(EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *NvmePassthru,
+					  UINT32 NamespaceId)
+{
+	NVME_ADMIN_NAMESPACE_DATA NsData;
+	EFI_STATUS                Status;
+
+	Status = nvme_identify(NvmePassthru, NamespaceId, 0, &NsData, sizeof(NsData));
 	if (EFI_ERROR(Status))
 		return FALSE;
 
-	if (CtrlData.Oncs & NVME_CTRL_ONCS_WRITE_ZEROES)
-		return TRUE;
+	return (NsData.Dlfeat & NVME_DLFEAT_READ_MASK) == NVME_DLFEAT_READ_ZEROES;
+}
 
-	return FALSE;
+static EFI_STATUS nvme_deallocate_blocks(
+	EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *NvmePassthru,
+	UINT32 NamespaceId,
+	EFI_LBA start,
+	EFI_LBA end
+)
+{
+	EFI_NVM_EXPRESS_PASS_THRU_COMMAND_PACKET CommandPacket;
+	EFI_NVM_EXPRESS_COMMAND                  Command;
+	EFI_NVM_EXPRESS_COMPLETION               Completion;
+	EFI_STATUS                               Status = EFI_SUCCESS;
+	NVME_DSM_RANGE                           *Ranges;
+	UINT32                                   nr, num;
+
+	Ranges = AllocatePool(NVME_DSM_MAX_RANGES * sizeof(*Ranges));
+	if (!Ranges)
+		return EFI_OUT_OF_RESOURCES;
+
+	while (start <= end) {
+		for (nr = 0; nr < NVME_DSM_MAX_RANGES && start <= end; nr++) {
+			num = min(end - start + 1, (EFI_LBA)NVME_DSM_MAX_RANGE_BLOCKS);
+			Ranges[nr].Cattr = 0;
+			Ranges[nr].Nlb = num;
+			Ranges[nr].Slba = start;
+			start += num;
+		}
+
+		ZeroMem(&CommandPacket, sizeof(EFI_NVM_EXPRESS_PASS_THRU_COMMAND_PACKET));
+		ZeroMem(&Command, sizeof(EFI_NVM_EXPRESS_COMMAND));
+		ZeroMem(&Completion, sizeof(EFI_NVM_EXPRESS_COMPLETION));
+
+		CommandPacket.NvmeCmd        = &Command;
+		CommandPacket.NvmeCompletion = &Completion;
+		CommandPacket.TransferBuffer = Ranges;
+		CommandPacket.TransferLength = nr * sizeof(*Ranges);
+		CommandPacket.CommandTimeout = NVME_GENERIC_TIMEOUT;
+		CommandPacket.QueueType      = NVME_IO_QUEUE;
+
+		Command.Cdw0.Opcode = NVME_CMD_DSM;
+		Command.Nsid        = NamespaceId;
+		Command.Cdw10       = nr - 1;
+		Command.Cdw11       = NVME_DSM_ATTR_DEALLOCATE;
+		Command.Flags       = CDW10_VALID | CDW11_VALID;
+
+		Status = NvmePassthru->PassThru(NvmePassthru, NamespaceId, &CommandPacket, NULL);
+		if (EFI_ERROR(Status)) {
+			debug(L"NvmePassthru(NVME_CMD_DSM) failed, ret = %d", Status);
+			break;
+		}
+	}
+
+	FreePool(Ranges);
+	return Status;
 }
 
 EFI_STATUS nvme_erase_blocks_impl(
@@ -187,6 +276,7 @@ static EFI_STATUS nvme_erase_blocks(
 	EFI_STATUS ret;
 	UINT32 NamespaceId = 0;
 	UINT32 num;
+	UINT16 oncs;
 	EFI_LBA blk;
 
 	debug(L"nvme_erase_blocks: 0x%X blocks", end - start + 1);
@@ -200,18 +290,32 @@ static EFI_STATUS nvme_erase_blocks(
 	if (EFI_ERROR(ret))
 		return ret;
 
-	if (!is_nvme_supported_write_zeros(NvmePassthru))
+	oncs = nvme_get_oncs(NvmePassthru);
+	if (!(oncs & (NVME_CTRL_ONCS_DSM | NVME_CTRL_ONCS_WRITE_ZEROES)))
 		return EFI_UNSUPPORTED;
 
 	nvme_dp = get_nvme_device_path(dp);
 	ret = NvmePassthru->GetNamespace(NvmePassthru, (EFI_DEVICE_PATH_PROTOCOL *)nvme_dp, &NamespaceId);
 	debug(L"GetNamespace() ret=%d, NamespaceId=%d", ret, NamespaceId);
 
-	for (blk = start;  blk < end; ) {
+	/* A single deallocate command covers up to 256 ranges of 4G
+	 * blocks where write zeroes covers 64K blocks.
+	 */
+	if ((oncs & NVME_CTRL_ONCS_DSM) &&
+	    is_nvme_deallocate_zeroing(NvmePassthru, NamespaceId)) {
+		ret = nvme_deallocate_blocks(NvmePassthru, NamespaceId, start, end);
+		if (!EFI_ERROR(ret))
+			return ret;
+	}
+
+	if (!(oncs & NVME_CTRL_ONCS_WRITE_ZEROES))
+		return EFI_UNSUPPORTED;
+
+	for (blk = start;  blk <= end; ) {
 		if (end - blk >= NVME_MAX_WRITE_ZEROS_BLOCKS)
 			num = NVME_MAX_WRITE_ZEROS_BLOCKS;
 		else
-			num = end - blk;
+			num = end - blk + 1;
 
 		ret = nvme_erase_blocks_impl(NvmePassthru, NamespaceId, blk, num);
 		if (EFI_ERROR(ret)) {
@@ -91,23 +91,40 @@
 #define DIR_ATTRIBUTES	(1)			/* Directory is present */
 #define MAX_MEMMAP_SZ	(128 * PAGE_SIZE)
 #define MIN_MEMMAP_SZ	(32 * PAGE_SIZE)
+#define NR_WINDOWS	4
 
+/*
+ * A miss maps the whole 32 bits address space region as a single
+ * window when there is nothing worth keeping: no window is in use or
+ * the caller is walking the memory sequentially.  Otherwise, the
+ * region is split in NR_WINDOWS windows which are recycled in least
+ * recently used order so that interleaved accesses to a few memory
+ * regions do not lead to remap each time.
+ */
 static struct memmap_context {
 	BOOLEAN initialized;
 
-	/* 32 bits address space region used to map the DST memory
-	 * region. */
+	/* 32 bits address space region used to map the memory
+	 * regions above 4G. */
 	struct {
 		UINT32 start;
 		UINT32 end;
 	} src;
 
-	struct {
-		EFI_PHYSICAL_ADDRESS start;
-		EFI_PHYSICAL_ADDRESS end;
-	} dst;
-
 	UINT32 size;
+	UINT32 window_sz;
+	UINT32 clock;
+	BOOLEAN split;
+
+	/* End of the last mapping returned by pae_map(). */
+	EFI_PHYSICAL_ADDRESS next;
+
+	struct window {
+		UINT32 src;
+		UINT32 size;
+		EFI_PHYSICAL_ADDRESS dst; /* 0 if the window is unused */
+		UINT32 last_use;
+	} windows[NR_WINDOWS];
 } ctx;
 
 /* Page table hierarchy. */
@@ -211,6 +228,10 @@ EFI_STATUS pae_init(CHAR8 *entries, UINTN nr_entries, UINTN entry_sz)
 	if (EFI_ERROR(ret))
 		return ret;
 
+	ctx.window_sz = ALIGN_DOWN(ctx.size / NR_WINDOWS, PAGE_SIZE);
+	ctx.windows[0].src = ctx.src.start;
+	ctx.windows[0].size = ctx.size;
+
 	init_directory();
 
 	/* Set bit 5 in CR4 to enable PAE. */
@@ -229,30 +250,90 @@ EFI_STATUS pae_init(CHAR8 *entries, UINTN nr_entries, UINTN entry_sz)
 	return EFI_SUCCESS;
 }
 
-static EFI_STATUS memmap(EFI_PHYSICAL_ADDRESS addr)
+static struct window *lookup_window(EFI_PHYSICAL_ADDRESS addr)
 {
-	UINT32 src;
+	struct window *w;
 
-	if (!ctx.initialized)
-		return EFI_NOT_READY;
+	for (w = ctx.windows; w < ctx.windows + NR_WINDOWS; w++)
+		if (w->dst && addr >= w->dst && addr - w->dst < w->size)
+			return w;
 
-	addr &= ~(PAGE_SIZE - 1);
-	ctx.dst.start = addr;
-	for (src = ctx.src.start; src < ctx.src.end; src += PAGE_SIZE) {
-		directory[src >> PAGE_BITS] = addr | PAGE_ATTRIBUTES;
-		addr += PAGE_SIZE;
+	return NULL;
+}
+
+/* Split the whole region window in NR_WINDOWS windows.  The current
+ * mapping is preserved and the window holding the last accessed
+ * address becomes the most recently used one. */
+static void split_windows(void)
+{
+	struct window whole = ctx.windows[0], *w;
+	UINT32 offset;
+
+	for (w = ctx.windows, offset = 0; w < ctx.windows + NR_WINDOWS;
+	     w++, offset += ctx.window_sz) {
+		w->src = whole.src + offset;
+		w->size = ctx.window_sz;
+		w->dst = whole.dst ? whole.dst + offset : 0;
+		w->last_use = whole.last_use - 1;
 	}
-	ctx.dst.end = addr;
 
-	/* Reload page directory. */
-	asm volatile("movl %%eax, %%cr3" :: "a" (&dir_ptr));
+	w = lookup_window(ctx.next - 1);
+	if (w)
+		w->last_use = whole.last_use;
 
-	return EFI_SUCCESS;
+	ctx.split = TRUE;
+}
+
+static void merge_windows(void)
+{
+	struct window *w;
+
+	for (w = ctx.windows; w < ctx.windows + NR_WINDOWS; w++)
+		w->dst = 0;
+
+	ctx.windows[0].src = ctx.src.start;
+	ctx.windows[0].size = ctx.size;
+	ctx.split = FALSE;
+}
+
+static BOOLEAN nothing_to_keep(EFI_PHYSICAL_ADDRESS addr)
+{
+	struct window *w;
+
+	if (addr == ctx.next)
+		return TRUE;
+
+	for (w = ctx.windows; w < ctx.windows + NR_WINDOWS; w++)
+		if (w->dst)
+			return FALSE;
+
+	return TRUE;
+}
+
+/* Map the window W to the memory region starting at ADDR.  Only the
+ * directory entries which change are written and their TLB entries
+ * flushed instead of reloading the whole page directory. */
+static void memmap(struct window *w, EFI_PHYSICAL_ADDRESS addr)
+{
+	EFI_PHYSICAL_ADDRESS entry;
+	UINT32 src;
+
+	addr &= ~(PAGE_SIZE - 1);
+	w->dst = addr;
+	for (src = w->src; src < w->src + w->size; src += PAGE_SIZE) {
+		entry = addr | PAGE_ATTRIBUTES;
+		addr += PAGE_SIZE;
+		if (directory[src >> PAGE_BITS] == entry)
+			continue;
+
+		directory[src >> PAGE_BITS] = entry;
+		asm volatile("invlpg (%0)" :: "r" (src) : "memory");
+	}
 }
 
 EFI_STATUS pae_map(EFI_PHYSICAL_ADDRESS addr, unsigned char **to, UINT64 *len)
 {
-	EFI_STATUS ret;
+	struct window *w, *lru;
 
 	if (addr <= UINT32_MAX) {
 		*to = (unsigned char *)(UINT32)addr;
@@ -260,17 +341,32 @@ EFI_STATUS pae_map(EFI_PHYSICAL_ADDRESS addr, unsigned char **to, UINT64 *len)
 			*len = UINT32_MAX;
 		if (addr > UINT32_MAX - *len)
 			*len = UINT32_MAX - addr;
-
-		if (addr + *len <= ctx.dst.start || addr >= ctx.dst.end)
-			return EFI_SUCCESS;
+		return EFI_SUCCESS;
 	}
 
-	ret = memmap(addr);
-	if (EFI_ERROR(ret))
-		return ret;
+	if (!ctx.initialized)
+		return EFI_NOT_READY;
+
+	w = lookup_window(addr);
+	if (!w && nothing_to_keep(addr)) {
+		if (ctx.split)
+			merge_windows();
+		w = ctx.windows;
+		memmap(w, addr);
+	} else if (!w) {
+		if (!ctx.split)
+			split_windows();
+		for (w = lru = ctx.windows; w < ctx.windows + NR_WINDOWS; w++)
+			if (w->last_use < lru->last_use)
+				lru = w;
+		w = lru;
+		memmap(w, addr);
+	}
+	w->last_use = ++ctx.clock;
 
-	*to = (unsigned char *)(UINT32)ctx.src.start + (addr - ctx.dst.start);
-	*len = min(*len, ctx.size - (addr - ctx.dst.start));
+	*to = (unsigned char *)w->src + (addr - w->dst);
+	*len = min(*len, w->size - (addr - w->dst));
+	ctx.next = addr + *len;
 
 	return EFI_SUCCESS;
 }
@@ -47,6 +47,7 @@
 #include "lib.h"
 #include "vars.h"
 #include "life_cycle.h"
+#include "trace.h"
 
 #ifdef USE_IPP_SHA256
 #include "sha256_ipps.h"
@@ -237,9 +238,11 @@ static EFI_STATUS check_bootimage(CHAR8 *bootimage, UINTN imgsize,
         if (!rsa)
                 goto free_pkey;
 
+        TRACE_BEGIN(TRACE_RSA_VERIFY, 0);
         rsa_ret = RSA_verify(get_rsa_verify_nid(sig->id.nid),
                              hash, hash_sz, sig->signature,
                              sig->signature_len, rsa);
+        TRACE_END(TRACE_RSA_VERIFY, 0);
         if (rsa_ret == 1)
                 ret = EFI_SUCCESS;
         else
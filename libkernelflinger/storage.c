@@ -33,6 +33,7 @@
 #include <log.h>
 #include <lib.h>
 #include "storage.h"
+#include "bufpool.h"
 #include "gpt.h"
 #include "pci.h"
 #include "protocol/EraseBlock.h"
@@ -258,22 +259,42 @@ EFI_STATUS storage_check_logical_unit(EFI_DEVICE_PATH *p, logical_unit_t log_uni
 	return cur_storage->check_logical_unit(p, log_unit);
 }
 
+static void report_erase_rate(EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end,
+			      UINT64 start_ms)
+{
+	UINT64 size_mb = (end - start + 1) * bio->Media->BlockSize / (1024 * 1024);
+	UINT64 time_ms = boottime_in_msec() - start_ms;
+
+	info(L"Erased %ld MB in %ld ms (%ld MB/s)", size_mb, time_ms,
+	     time_ms ? size_mb * 1000 / time_ms : size_mb * 1000);
+}
+
 EFI_STATUS storage_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end)
 {
 	EFI_STATUS ret;
+	UINT64 start_ms;
 
 	if (!valid_storage())
 		return EFI_UNSUPPORTED;
 
+	start_ms = boottime_in_msec();
+
 	/* check if underlying BIOS supports ERASE_BLOCK_PROTOCOL
 	 * If so use ERASE_BLOCK_PROTOCOL to erase blocks.
 	 */
 	ret = media_erase_blocks(handle, bio, start, end);
-	if (ret == EFI_SUCCESS || ret != EFI_UNSUPPORTED)
+	if (ret != EFI_UNSUPPORTED) {
+		if (!EFI_ERROR(ret))
+			report_erase_rate(bio, start, end, start_ms);
 		return ret;
+	}
 
 	debug(L"ERASE_BLOCK_PROTOCOL not supported");
-	return cur_storage->erase_blocks(handle, bio, start, end);
+	ret = cur_storage->erase_blocks(handle, bio, start, end);
+	if (!EFI_ERROR(ret))
+		report_erase_rate(bio, start, end, start_ms);
+
+	return ret;
 }
 
 #define PRINT_INTERVAL (3)
@@ -295,7 +316,7 @@ EFI_STATUS fill_with(EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end,
 
 	info_n(L"Erasing ");
 	sec = boottime_in_msec() / 1000;
-	for (lba = start; lba <= end; lba += pattern_blocks) {
+	for (lba = start; lba <= end; lba += size) {
 		if (lba + pattern_blocks > end + 1)
 			size = end - lba + 1;
 		else
@@ -303,6 +324,13 @@ EFI_STATUS fill_with(EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end,
 
 		ret = uefi_call_wrapper(bio->WriteBlocks, 5, bio, bio->Media->MediaId, lba,
 				bio->Media->BlockSize * size, pattern);
+		if (ret == EFI_BAD_BUFFER_SIZE && pattern_blocks > 1) {
+			/* The transfer is larger than what the device
+			   accepts, use a shorter part of the pattern. */
+			pattern_blocks /= 2;
+			size = 0;
+			continue;
+		}
 		if (EFI_ERROR(ret)) {
 			efi_perror(ret, L"Failed to erase block %ld", lba);
 			return ret;
@@ -331,21 +359,32 @@ EFI_STATUS fill_with(EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end,
 	return EFI_SUCCESS;
 }
 
+/* Largest zero buffer used to fill the blocks which cannot be erased.
+   Fewer and larger WriteBlocks() calls are much faster.  */
+#define FILL_ZERO_MAX_SIZE (16 * 1024 * 1024)
+
 EFI_STATUS fill_zero(EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end)
 {
 	EFI_STATUS ret;
 	VOID *emptyblock;
-	VOID *aligned_emptyblock;
-
-	ret = alloc_aligned(&emptyblock, &aligned_emptyblock,
-			    bio->Media->BlockSize * N_BLOCK,
-			    bio->Media->IoAlign);
+	UINTN blocks;
+
+	blocks = min((EFI_LBA)FILL_ZERO_MAX_SIZE / bio->Media->BlockSize,
+		     end - start + 1);
+	for (;;) {
+		ret = bufpool_get(bio->Media->BlockSize * blocks,
+				  bio->Media->IoAlign, &emptyblock);
+		if (ret != EFI_OUT_OF_RESOURCES || blocks == 1)
+			break;
+		blocks /= 2;
+	}
 	if (EFI_ERROR(ret))
 		return ret;
 
-	ret = fill_with(bio, start, end, aligned_emptyblock, N_BLOCK);
+	memset(emptyblock, 0, bio->Media->BlockSize * blocks);
+	ret = fill_with(bio, start, end, emptyblock, blocks);
 
-	FreePool(emptyblock);
+	bufpool_put(emptyblock);
 
 	return ret;
 }
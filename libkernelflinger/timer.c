@@ -35,6 +35,7 @@
 #include <efilib.h>
 #include <lib.h>
 #include "timer.h"
+#include "trace.h"
 
 #define BOOT_STAGE_FIRMWARE "FWS"
 #define BOOT_STAGE_OSLOADER_INIT "LIS"
@@ -68,41 +69,140 @@ __RDMSR (unsigned idx)
 	return msr.val;
 }
 
-static uint64_t __attribute__((unused,always_inline))
-__RDTSC (void)
+#define CPUID_VENDOR_LEAF		0x0
+#define CPUID_FEATURES_LEAF		0x1
+#define CPUID_TSC_LEAF			0x15
+#define CPUID_FREQ_LEAF			0x16
+#define CPUID_HYPERVISOR_LEAF		0x40000000
+#define CPUID_HYPERVISOR_TIMING_LEAF	0x40000010
+
+#define CPUID_HYPERVISOR_PRESENT	(1U << 31)
+#define CPUID_BASE_FREQ_MASK		0xffff
+
+#define MSR_PLATFORM_INFO		0xce
+
+#define CALIBRATION_STALL_MS		10
+
+/* "GenuineIntel" */
+#define INTEL_EBX			0x756e6547
+#define INTEL_EDX			0x49656e69
+#define INTEL_ECX			0x6c65746e
+
+static uint32_t tsc_khz;
+
+static uint32_t tsc_khz_from_cpuid(BOOLEAN hypervisor)
 {
-	uint32_t lo, hi;
+	uint32_t reg[4], max_leaf;
+
+	/* Hypervisors report the frequency of the virtualized TSC
+	   in the generic timing leaf.  */
+	if (hypervisor) {
+		cpuid(CPUID_HYPERVISOR_LEAF, reg);
+		if (reg[0] >= CPUID_HYPERVISOR_TIMING_LEAF) {
+			cpuid(CPUID_HYPERVISOR_TIMING_LEAF, reg);
+			if (reg[0])
+				return reg[0];
+		}
+	}
+
+	cpuid(CPUID_VENDOR_LEAF, reg);
+	max_leaf = reg[0];
+
+	/* EAX: denominator, EBX: numerator, ECX: crystal in Hz */
+	if (max_leaf >= CPUID_TSC_LEAF) {
+		cpuid(CPUID_TSC_LEAF, reg);
+		if (reg[0] && reg[1] && reg[2])
+			return DivU64x32(MultU64x32(reg[2], reg[1]),
+					 reg[0] * 1000, NULL);
+	}
+
+	/* EAX: processor base frequency in MHz */
+	if (max_leaf >= CPUID_FREQ_LEAF) {
+		cpuid(CPUID_FREQ_LEAF, reg);
+		if (reg[0] & CPUID_BASE_FREQ_MASK)
+			return (reg[0] & CPUID_BASE_FREQ_MASK) * 1000;
+	}
 
-	asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
-	return (uint64_t) hi << 32 | lo;
+	return 0;
 }
 
-uint32_t get_cpu_freq(void)
+static BOOLEAN is_intel_cpu(void)
+{
+	uint32_t reg[4];
+
+	cpuid(CPUID_VENDOR_LEAF, reg);
+	return reg[1] == INTEL_EBX && reg[3] == INTEL_EDX && reg[2] == INTEL_ECX;
+}
+
+static uint32_t tsc_khz_from_msr(void)
 {
-	uint32_t cpu_freq;
-	uint32_t max_nb_ratio;
 	msr_t platform_info;
+	uint32_t max_nb_ratio;
 
-	platform_info.val = __RDMSR (0xce);
+	platform_info.val = __RDMSR(MSR_PLATFORM_INFO);
 	max_nb_ratio = (platform_info.lo >> 8) & 0xff;
-	cpu_freq = 100 * max_nb_ratio;
 
-	return cpu_freq;
+	return 100 * 1000 * max_nb_ratio;
 }
 
-uint32_t boottime_in_msec(void)
+static uint32_t tsc_khz_from_calibration(void)
+{
+	uint64_t start;
+
+	start = __RDTSC();
+	uefi_call_wrapper(BS->Stall, 1, CALIBRATION_STALL_MS * 1000);
+
+	return DivU64x32(__RDTSC() - start, CALIBRATION_STALL_MS, NULL);
+}
+
+/* The TSC frequency is computed only once: rdmsr is serializing and
+   usually trapped under a hypervisor, and the calibration costs a
+   few milliseconds.  */
+uint32_t get_tsc_khz(void)
 {
-	uint64_t tick;
-	uint32_t bt_us, bt_ms;
-	uint32_t cpu_freq;
+	uint32_t reg[4];
+	BOOLEAN hypervisor;
 
-	cpu_freq = get_cpu_freq();
+	if (tsc_khz)
+		return tsc_khz;
 
-	tick = __RDTSC();
-	bt_us = (((unsigned) (tick >> 6)) / cpu_freq) << 6;
-	bt_ms = bt_us / 1000;
+	cpuid(CPUID_FEATURES_LEAF, reg);
+	hypervisor = !!(reg[2] & CPUID_HYPERVISOR_PRESENT);
+
+	tsc_khz = tsc_khz_from_cpuid(hypervisor);
+	if (!tsc_khz && !hypervisor && is_intel_cpu())
+		tsc_khz = tsc_khz_from_msr();
+	if (!tsc_khz)
+		tsc_khz = tsc_khz_from_calibration();
+	if (!tsc_khz)
+		tsc_khz = 1;
+
+	return tsc_khz;
+}
 
-	return bt_ms;
+uint32_t get_cpu_freq(void)
+{
+	return get_tsc_khz() / 1000;
+}
+
+uint64_t get_tsc_ticks(void)
+{
+	return __RDTSC();
+}
+
+uint64_t tsc_ticks_to_usec(uint64_t ticks)
+{
+	return DivU64x32(MultU64x32(ticks, 1000), get_tsc_khz(), NULL);
+}
+
+uint64_t boottime_in_usec(void)
+{
+	return tsc_ticks_to_usec(__RDTSC());
+}
+
+uint32_t boottime_in_msec(void)
+{
+	return DivU64x32(__RDTSC(), get_tsc_khz(), NULL);
 }
 
 void set_boottime_stamp(int num)
@@ -111,6 +211,7 @@ void set_boottime_stamp(int num)
 		return;
 
 	bt_stamp[num] = boottime_in_msec();
+	TRACE_INSTANT(TRACE_BOOT_STAGE, num);
 }
 
 void set_efi_enter_point(unsigned int value)
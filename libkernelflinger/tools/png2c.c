@@ -47,6 +47,19 @@
 
 static char *program_name;
 
+enum encoding {
+	ENCODING_NONE,
+	ENCODING_RAW,
+	ENCODING_RLE
+};
+
+/* RLE control byte: the high bit selects a run of one repeated pixel,
+ * otherwise a literal sequence of pixels follows.  The low 7 bits hold
+ * the pixel count minus one. */
+#define RLE_RUN_FLAG	0x80
+#define RLE_MAX_COUNT	128
+#define PIXEL_SIZE	4
+
 static void usage(int status)
 {
 	printf("Usage: %s -i FILE -o FILE -f FORMAT -p NAME\n",
@@ -57,6 +70,9 @@ Transform PNG file to C source data structure.\n\
   -i, --input-file=FILE         write data into FILE instead of printing it\n\
   -f, --output-format=FORMAT    allowed values are: RGBA, BGRA, GRAY\n\
   -p, --prefix=NAME             prefix name for C content\n\
+  -e, --encoding=ENCODING       emit a pre-decoded image resource with its\n\
+                                dimensions, allowed values are: RAW, RLE.\n\
+                                Requires a 4 channels output format\n\
   -h, --help                    display this help\n\
 ");
 	exit(status);
@@ -71,7 +87,8 @@ static void error(const char *s)
 static const unsigned int LINE_LENGTH = 80;
 
 static void write_to_c_source(const char *name, png_bytep buffer,
-			     unsigned int size, const char *path)
+			     unsigned int size, const char *path,
+			     png_imagep image, enum encoding encoding)
 {
 	unsigned int i, col;
 	const unsigned int item_len = strlen("0x00, ");
@@ -87,7 +104,14 @@ static void write_to_c_source(const char *name, png_bytep buffer,
 			error("Failed to create output file.");
 	}
 
-	fprintf(f, "unsigned char %s_dat[] = {", name);
+	if (encoding == ENCODING_NONE)
+		fprintf(f, "unsigned char %s_dat[] = {", name);
+	else {
+		fprintf(f, "#define %s_width %u\n", name, image->width);
+		fprintf(f, "#define %s_height %u\n", name, image->height);
+		fprintf(f, "const unsigned char %s_dat[] __attribute__((aligned(%d))) = {",
+			name, PIXEL_SIZE);
+	}
 	for (i = 0, col = 2; i < size; i++, col += item_len, buffer++) {
 		if (col >= LINE_LENGTH - item_len)
 			col = 2;
@@ -100,6 +124,73 @@ static void write_to_c_source(const char *name, png_bytep buffer,
 		fclose(f);
 }
 
+static png_bytep emit_pixels(png_bytep out, png_bytep pixels,
+			     unsigned int nb)
+{
+	memcpy(out, pixels, nb * PIXEL_SIZE);
+	return out + nb * PIXEL_SIZE;
+}
+
+/* Encode a 4 bytes per pixel buffer using the RLE scheme described
+ * along the RLE_RUN_FLAG definition.  The output buffer must be able
+ * to hold the worst case which is one control byte every
+ * RLE_MAX_COUNT pixels. */
+static unsigned int rle_encode(png_bytep pixels, unsigned int nb_pixels,
+			       png_bytep out)
+{
+	png_bytep start = out;
+	unsigned int i = 0, run, len;
+
+#define PIXEL(x) (pixels + (x) * PIXEL_SIZE)
+#define SAME_PIXEL(a, b) (!memcmp(PIXEL(a), PIXEL(b), PIXEL_SIZE))
+
+	while (i < nb_pixels) {
+		for (run = 1; i + run < nb_pixels && run < RLE_MAX_COUNT; run++)
+			if (!SAME_PIXEL(i, i + run))
+				break;
+
+		if (run > 1) {
+			*out++ = RLE_RUN_FLAG | (run - 1);
+			out = emit_pixels(out, PIXEL(i), 1);
+			i += run;
+			continue;
+		}
+
+		for (len = 1; i + len < nb_pixels && len < RLE_MAX_COUNT; len++)
+			if (i + len + 1 < nb_pixels &&
+			    SAME_PIXEL(i + len, i + len + 1))
+				break;
+
+		*out++ = len - 1;
+		out = emit_pixels(out, PIXEL(i), len);
+		i += len;
+	}
+
+#undef SAME_PIXEL
+#undef PIXEL
+
+	return out - start;
+}
+
+static enum encoding get_encoding_from_string(const char *str)
+{
+	static struct str_to_encoding {
+		const char *str;
+		enum encoding encoding;
+	} encodings[] = {
+		{ "RAW", ENCODING_RAW },
+		{ "RLE", ENCODING_RLE }
+	};
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(encodings); i++)
+		if (!strcmp(str, encodings[i].str))
+			return encodings[i].encoding;
+
+	usage(EXIT_FAILURE);
+	return ENCODING_NONE;
+}
+
 static png_uint_32 get_format_from_string(const char *str)
 {
 	static struct str_to_format {
@@ -125,6 +216,7 @@ static struct option const long_options[] = {
 	{"output-file", required_argument, NULL, 'o'},
 	{"output-format", required_argument, NULL, 'f'},
 	{"prefix", required_argument, NULL, 'p'},
+	{"encoding", required_argument, NULL, 'e'},
 	{"help", no_argument, NULL, 'h'},
 	{NULL, 0, NULL, 0}
 };
@@ -132,8 +224,9 @@ static struct option const long_options[] = {
 int main(int argc, char **argv)
 {
 	png_image image;
-	png_bytep buffer;
-	unsigned int size;
+	png_bytep buffer, rle = NULL;
+	unsigned int size, nb_pixels;
+	enum encoding encoding = ENCODING_NONE;
 	bool format_initialized = false;
 	png_uint_32 format = 0;
 	const char *ipath = NULL;
@@ -143,7 +236,7 @@ int main(int argc, char **argv)
 
 	program_name = argv[0];
 
-	while ((c = getopt_long(argc, argv, "i:o:f:p:h", long_options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "i:o:f:p:e:h", long_options, NULL)) != -1) {
 		switch (c) {
 		case 'i':
 			ipath = optarg;
@@ -154,6 +247,9 @@ int main(int argc, char **argv)
 		case 'p':
 			prefix = optarg;
 			break;
+		case 'e':
+			encoding = get_encoding_from_string(optarg);
+			break;
 		case 'f':
 			format = get_format_from_string(optarg);
 			format_initialized = true;
@@ -170,6 +266,10 @@ int main(int argc, char **argv)
 	if (!format_initialized || !opath || !ipath || !prefix)
 		usage(EXIT_FAILURE);
 
+	if (encoding != ENCODING_NONE &&
+	    PNG_IMAGE_PIXEL_SIZE(format) != PIXEL_SIZE)
+		usage(EXIT_FAILURE);
+
 	memset(&image, 0, sizeof(image));
 	image.version = PNG_IMAGE_VERSION;
 
@@ -186,10 +286,21 @@ int main(int argc, char **argv)
 	if (!png_image_finish_read(&image, NULL, buffer, 0, NULL))
 		error("Failed to read  PNG file.");
 
-	write_to_c_source(prefix, buffer, size, opath);
+	if (encoding == ENCODING_RLE) {
+		nb_pixels = image.width * image.height;
+		rle = malloc(size + (nb_pixels + RLE_MAX_COUNT - 1) / RLE_MAX_COUNT);
+		if (!rle)
+			error("Failed to allocate RLE buffer.");
+
+		write_to_c_source(prefix, rle,
+				  rle_encode(buffer, nb_pixels, rle),
+				  opath, &image, encoding);
+	} else
+		write_to_c_source(prefix, buffer, size, opath, &image, encoding);
 
 	png_image_free(&image);
 	free(buffer);
+	free(rle);
 
 	return EXIT_SUCCESS;
 }
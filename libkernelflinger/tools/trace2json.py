@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2019, Intel Corporation
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+#
+#    * Redistributions of source code must retain the above copyright
+#      notice, this list of conditions and the following disclaimer.
+#    * Redistributions in binary form must reproduce the above copyright
+#      notice, this list of conditions and the following disclaimer
+#      in the documentation and/or other materials provided with the
+#      distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+# "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+# LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+# FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+# COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+# INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+# STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+# OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+
+"""Convert a kernelflinger binary boot trace into the Chrome trace
+event JSON format, which chrome://tracing and Perfetto can load.
+
+The binary trace is either pulled in crashmode with 'adb pull trace'
+or read from the KernelflingerTrace EFI variable.  The layout is
+described in include/libkernelflinger/trace.h."""
+
+import json
+import struct
+import sys
+
+TRACE_MAGIC = 0x5254464b
+HEADER = struct.Struct('<IHHIIII')
+EVENT = struct.Struct('<QIHH')
+PHASES = {0: 'B', 1: 'E', 2: 'i'}
+
+# efivarfs prepends the variable attributes to the content.
+EFIVARFS_ATTRIBUTES_SIZE = 4
+
+
+def parse(data):
+    if len(data) >= EFIVARFS_ATTRIBUTES_SIZE + HEADER.size and \
+       struct.unpack_from('<I', data)[0] != TRACE_MAGIC:
+        data = data[EFIVARFS_ATTRIBUTES_SIZE:]
+
+    magic, version, name_len, tsc_khz, nb_ids, nb_events, dropped = \
+        HEADER.unpack_from(data)
+    if magic != TRACE_MAGIC:
+        raise ValueError('not a kernelflinger boot trace')
+    if version != 1:
+        raise ValueError('unsupported trace version %d' % version)
+
+    offset = HEADER.size
+    names = []
+    for _ in range(nb_ids):
+        raw = data[offset:offset + name_len]
+        names.append(raw.split(b'\0', 1)[0].decode('ascii'))
+        offset += name_len
+
+    events = []
+    for _ in range(nb_events):
+        tsc, arg, event_id, event_type = EVENT.unpack_from(data, offset)
+        offset += EVENT.size
+        name = names[event_id] if event_id < len(names) else str(event_id)
+        event = {
+            'name': name,
+            'ph': PHASES.get(event_type, 'i'),
+            'ts': tsc * 1000.0 / tsc_khz,
+            'pid': 0,
+            'tid': 0,
+            'args': {'arg': arg},
+        }
+        if event['ph'] == 'i':
+            event['s'] = 'g'
+        events.append(event)
+
+    return {
+        'traceEvents': events,
+        'displayTimeUnit': 'ms',
+        'otherData': {'tsc_khz': tsc_khz, 'dropped': dropped},
+    }
+
+
+def main(argv):
+    if len(argv) not in (2, 3):
+        sys.stderr.write('Usage: %s TRACE_FILE [JSON_FILE]\n' % argv[0])
+        return 1
+
+    with open(argv[1], 'rb') as f:
+        trace = parse(f.read())
+
+    if len(argv) == 3:
+        with open(argv[2], 'w') as f:
+            json.dump(trace, f, indent=1)
+    else:
+        json.dump(trace, sys.stdout, indent=1)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+#include <vars.h>
+
+#include "timer.h"
+#include "trace.h"
+
+/* Must be a power of two. */
+#define TRACE_MAX_EVENTS	4096
+#define TRACE_VAR_MAX_SIZE	(16 * 1024)
+
+static struct trace_event events[TRACE_MAX_EVENTS];
+static UINT32 count;
+
+static const CHAR8 trace_names[TRACE_ID_LAST][TRACE_NAME_LEN] = {
+	[TRACE_BOOT_STAGE]	= "boot_stage",
+	[TRACE_GPT_LOOKUP]	= "gpt_lookup",
+	[TRACE_READ_DISK]	= "read_disk",
+	[TRACE_AVB_VERIFY]	= "avb_verify",
+	[TRACE_RSA_VERIFY]	= "rsa_verify",
+	[TRACE_TRUSTY_LOAD]	= "trusty_load",
+	[TRACE_ACPI_INSTALL]	= "acpi_install"
+};
+
+void trace_event(enum trace_event_id id, enum trace_event_type type, UINT32 arg)
+{
+	struct trace_event *event;
+
+	event = &events[count++ & (TRACE_MAX_EVENTS - 1)];
+	event->tsc = __RDTSC();
+	event->arg = arg;
+	event->id = id;
+	event->type = type;
+}
+
+EFI_STATUS trace_export(void **buf, UINTN *size, UINTN max_size)
+{
+	struct trace_header *header;
+	struct trace_event *out;
+	UINTN header_size, nb, i;
+
+	if (!buf || !size)
+		return EFI_INVALID_PARAMETER;
+
+	header_size = sizeof(*header) + sizeof(trace_names);
+	if (max_size < header_size)
+		return EFI_BUFFER_TOO_SMALL;
+
+	nb = min((UINTN)count, (UINTN)TRACE_MAX_EVENTS);
+	nb = min(nb, (max_size - header_size) / sizeof(*out));
+
+	*size = header_size + nb * sizeof(*out);
+	header = AllocatePool(*size);
+	if (!header)
+		return EFI_OUT_OF_RESOURCES;
+
+	header->magic = TRACE_MAGIC;
+	header->version = TRACE_VERSION;
+	header->name_len = TRACE_NAME_LEN;
+	header->tsc_khz = get_tsc_khz();
+	header->nb_ids = TRACE_ID_LAST;
+	header->nb_events = nb;
+	header->dropped = count - nb;
+	memcpy(header + 1, trace_names, sizeof(trace_names));
+
+	out = (struct trace_event *)((CHAR8 *)(header + 1) + sizeof(trace_names));
+	for (i = 0; i < nb; i++)
+		out[i] = events[(count - nb + i) & (TRACE_MAX_EVENTS - 1)];
+
+	*buf = header;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS trace_save_to_var(void)
+{
+	EFI_STATUS ret;
+	void *buf;
+	UINTN size;
+
+	if (!count)
+		return EFI_SUCCESS;
+
+	ret = trace_export(&buf, &size, TRACE_VAR_MAX_SIZE);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = set_efi_variable(&loader_guid, TRACE_VAR, size, buf, FALSE, TRUE);
+	FreePool(buf);
+
+	return ret;
+}
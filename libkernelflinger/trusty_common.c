@@ -43,6 +43,7 @@
 #include "targets.h"
 #include "gpt.h"
 #include "efilinux.h"
+#include "trace.h"
 
 #ifdef USE_AVB
 EFI_STATUS load_tos_image(OUT VOID **bootimage)
@@ -52,6 +53,7 @@ EFI_STATUS load_tos_image(OUT VOID **bootimage)
         UINT8 verify_state_new;
         AvbSlotVerifyData *slot_data;
         BOOLEAN b_secureboot = is_platform_secure_boot_enabled();
+        TRACE_SCOPE(TRACE_TRUSTY_LOAD, 0);
 
         if (!b_secureboot)
                 verify_state = BOOT_STATE_ORANGE;
@@ -137,8 +139,10 @@ static EFI_STATUS tos_image_load_partition(IN const CHAR16 *label, OUT VOID **im
         }
 
         debug(L"Reading Tos image: %d bytes", img_size);
+        TRACE_BEGIN(TRACE_READ_DISK, img_size >> 10);
         ret = uefi_call_wrapper(gpart.dio->ReadDisk, 5, gpart.dio, MediaId, partition_start,
                                 img_size, bootimg);
+        TRACE_END(TRACE_READ_DISK, img_size >> 10);
         if (EFI_ERROR(ret)) {
                 efi_perror(ret, L"ReadDisk Error for TOS image read");
                 FreePool(bootimg);
@@ -153,6 +157,7 @@ EFI_STATUS load_tos_image(OUT VOID **bootimage)
         CHAR16 target[BOOT_TARGET_SIZE];
         EFI_STATUS ret;
         UINT8 verify_state;
+        TRACE_SCOPE(TRACE_TRUSTY_LOAD, 0);
 
         ret = tos_image_load_partition(TOS_LABEL, bootimage);
         if (EFI_ERROR(ret)) {
@@ -552,6 +552,7 @@ EFI_STATUS uefi_enter_binary(EFI_HANDLE part_handle, CHAR16 *path,
 		loaded_image->LoadOptionsSize = load_options_size;
 		loaded_image->LoadOptions = load_options;
 	}
+	log_exit();
 	ret = uefi_call_wrapper(BS->StartImage, 3, image, NULL, NULL);
 
 out:
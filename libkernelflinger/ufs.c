@@ -52,20 +52,69 @@ static EFI_DEVICE_PATH *get_ufs_device_path(EFI_DEVICE_PATH *p)
 	return NULL;
 }
 
+/* Read the UNMAP limits from the Block Limits VPD page.  The
+ * previous behaviour, a single descriptor without LBA count limit,
+ * is kept if the device does not report them.  A maximum LBA count
+ * of UFS_UNMAP_NO_LIMIT means that the UNMAP command is only limited
+ * by the 32-bit count of each of its descriptors.
+ */
+static void ufs_get_unmap_limits(EFI_EXT_SCSI_PASS_THRU_PROTOCOL *scsi,
+				 UINT8 *target, UINT64 lun,
+				 UINT64 *max_lba_count, UINT32 *max_desc_count)
+{
+	EFI_STATUS ret;
+	EFI_EXT_SCSI_PASS_THRU_SCSI_REQUEST_PACKET scsi_req;
+	struct command_descriptor_block_inquiry cdb;
+	struct vpd_block_limits limits;
+
+	*max_lba_count = (UINT64)-1;
+	*max_desc_count = 1;
+
+	ZeroMem(&scsi_req, sizeof(scsi_req));
+	ZeroMem(&cdb, sizeof(cdb));
+	ZeroMem(&limits, sizeof(limits));
+
+	cdb.op_code = UFS_INQUIRY;
+	cdb.evpd = 1;
+	cdb.page_code = UFS_VPD_BLOCK_LIMITS;
+	cdb.allocation_length = htobe16(sizeof(limits));
+
+	scsi_req.Timeout = BLOCK_TIMEOUT;
+	scsi_req.InDataBuffer = &limits;
+	scsi_req.InTransferLength = sizeof(limits);
+	scsi_req.Cdb = &cdb;
+	scsi_req.CdbLength = sizeof(cdb);
+	scsi_req.DataDirection = EFI_EXT_SCSI_DATA_DIRECTION_READ;
+
+	ret = uefi_call_wrapper(scsi->PassThru, 5, scsi, target, lun, &scsi_req, NULL);
+	if (EFI_ERROR(ret) || limits.page_code != UFS_VPD_BLOCK_LIMITS) {
+		debug(L"Block Limits VPD page not available");
+		return;
+	}
+
+	if (be32toh(limits.max_unmap_lba_count) &&
+	    be32toh(limits.max_unmap_lba_count) != UFS_UNMAP_NO_LIMIT)
+		*max_lba_count = be32toh(limits.max_unmap_lba_count);
+	if (be32toh(limits.max_unmap_block_desc_count))
+		*max_desc_count = min(be32toh(limits.max_unmap_block_desc_count),
+				      (UINT32)UFS_UNMAP_MAX_DESCRIPTORS);
+}
+
 static EFI_STATUS ufs_erase_blocks(EFI_HANDLE handle, __attribute__((unused)) EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end)
 {
 	EFI_STATUS ret;
 	EFI_GUID ScsiPassThruProtocolGuid = EFI_EXT_SCSI_PASS_THRU_PROTOCOL_GUID;
 	EFI_EXT_SCSI_PASS_THRU_PROTOCOL *scsi;
 	EFI_EXT_SCSI_PASS_THRU_SCSI_REQUEST_PACKET scsi_req;
-	struct unmap_parameter unmap;
+	struct unmap_parameter_list unmap;
 	struct command_descriptor_block_unmap cdb;
 	EFI_HANDLE scsi_handle;
 	EFI_DEVICE_PATH *dp = DevicePathFromHandle(handle);
 	EFI_DEVICE_PATH *scsi_dp = dp;
 	UINT8 target_bytes[TARGET_MAX_BYTES];
 	UINT8 *target = target_bytes;
-	UINT64 lun;
+	UINT64 lun, cmd_count, max_lba_count;
+	UINT32 max_desc_count, count, nr, param_length;
 
 	if (!dp) {
 		error(L"Failed to get device path from handle");
@@ -97,26 +146,50 @@ static EFI_STATUS ufs_erase_blocks(EFI_HANDLE handle, __attribute__((unused)) EF
 		return ret;
 	}
 
-	ZeroMem(&scsi_req, sizeof(scsi_req));
-	ZeroMem(&unmap, sizeof(unmap));
-	ZeroMem(&cdb, sizeof(cdb));
-
-	cdb.op_code = UFS_UNMAP;
-	cdb.param_length = htobe16(sizeof(unmap));
-
-	unmap.data_length = htobe16(sizeof(unmap) - sizeof(unmap.data_length));
-	unmap.block_desc_length = htobe16(sizeof(unmap.block_desc));
-	unmap.block_desc.lba = htobe64(start);
-	unmap.block_desc.count = htobe32(end - start + 1);
+	ufs_get_unmap_limits(scsi, target, lun, &max_lba_count, &max_desc_count);
 
-	scsi_req.Timeout = BLOCK_TIMEOUT * (end - start + 1);
-	scsi_req.OutDataBuffer = &unmap;
-	scsi_req.Cdb = &cdb;
-	scsi_req.OutTransferLength = sizeof(unmap);
-	scsi_req.CdbLength = sizeof(cdb);
-	scsi_req.DataDirection = EFI_EXT_SCSI_DATA_DIRECTION_WRITE;
+	/* Pack as many descriptors as the device accepts in each
+	 * UNMAP command, within its LBA count limit.  A range larger
+	 * than the 32-bit count of a descriptor is split over several
+	 * descriptors of the same command.
+	 */
+	while (start <= end) {
+		ZeroMem(&scsi_req, sizeof(scsi_req));
+		ZeroMem(&unmap, sizeof(unmap));
+		ZeroMem(&cdb, sizeof(cdb));
+
+		cmd_count = 0;
+		for (nr = 0; nr < max_desc_count && start <= end &&
+			     cmd_count < max_lba_count; nr++) {
+			count = min(min(end - start + 1, max_lba_count - cmd_count),
+				    (UINT64)UFS_UNMAP_NO_LIMIT);
+			unmap.block_desc[nr].lba = htobe64(start);
+			unmap.block_desc[nr].count = htobe32(count);
+			cmd_count += count;
+			start += count;
+		}
+
+		param_length = offsetof(struct unmap_parameter_list, block_desc) +
+			nr * sizeof(unmap.block_desc[0]);
+
+		cdb.op_code = UFS_UNMAP;
+		cdb.param_length = htobe16(param_length);
+
+		unmap.data_length = htobe16(param_length - sizeof(unmap.data_length));
+		unmap.block_desc_length = htobe16(nr * sizeof(unmap.block_desc[0]));
+
+		scsi_req.Timeout = BLOCK_TIMEOUT * cmd_count;
+		scsi_req.OutDataBuffer = &unmap;
+		scsi_req.Cdb = &cdb;
+		scsi_req.OutTransferLength = param_length;
+		scsi_req.CdbLength = sizeof(cdb);
+		scsi_req.DataDirection = EFI_EXT_SCSI_DATA_DIRECTION_WRITE;
+
+		ret = uefi_call_wrapper(scsi->PassThru, 5, scsi, target, lun, &scsi_req, NULL);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
 
-	ret = uefi_call_wrapper(scsi->PassThru, 5, scsi, target, lun, &scsi_req, NULL);
 	return ret;
 }
 
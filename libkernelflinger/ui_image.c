@@ -40,6 +40,59 @@
 
 #include "res/img_res.h"
 
+/* RLE control byte, see png2c: the high bit selects a run of one
+ * repeated pixel, otherwise a literal sequence of pixels follows.
+ * The low 7 bits hold the pixel count minus one. */
+#define RLE_RUN_FLAG	0x80
+#define RLE_COUNT_MASK	0x7f
+
+static EFI_STATUS rle_load(const UINT8 *data, UINTN size,
+			   EFI_GRAPHICS_OUTPUT_BLT_PIXEL **blt,
+			   UINTN width, UINTN height)
+{
+	EFI_GRAPHICS_OUTPUT_BLT_PIXEL *out, *end, pixel;
+	const UINT8 *data_end = data + size;
+	UINTN count, i;
+	UINT8 ctrl;
+
+	out = AllocatePool(ui_get_blt_size(width, height));
+	if (!out)
+		return EFI_OUT_OF_RESOURCES;
+
+	*blt = out;
+	end = out + width * height;
+	while (data < data_end) {
+		ctrl = *data++;
+		count = (ctrl & RLE_COUNT_MASK) + 1;
+		if ((UINTN)(end - out) < count)
+			goto err;
+
+		if (ctrl & RLE_RUN_FLAG) {
+			if ((UINTN)(data_end - data) < sizeof(pixel))
+				goto err;
+			memcpy(&pixel, data, sizeof(pixel));
+			data += sizeof(pixel);
+			for (i = 0; i < count; i++)
+				*out++ = pixel;
+			continue;
+		}
+
+		if ((UINTN)(data_end - data) < count * sizeof(pixel))
+			goto err;
+		memcpy(out, data, count * sizeof(pixel));
+		data += count * sizeof(pixel);
+		out += count;
+	}
+
+	if (out == end)
+		return EFI_SUCCESS;
+
+err:
+	FreePool(*blt);
+	*blt = NULL;
+	return EFI_INVALID_PARAMETER;
+}
+
 ui_image_t *ui_image_get(const char *name)
 {
 	unsigned int i;
@@ -54,8 +107,18 @@ ui_image_t *ui_image_get(const char *name)
 
 	img = &ui_images[i];
 	if (!img->blt) {
-		ret = upng_load(img->data, img->size,
-				&img->blt, &img->width, &img->height);
+		switch (img->format) {
+		case UI_IMAGE_RLE:
+			ret = rle_load(img->data, img->size, &img->blt,
+				       img->width, img->height);
+			break;
+		case UI_IMAGE_PNG:
+			ret = upng_load(img->data, img->size,
+					&img->blt, &img->width, &img->height);
+			break;
+		default:
+			ret = EFI_UNSUPPORTED;
+		}
 		if (EFI_ERROR(ret))
 			efi_perror(ret, L"Failed to load image %s",
 				   name);
@@ -99,6 +99,7 @@ EFI_STATUS transport_stop(void)
 
 EFI_STATUS transport_run(void)
 {
+	log_drain();
 	return current ? current->run() : EFI_NOT_STARTED;
 }
 
@@ -41,6 +41,10 @@
 #include "unittest.h"
 #include "blobstore.h"
 #include "watchdog.h"
+#include "timer.h"
+#ifndef __LP64__
+#include "pae.h"
+#endif
 
 /*
  * This is the hardware second timeout value
@@ -107,6 +111,169 @@ static VOID test_ux(VOID)
 }
 #endif
 
+#ifndef __LP64__
+/* Measure the mapped bytes per second when the memory above 4G is
+ * walked in 64 KB steps as the crashmode memory dump readers do.
+ */
+#define PAE_STEP (64 * 1024)
+
+static VOID test_pae(VOID)
+{
+        EFI_STATUS ret;
+        UINTN nr_entries, key, entry_sz, i;
+        UINT32 entry_ver;
+        CHAR8 *entries, *cur;
+        EFI_MEMORY_DESCRIPTOR *entry;
+        EFI_PHYSICAL_ADDRESS addr, end;
+        unsigned char *buf;
+        UINT64 len, mapped = 0, start_us, elapsed_us;
+        volatile unsigned char sink;
+
+        entries = (CHAR8 *)LibMemoryMap(&nr_entries, &key, &entry_sz, &entry_ver);
+        if (!entries) {
+                Print(L"Failed to get the memory map, test Failed\n");
+                return;
+        }
+
+        ret = pae_init(entries, nr_entries, entry_sz);
+        if (EFI_ERROR(ret)) {
+                Print(L"pae_init failed: %r, test Failed\n", ret);
+                goto out;
+        }
+
+        start_us = boottime_in_usec();
+        for (i = 0, cur = entries; i < nr_entries; cur += entry_sz, i++) {
+                entry = (EFI_MEMORY_DESCRIPTOR *)cur;
+                addr = entry->PhysicalStart;
+                end = addr + entry->NumberOfPages * EFI_PAGE_SIZE;
+                if (entry->Type != EfiConventionalMemory || end <= 0x100000000ULL)
+                        continue;
+
+                for (addr = max(addr, 0x100000000ULL); addr < end; addr += len) {
+                        len = min(end - addr, (UINT64)PAE_STEP);
+                        ret = pae_map(addr, &buf, &len);
+                        if (EFI_ERROR(ret)) {
+                                Print(L"pae_map failed: %r, test Failed\n", ret);
+                                goto exit;
+                        }
+                        sink = buf[0];
+                        mapped += len;
+                }
+        }
+        elapsed_us = boottime_in_usec() - start_us;
+        (void)sink;
+
+        if (!mapped)
+                Print(L"No memory above 4G\n");
+        else
+                Print(L"%ld MB mapped in %ld us (%ld MB/s)\n", mapped / 1024 / 1024,
+                      elapsed_us, elapsed_us ? mapped / elapsed_us : 0);
+
+exit:
+        pae_exit();
+out:
+        FreePool(entries);
+}
+#endif
+
+/* Check memcpy(), memset() and memcmp() against the gnu-efi
+ * CopyMem(), SetMem() and CompareMem() functions and compare their
+ * throughput for small, medium and large buffers.
+ */
+#define MEM_BENCH_TOTAL (64 * 1024 * 1024)
+
+static UINT64 mem_bench_rate(UINT64 start_us)
+{
+        UINT64 elapsed_us = boottime_in_usec() - start_us;
+
+        return elapsed_us ? (UINT64)MEM_BENCH_TOTAL / elapsed_us : 0;
+}
+
+static VOID test_mem(VOID)
+{
+        static const UINTN SIZES[] = { 64, 4096, 8 * 1024 * 1024 };
+        UINT8 *src, *dst;
+        UINT64 start_us;
+        UINTN i, j, n, size, count;
+        volatile INTN sink = 0;
+
+        src = AllocatePool(SIZES[ARRAY_SIZE(SIZES) - 1] + 1);
+        dst = AllocatePool(SIZES[ARRAY_SIZE(SIZES) - 1] + 1);
+        if (!src || !dst) {
+                Print(L"Failed to allocate the buffers, test Failed\n");
+                goto out;
+        }
+
+        for (i = 0; i < SIZES[ARRAY_SIZE(SIZES) - 1] + 1; i++)
+                src[i] = (UINT8)(i * 7 + 3);
+
+        for (n = 0; n <= 130; n++) {
+                for (i = 0; i < 16; i++) {
+                        SetMem(dst, n + 32, 0);
+                        memcpy(dst + i, src + 1, n);
+                        if (CompareMem(dst + i, src + 1, n) || dst[i + n]) {
+                                Print(L"memcpy of %d bytes at offset %d, test Failed\n", n, i);
+                                goto out;
+                        }
+                        memset(dst + i, 0xA5, n);
+                        for (j = 0; j < n; j++)
+                                if (dst[i + j] != 0xA5)
+                                        break;
+                        if (j != n || dst[i + n]) {
+                                Print(L"memset of %d bytes at offset %d, test Failed\n", n, i);
+                                goto out;
+                        }
+                        memcpy(dst + i, src, n);
+                        if (n)
+                                dst[i + n - 1] ^= 0x80;
+                        if ((memcmp(dst + i, src, n) < 0) != (CompareMem(dst + i, src, n) < 0) ||
+                            (n && !memcmp(dst + i, src, n))) {
+                                Print(L"memcmp of %d bytes at offset %d, test Failed\n", n, i);
+                                goto out;
+                        }
+                }
+        }
+
+        for (i = 0; i < ARRAY_SIZE(SIZES); i++) {
+                size = SIZES[i];
+                count = MEM_BENCH_TOTAL / size;
+
+                start_us = boottime_in_usec();
+                for (j = 0; j < count; j++)
+                        CopyMem(dst, src, size);
+                Print(L"%d bytes: CopyMem %ld MB/s", size, mem_bench_rate(start_us));
+                start_us = boottime_in_usec();
+                for (j = 0; j < count; j++)
+                        memcpy(dst, src, size);
+                Print(L", memcpy %ld MB/s\n", mem_bench_rate(start_us));
+
+                start_us = boottime_in_usec();
+                for (j = 0; j < count; j++)
+                        SetMem(dst, size, (UINT8)j);
+                Print(L"%d bytes: SetMem %ld MB/s", size, mem_bench_rate(start_us));
+                start_us = boottime_in_usec();
+                for (j = 0; j < count; j++)
+                        memset(dst, (UINT8)j, size);
+                Print(L", memset %ld MB/s\n", mem_bench_rate(start_us));
+
+                memcpy(dst, src, size);
+                start_us = boottime_in_usec();
+                for (j = 0; j < count; j++)
+                        sink += CompareMem(dst, src, size);
+                Print(L"%d bytes: CompareMem %ld MB/s", size, mem_bench_rate(start_us));
+                start_us = boottime_in_usec();
+                for (j = 0; j < count; j++)
+                        sink += memcmp(dst, src, size);
+                Print(L", memcmp %ld MB/s\n", mem_bench_rate(start_us));
+        }
+
+out:
+        if (src)
+                FreePool(src);
+        if (dst)
+                FreePool(dst);
+}
+
 static struct test_suite {
         CHAR16 *name;
         VOID (*fun)(VOID);
@@ -114,6 +281,10 @@ static struct test_suite {
 #ifdef USE_UI
         { L"ux", test_ux },
 #endif
+#ifndef __LP64__
+        { L"pae", test_pae },
+#endif
+        { L"mem", test_mem },
         { L"keys", test_keys },
         { L"watchdog", test_watchdog }
 };